@@ -0,0 +1,668 @@
+#!/usr/bin/env python3
+import argparse
+import ast
+import heapq
+import random
+import re
+from collections import deque
+from dataclasses import dataclass, field
+from pathlib import Path
+from typing import Callable
+
+ROOT = Path(__file__).resolve().parent
+
+
+def evaluate_constant(expression: str, constants: dict[str, int | str]) -> int:
+    """Evaluate the integer expression of a constexpr, like `sizeof("$$") - 1 + SerialBus::PAYLOAD_CAPACITY`."""
+    expression = re.sub(r'\b(?:\w+::)+(\w+)', r'\1', expression)
+    expression = re.sub(r'sizeof\("([^"]*)"\)', lambda match: str(len(match.group(1)) + 1), expression)
+    expression = re.sub(r'sizeof\((\w+)\)', lambda match: str(len(constants[match.group(1)]) + 1)  # type: ignore[arg-type]
+                        if isinstance(constants.get(match.group(1)), str) else match.group(0), expression)
+    expression = re.sub(r'\b(\d+)(?:ULL|UL|U|LL|L)\b', r'\1', expression, flags=re.IGNORECASE)
+
+    def evaluate(node: ast.AST) -> int:
+        if isinstance(node, ast.Constant) and isinstance(node.value, int):
+            return node.value
+        if isinstance(node, ast.Name) and isinstance(constants.get(node.id), int):
+            return constants[node.id]  # type: ignore[return-value]
+        if isinstance(node, ast.UnaryOp) and isinstance(node.op, ast.USub):
+            return -evaluate(node.operand)
+        if isinstance(node, ast.BinOp):
+            left, right = evaluate(node.left), evaluate(node.right)
+            if isinstance(node.op, ast.Add):
+                return left + right
+            if isinstance(node.op, ast.Sub):
+                return left - right
+            if isinstance(node.op, ast.Mult):
+                return left * right
+            if isinstance(node.op, (ast.Div, ast.FloorDiv)):
+                return left // right  # unsigned integer division
+        raise ValueError(ast.dump(node))
+
+    return evaluate(ast.parse(expression.replace('/', '//'), mode='eval').body)
+
+
+def read_constants(*paths: str) -> tuple[dict[str, int | str], dict[str, str]]:
+    """Read the constexpr constants of the given firmware sources.
+
+    Returns the values and, for declarations whose value could not be evaluated, their source text.
+    """
+    constants: dict[str, int | str] = {}
+    unreadable: dict[str, str] = {}
+    for path in paths:
+        source = (ROOT / path).read_text()
+        declarations = re.findall(r'constexpr\s+[^=;(){}]*?\b(\w+)\s*(?:\[\])?\s*=\s*([^;]*);', source)
+        if not declarations:
+            raise RuntimeError(f'no constexpr declarations found in {path}, update bus_sim.py')
+        for name, value in declarations:
+            value = ' '.join(value.split())
+            string = re.fullmatch(r'"([^"]*)"', value)
+            try:
+                constants[name] = string.group(1) if string else evaluate_constant(value, constants)
+            except (SyntaxError, ValueError):
+                unreadable[name] = value
+    return constants, unreadable
+
+
+# protocol constants, read from the firmware and otb_update.py so that the model cannot drift from them
+_FIRMWARE, _UNREADABLE = read_constants('main/modules/serial_bus.h', 'main/utils/otb.h', 'main/modules/serial_bus.cpp')
+_OTB_ACK_TIMEOUT = re.search(r'^ACK_TIMEOUT = ([\d.]+)', (ROOT / 'otb_update.py').read_text(), re.MULTILINE)
+if _OTB_ACK_TIMEOUT is None:
+    raise RuntimeError('ACK_TIMEOUT not found in otb_update.py')
+
+
+def firmware_constant(name: str):
+    if name in _UNREADABLE:
+        raise RuntimeError(f'cannot evaluate {name} = {_UNREADABLE[name]} from the firmware sources, update bus_sim.py')
+    if name not in _FIRMWARE:
+        raise RuntimeError(f'{name} not found in the firmware sources, update bus_sim.py')
+    return _FIRMWARE[name]
+
+
+PAYLOAD_CAPACITY = firmware_constant('PAYLOAD_CAPACITY')
+BROADCAST_ID = firmware_constant('BROADCAST_ID')
+POLL_TIMEOUT_US = firmware_constant('POLL_TIMEOUT_MS') * 1000
+MIN_POLL_TIMEOUT_US = firmware_constant('MIN_POLL_TIMEOUT_US')
+MAX_FRAME_SIZE = firmware_constant('MAX_FRAME_SIZE')
+BACKOFF_BASE_US = firmware_constant('BACKOFF_BASE_MS') * 1000
+MAX_BACKOFF_US = firmware_constant('MAX_BACKOFF_MS') * 1000
+INCOMING_RING_SIZE = firmware_constant('INCOMING_RING_SIZE')
+OUTGOING_RING_SIZE = firmware_constant('OUTGOING_RING_SIZE')
+ECHO_CMD = firmware_constant('ECHO_CMD')
+POLL_CMD = firmware_constant('POLL_CMD')
+DONE_CMD = firmware_constant('DONE_CMD')
+DONE_MORE_CMD = firmware_constant('DONE_MORE_CMD')
+BATCH_CMD = firmware_constant('BATCH_CMD')
+OTB_CHUNK_PREFIX = firmware_constant('OTB_CHUNK_PREFIX')
+OTB_CHUNK_SIZE = firmware_constant('BUS_OTB_MAX_CHUNK_SIZE')
+OTB_SEQ_DIGITS = firmware_constant('BUS_OTB_MAX_SEQ_DIGITS')
+OTB_WINDOW = firmware_constant('BUS_OTB_WINDOW')
+OTB_ACK_TIMEOUT_US = int(float(_OTB_ACK_TIMEOUT.group(1)) * 1_000_000)
+
+COMM_PERIOD_US = 1_000  # vTaskDelay(pdMS_TO_TICKS(1)) at CONFIG_FREERTOS_HZ=1000
+MAIN_PERIOD_US = 10_000  # main loop cycle
+
+
+def percentile(values: list[float], p: float) -> float:
+    if not values:
+        return float('nan')
+    values = sorted(values)
+    return values[min(len(values) - 1, int(p / 100 * len(values)))]
+
+
+class Simulation:
+    """Discrete-event scheduler with a time base in microseconds."""
+
+    def __init__(self) -> None:
+        self.now = 0
+        self.events: list[tuple[int, int, Callable[[], None]]] = []
+        self.counter = 0
+
+    def at(self, time: int, callback: Callable[[], None]) -> None:
+        heapq.heappush(self.events, (time, self.counter, callback))
+        self.counter += 1
+
+    def run(self, until: int) -> None:
+        while self.events and self.events[0][0] <= until:
+            self.now, _, callback = heapq.heappop(self.events)
+            callback()
+        self.now = until
+
+
+class MessageRing:
+    """Byte accounting of main/utils/message_ring.h: records never wrap, the skipped end counts as used."""
+
+    def __init__(self, capacity: int) -> None:
+        self.capacity = capacity
+        self.head = 0
+        self.tail = 0
+        self.records: deque[tuple[object, int]] = deque()
+        self.high_water = 0
+
+    @staticmethod
+    def record_size(length: int) -> int:
+        return 4 + (length + 3) // 4 * 4
+
+    def push(self, item: object, length: int) -> bool:
+        size = self.record_size(length)
+        position = self.head % self.capacity
+        skip = self.capacity - position if position + size > self.capacity else 0
+        if self.head - self.tail + skip + size > self.capacity:
+            return False
+        self.head += skip + size
+        self.records.append((item, skip + size))
+        self.high_water = max(self.high_water, self.head - self.tail)
+        return True
+
+    def pop(self) -> object | None:
+        if not self.records:
+            return None
+        item, size = self.records.popleft()
+        self.tail += size
+        return item
+
+    def __bool__(self) -> bool:
+        return bool(self.records)
+
+
+@dataclass
+class Stats:
+    frames: int = 0
+    bytes: int = 0
+    busy_us: int = 0
+    collisions: int = 0
+    lost: int = 0
+    corrupted: int = 0
+    inbound_dropped: int = 0
+    outbound_dropped: int = 0
+    generated: int = 0
+    delivered: int = 0
+    payload_bytes: int = 0
+    latencies: list[float] = field(default_factory=list)
+    otb_bytes: int = 0
+    otb_resends: int = 0
+
+
+@dataclass
+class Transmission:
+    sender: int
+    line: str
+    start: int
+    end: int
+    collided: bool = False
+
+
+class Medium:
+    """Shared half-duplex line (RS-485): every frame reaches all other nodes, overlapping frames are destroyed."""
+
+    def __init__(self, sim: Simulation, stats: Stats, args: argparse.Namespace) -> None:
+        self.sim = sim
+        self.stats = stats
+        self.args = args
+        self.nodes: list['Node'] = []
+        self.transmissions: list[Transmission] = []
+        self.random = random.Random(args.seed)
+
+    def transmit(self, node: 'Node', line: str) -> None:
+        # uart_write_bytes() only queues the bytes, the UART sends them one after another
+        start = max(self.sim.now, node.tx_free_at)
+        end = start + round(len(line) * 10 * 1e6 / self.args.baud)
+        node.tx_free_at = end
+        transmission = Transmission(node.id, line, start, end)
+        self.transmissions = [t for t in self.transmissions if t.end + self.args.latency >= self.sim.now]
+        for other in self.transmissions:
+            if other.sender != node.id and other.start < end and start < other.end:
+                if not other.collided:
+                    self.stats.collisions += 1
+                other.collided = transmission.collided = True
+        self.transmissions.append(transmission)
+        self.stats.frames += 1
+        self.stats.bytes += len(line)
+        self.stats.busy_us += end - start
+        self.sim.at(end + self.args.latency, lambda: self.deliver(transmission))
+
+    def deliver(self, transmission: Transmission) -> None:
+        for node in self.nodes:
+            if node.id == transmission.sender or transmission.collided:
+                continue
+            if self.random.random() < self.args.loss:
+                self.stats.lost += 1
+                continue
+            bits = len(transmission.line) * 10
+            if self.random.random() < 1 - (1 - self.args.ber) ** bits:
+                self.stats.corrupted += 1  # the receiver reports a checksum mismatch
+                continue
+            node.rx_lines.append(transmission.line)
+
+
+@dataclass
+class PeerState:
+    id: int
+    rtt_valid: bool = False
+    srtt_us: float = 0
+    rttvar_us: float = 0
+    failures: int = 0
+    backoff_start: int = 0
+    more_pending: bool = False
+    polls: int = 0
+    timeouts: int = 0
+    rtts: list[float] = field(default_factory=list)
+
+    def timeout_us(self, min_timeout_us: int) -> int:
+        max_timeout_us = max(POLL_TIMEOUT_US, min_timeout_us)
+        if not self.rtt_valid:
+            return max_timeout_us
+        return int(min(max(self.srtt_us + 4 * self.rttvar_us, min_timeout_us), max_timeout_us))
+
+    def is_backing_off(self, now: int) -> bool:
+        if self.failures == 0:
+            return False
+        return now - self.backoff_start < min(BACKOFF_BASE_US << min(self.failures - 1, 5), MAX_BACKOFF_US)
+
+    def update_rtt(self, rtt_us: float) -> None:
+        self.rtts.append(rtt_us)
+        if not self.rtt_valid:
+            self.srtt_us = rtt_us
+            self.rttvar_us = rtt_us / 2
+            self.rtt_valid = True
+        else:
+            self.rttvar_us = 0.75 * self.rttvar_us + 0.25 * abs(self.srtt_us - rtt_us)
+            self.srtt_us = 0.875 * self.srtt_us + 0.125 * rtt_us
+
+
+class Node:
+    """One SerialBus instance: the communication task and the part of the main loop that handles bus messages."""
+
+    def __init__(self, sim: Simulation, medium: Medium, stats: Stats, args: argparse.Namespace, node_id: int) -> None:
+        self.sim = sim
+        self.medium = medium
+        self.stats = stats
+        self.args = args
+        self.id = node_id
+        self.peers: list[PeerState] = []
+        self.min_poll_timeout_us = MAX_FRAME_SIZE * 10 * 1_000_000 // args.baud + MIN_POLL_TIMEOUT_US
+        self.outbound = MessageRing(OUTGOING_RING_SIZE)
+        self.inbound = MessageRing(INCOMING_RING_SIZE)
+        self.rx_lines: deque[str] = deque()
+        self.tx_free_at = 0
+        self.is_polling = False
+        self.awaiting_first_response = False
+        self.poll_activity = 0
+        self.poll_timeout = 0
+        self.poll_index = 0
+        self.round_robin_index = 0
+        self.last_poll_was_priority = False
+        self.requesting_node = 0
+        self.ready_pending = True
+        self.main_hook: Callable[['Node'], None] | None = None
+        self.message_hook: Callable[['Node', int, str], None] | None = None
+        offset = medium.random.randrange(MAIN_PERIOD_US)  # nodes are not synchronized
+        sim.at(offset % COMM_PERIOD_US, self.communication_step)
+        sim.at(offset, self.main_step)
+
+    # communication task
+
+    def communication_step(self) -> None:
+        self.process_uart()
+        if self.peers:
+            if not self.is_polling and not self.send_outgoing_queue():
+                index = self.select_peer()
+                if index >= 0:
+                    peer = self.peers[index]
+                    self.poll_index = index
+                    self.send_message(peer.id, POLL_CMD)
+                    self.poll_activity = self.sim.now
+                    self.poll_timeout = peer.timeout_us(self.min_poll_timeout_us)
+                    self.awaiting_first_response = True
+                    self.is_polling = True
+                    peer.polls += 1
+            if self.awaiting_first_response and self.tx_free_at > self.sim.now:
+                self.poll_activity = self.sim.now
+            if self.is_polling and self.sim.now - self.poll_activity > self.poll_timeout:
+                peer = self.peers[self.poll_index]
+                peer.timeouts += 1
+                peer.more_pending = False
+                peer.failures += 1
+                peer.backoff_start = self.sim.now
+                self.is_polling = False
+        elif self.requesting_node:
+            if self.ready_pending:
+                self.send_message(self.requesting_node, ECHO_CMD + 'Ready.')
+                self.ready_pending = False
+            self.send_poll_response()
+            self.requesting_node = 0
+        self.sim.at(self.sim.now + COMM_PERIOD_US, self.communication_step)
+
+    def send_message(self, receiver: int, payload: str) -> None:
+        self.medium.transmit(self, f'$${self.id}:{receiver}$${payload}@xx\n')
+
+    def send_outgoing_queue(self, max_messages: int | None = None) -> bool:
+        sent = 0
+        while self.outbound and (max_messages is None or sent < max_messages):
+            receiver, payload = self.outbound.pop()
+            self.send_message(receiver, payload)
+            sent += 1
+        return sent > 0
+
+    def send_poll_response(self) -> None:
+        budget = self.args.poll_budget
+        max_messages = budget if budget > 0 else None
+
+        def done_marker() -> str:
+            return DONE_MORE_CMD if self.outbound and budget > 0 else DONE_CMD
+
+        if not self.args.batch:
+            self.send_outgoing_queue(max_messages)
+            self.send_message(self.requesting_node, done_marker())
+            return
+
+        records: list[str] = []
+        batch_receiver = 0
+
+        def flush() -> None:
+            if len(records) == 1:
+                self.send_message(batch_receiver, records[0])
+            elif records:
+                self.send_message(batch_receiver, BATCH_CMD + ''.join(f'{len(r)}:{r}' for r in records))
+            records.clear()
+
+        def append(receiver: int, payload: str) -> None:
+            nonlocal batch_receiver
+            length = len(BATCH_CMD) + sum(len(f'{len(r)}:{r}') for r in records)
+            record = f'{len(payload)}:{payload}'
+            if records and (receiver != batch_receiver or length + len(record) >= PAYLOAD_CAPACITY):
+                flush()
+            if len(BATCH_CMD) + len(record) >= PAYLOAD_CAPACITY:
+                self.send_message(receiver, payload)
+                return
+            records.append(payload)
+            batch_receiver = receiver
+
+        sent = 0
+        while self.outbound and (max_messages is None or sent < max_messages):
+            append(*self.outbound.pop())
+            sent += 1
+        append(self.requesting_node, done_marker())
+        flush()
+
+    def select_peer(self) -> int:
+        count = len(self.peers)
+        if not self.last_poll_was_priority:
+            for k in range(count):
+                index = (self.poll_index + 1 + k) % count
+                if self.peers[index].more_pending and not self.peers[index].is_backing_off(self.sim.now):
+                    self.last_poll_was_priority = True
+                    return index
+        self.last_poll_was_priority = False
+        for k in range(1, count + 1):
+            index = (self.round_robin_index + k) % count
+            if not self.peers[index].is_backing_off(self.sim.now):
+                self.round_robin_index = index
+                return index
+        return -1
+
+    def process_uart(self) -> None:
+        while self.rx_lines:
+            line = self.rx_lines.popleft()[:-4]
+            header, payload = line[2:].split('$$', 1)
+            sender, receiver = (int(part) for part in header.split(':'))
+            if payload.startswith(BATCH_CMD):
+                if receiver not in (self.id, BROADCAST_ID):
+                    continue
+                rest = payload[len(BATCH_CMD):]
+                while rest:
+                    length, rest = rest.split(':', 1)
+                    self.dispatch_message(sender, receiver, rest[:int(length)])
+                    rest = rest[int(length):]
+            else:
+                self.dispatch_message(sender, receiver, payload)
+
+    def dispatch_message(self, sender: int, receiver: int, payload: str) -> None:
+        if receiver == BROADCAST_ID:
+            self.push_incoming(sender, payload)
+            return
+        if receiver != self.id:
+            return
+        if payload == POLL_CMD:
+            self.requesting_node = sender
+            return
+        done = payload in (DONE_CMD, DONE_MORE_CMD)
+        if self.peers and self.is_polling and sender == self.peers[self.poll_index].id:
+            peer = self.peers[self.poll_index]
+            if self.awaiting_first_response:
+                peer.update_rtt(self.sim.now - self.poll_activity)
+                self.awaiting_first_response = False
+            peer.failures = 0
+            self.poll_activity = self.sim.now
+            if done:
+                peer.more_pending = payload == DONE_MORE_CMD
+                self.is_polling = False
+        if not done:
+            self.push_incoming(sender, payload)
+
+    def push_incoming(self, sender: int, payload: str) -> None:
+        if not self.inbound.push((sender, payload), 2 + len(payload) + 1):
+            self.stats.inbound_dropped += 1
+
+    # main task
+
+    def main_step(self) -> None:
+        while self.inbound:
+            sender, payload = self.inbound.pop()
+            if self.message_hook:
+                self.message_hook(self, sender, payload)
+        if self.main_hook:
+            self.main_hook(self)
+        self.sim.at(self.sim.now + MAIN_PERIOD_US, self.main_step)
+
+    def enqueue(self, receiver: int, payload: str) -> bool:
+        if not self.outbound.push((receiver, payload), 1 + len(payload)):
+            self.stats.outbound_dropped += 1
+            return False
+        return True
+
+
+class Traffic:
+    """Generates messages with IDs to measure their delivery latency."""
+
+    def __init__(self, sim: Simulation, stats: Stats, args: argparse.Namespace) -> None:
+        self.sim = sim
+        self.stats = stats
+        self.args = args
+        self.sent: dict[int, int] = {}
+        self.next_id = 0
+        self.due: dict[int, float] = {}
+
+    def payload(self, prefix: str) -> tuple[int, str]:
+        self.next_id += 1
+        text = f'{prefix}m{self.next_id} '
+        return self.next_id, text + 'x' * max(0, self.args.length - len(text))
+
+    def tick(self, node_id: int) -> int:
+        """Number of messages a node should generate in this main loop cycle."""
+        self.due[node_id] = self.due.get(node_id, 0.0) + self.args.rate * MAIN_PERIOD_US / 1e6
+        count = int(self.due[node_id])
+        self.due[node_id] -= count
+        return count
+
+    def generate(self, node: Node, receiver: int, prefix: str) -> None:
+        message_id, payload = self.payload(prefix)
+        self.stats.generated += 1
+        if node.enqueue(receiver, payload):
+            self.sent[message_id] = self.sim.now
+
+    def receive(self, payload: str) -> None:
+        token = payload.split(' ', 1)[0]
+        message_id = int(token[1:]) if token[:1] == 'm' and token[1:].isdigit() else None
+        if message_id in self.sent:
+            self.stats.delivered += 1
+            self.stats.payload_bytes += len(payload)
+            self.stats.latencies.append(self.sim.now - self.sent.pop(message_id))
+
+
+def setup_echo(coordinator: Node, peers: list[Node], traffic: Traffic) -> None:
+    """Peers relay output lines to the coordinator (like command output or !! property updates)."""
+    def peer_main(node: Node) -> None:
+        for _ in range(traffic.tick(node.id)):
+            traffic.generate(node, coordinator.id, ECHO_CMD)
+
+    for peer in peers:
+        peer.main_hook = peer_main
+    coordinator.message_hook = lambda node, sender, payload: traffic.receive(payload[len(ECHO_CMD):]) \
+        if payload.startswith(ECHO_CMD) else None
+
+
+def setup_send(coordinator: Node, peers: list[Node], traffic: Traffic) -> None:
+    """The coordinator sends commands with bus.send, each peer answers with one line of output."""
+    def coordinator_main(node: Node) -> None:
+        for peer in peers:
+            for _ in range(traffic.tick(peer.id)):
+                traffic.generate(node, peer.id, '')
+
+    def peer_message(node: Node, sender: int, payload: str) -> None:
+        if not payload.startswith('__'):
+            node.enqueue(sender, ECHO_CMD + payload.split(' ', 1)[0] + ' ok')
+
+    coordinator.main_hook = coordinator_main
+    coordinator.message_hook = lambda node, sender, payload: traffic.receive(payload[len(ECHO_CMD):]) \
+        if payload.startswith(ECHO_CMD) else None
+    for peer in peers:
+        peer.message_hook = peer_message
+
+
+def setup_otb(coordinator: Node, peers: list[Node], traffic: Traffic) -> None:
+    """The coordinator streams firmware chunks to the first peer like otb_update.py (selective repeat, adaptive window)."""
+    target = peers[0].id
+    line_length = len(OTB_CHUNK_PREFIX) + OTB_SEQ_DIGITS + len('__:00000000:') + (OTB_CHUNK_SIZE + 2) // 3 * 4
+    # sender: seq -> (transmission number, time) of chunks in flight, acknowledged chunks, window
+    sender = {'in_flight': {}, 'done': set(), 'base': 0, 'next': 0, 'transmissions': 0, 'recovery_until': 0,
+              'window': 8.0}
+    # target: next chunk to write and chunks buffered after a gap
+    receiver = {'next': 0, 'buffered': set()}
+
+    def send(node: Node, seq: int) -> bool:
+        header = f'{OTB_CHUNK_PREFIX}{seq}__:00000000:'
+        if not node.enqueue(target, header + 'A' * (line_length - len(header))):
+            return False
+        sender['transmissions'] += 1
+        sender['in_flight'][seq] = (sender['transmissions'], traffic.sim.now)
+        return True
+
+    def lost(node: Node, seqs: list[int]) -> None:
+        if any(sender['in_flight'][seq][0] > sender['recovery_until'] for seq in seqs):
+            sender['window'] = max(2.0, sender['window'] / 2)
+            sender['recovery_until'] = sender['transmissions']
+        for seq in sorted(seqs):
+            if send(node, seq):
+                traffic.stats.otb_resends += 1
+
+    def coordinator_main(node: Node) -> None:
+        timed_out = [seq for seq, (_, sent_at) in sender['in_flight'].items()
+                     if traffic.sim.now - sent_at > OTB_ACK_TIMEOUT_US]
+        if timed_out:
+            lost(node, timed_out)
+        while len(sender['in_flight']) < int(sender['window']) and sender['next'] < sender['base'] + OTB_WINDOW:
+            if not send(node, sender['next']):
+                break
+            sender['next'] += 1
+
+    def coordinator_message(node: Node, _: int, payload: str) -> None:
+        if not payload.startswith('__OTB_ACK_CHUNK_'):
+            return
+        written, _, bitmap = payload[len('__OTB_ACK_CHUNK_'):].partition('__')
+        written = int(written)
+        bitmap = int(bitmap.lstrip(':') or '0', 16)
+        in_flight = sender['in_flight']
+        acked = [seq for seq in in_flight if seq <= written or (seq > written + 1 and bitmap >> (seq - written - 2) & 1)]
+        sender['done'].update(range(sender['base'], written + 1))
+        sender['done'].update(acked)
+        latest = max((in_flight.pop(seq)[0] for seq in acked), default=0)
+        sender['window'] = min(float(OTB_WINDOW), sender['window'] + len(acked) / sender['window'])
+        while sender['base'] in sender['done']:
+            sender['done'].discard(sender['base'])
+            sender['base'] += 1
+            traffic.stats.otb_bytes += OTB_CHUNK_SIZE
+        if overtaken := [seq for seq, (number, _) in in_flight.items() if number < latest]:
+            lost(node, overtaken)
+
+    def peer_message(node: Node, source: int, payload: str) -> None:
+        if not payload.startswith(OTB_CHUNK_PREFIX):
+            return
+        seq = int(payload[len(OTB_CHUNK_PREFIX):].split('__', 1)[0])
+        if seq == receiver['next']:
+            receiver['next'] += 1
+            while receiver['next'] in receiver['buffered']:
+                receiver['buffered'].discard(receiver['next'])
+                receiver['next'] += 1
+        elif receiver['next'] < seq < receiver['next'] + OTB_WINDOW:
+            receiver['buffered'].add(seq)
+        if receiver['next'] > 0:
+            bitmap = sum(1 << (seq - receiver['next'] - 1) for seq in receiver['buffered'])
+            suffix = f':{bitmap:x}' if bitmap else ''
+            node.enqueue(source, f'__OTB_ACK_CHUNK_{receiver["next"] - 1}__{suffix}')
+
+    coordinator.main_hook = coordinator_main
+    coordinator.message_hook = coordinator_message
+    for peer in peers:
+        if peer.id == target:
+            peer.message_hook = peer_message
+
+
+PATTERNS = {'echo': setup_echo, 'send': setup_send, 'otb': setup_otb}
+
+
+def report(args: argparse.Namespace, stats: Stats, coordinator: Node, nodes: list[Node]) -> None:
+    duration = args.duration
+    print(f'pattern {args.pattern}, {args.peers} peers ({len(args.dead)} dead), {args.baud} baud, '
+          f'{duration:.1f} s, budget {args.poll_budget}, batching {"on" if args.batch else "off"}')
+    print(f'bus:        {stats.frames} frames, {stats.bytes} bytes, {100 * stats.busy_us / (duration * 1e6):.1f} % busy')
+    print(f'errors:     {stats.collisions} collisions, {stats.lost} lost, {stats.corrupted} corrupted')
+    print(f'drops:      {stats.inbound_dropped} inbound, {stats.outbound_dropped} outbound (ring full)')
+    high_water = max(max(node.inbound.high_water, node.outbound.high_water) for node in nodes)
+    print(f'rings:      high water {high_water} of {max(INCOMING_RING_SIZE, OUTGOING_RING_SIZE)} bytes')
+    if args.pattern == 'otb':
+        print(f'otb:        {stats.otb_bytes / duration:.0f} B/s firmware, {stats.otb_resends} chunks resent')
+    else:
+        print(f'messages:   {stats.delivered} of {stats.generated} delivered, {stats.payload_bytes / duration:.0f} B/s payload')
+        print(f'latency:    p50 {percentile(stats.latencies, 50) / 1000:.1f} ms, '
+              f'p99 {percentile(stats.latencies, 99) / 1000:.1f} ms, max {max(stats.latencies, default=0) / 1000:.1f} ms')
+    print('peer   polls timeouts   rtt p50   rtt p99  timeout')
+    for peer in coordinator.peers:
+        print(f'{peer.id:4d} {peer.polls:7d} {peer.timeouts:8d} {percentile(peer.rtts, 50) / 1000:7.2f} ms '
+              f'{percentile(peer.rtts, 99) / 1000:7.2f} ms {peer.timeout_us(coordinator.min_poll_timeout_us) / 1000:5.1f} ms')
+
+
+def main() -> None:
+    parser = argparse.ArgumentParser(description='Simulate SerialBus coordinator and peers on a shared half-duplex line')
+    parser.add_argument('--pattern', choices=PATTERNS, default='echo', help='Traffic pattern (default: echo)')
+    parser.add_argument('--peers', type=int, default=4, help='Number of peers (default: 4)')
+    parser.add_argument('--dead', type=int, nargs='*', default=[], help='Peer IDs that are configured but do not respond')
+    parser.add_argument('--baud', type=int, default=115200, help='Baud rate (default: 115200)')
+    parser.add_argument('--latency', type=int, default=100,
+                        help='Delay from the end of a frame until the receiver sees it in µs (default: 100)')
+    parser.add_argument('--ber', type=float, default=0.0, help='Bit error rate (default: 0)')
+    parser.add_argument('--loss', type=float, default=0.0, help='Probability that a receiver misses a frame (default: 0)')
+    parser.add_argument('--rate', type=float, default=20.0, help='Messages per second per peer (default: 20)')
+    parser.add_argument('--length', type=int, default=40, help='Payload length of generated messages (default: 40)')
+    parser.add_argument('--poll-budget', type=int, default=0, help='Peer poll_budget property (default: 0)')
+    parser.add_argument('--batch', action='store_true', help='Enable batch_responses on the peers')
+    parser.add_argument('--duration', type=float, default=10.0, help='Simulated time in seconds (default: 10)')
+    parser.add_argument('--seed', type=int, default=0, help='Random seed (default: 0)')
+    args = parser.parse_args()
+
+    sim = Simulation()
+    stats = Stats()
+    medium = Medium(sim, stats, args)
+    coordinator = Node(sim, medium, stats, args, 1)
+    peer_ids = list(range(2, args.peers + 2))
+    coordinator.peers = [PeerState(peer_id) for peer_id in peer_ids + args.dead]
+    peers = [Node(sim, medium, stats, args, peer_id) for peer_id in peer_ids]
+    medium.nodes = [coordinator] + peers
+
+    PATTERNS[args.pattern](coordinator, peers, Traffic(sim, stats, args))
+    sim.run(int(args.duration * 1e6))
+    report(args, stats, coordinator, medium.nodes)
+
+
+if __name__ == '__main__':
+    main()
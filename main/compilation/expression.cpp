@@ -1,4 +1,5 @@
 #include "expression.h"
+#include "../utils/number_format.h"
 #include "../utils/string_utils.h"
 #include <stdexcept>
 
@@ -34,9 +35,9 @@ int Expression::print_to_buffer(char *buffer, size_t buffer_len) const {
     case boolean:
         return csprintf(buffer, buffer_len, "%s", this->evaluate_boolean() ? "true" : "false");
     case integer:
-        return csprintf(buffer, buffer_len, "%lld", this->evaluate_integer());
+        return format_integer(buffer, buffer_len, this->evaluate_integer());
     case number:
-        return csprintf(buffer, buffer_len, "%f", this->evaluate_number());
+        return format_number(buffer, buffer_len, this->evaluate_number());
     case string: {
         char escaped[buffer_len];
         int pos = 0;
@@ -1,4 +1,5 @@
 #include "variable.h"
+#include "../utils/number_format.h"
 #include "../utils/string_utils.h"
 #include "expression.h"
 #include <stdexcept>
@@ -27,9 +28,9 @@ int Variable::print_to_buffer(char *const buffer, size_t buffer_len) const {
     case boolean:
         return csprintf(buffer, buffer_len, "%s", this->boolean_value ? "true" : "false");
     case integer:
-        return csprintf(buffer, buffer_len, "%lld", this->integer_value);
+        return format_integer(buffer, buffer_len, this->integer_value);
     case number:
-        return csprintf(buffer, buffer_len, "%f", this->number_value);
+        return format_number(buffer, buffer_len, this->number_value);
     case string:
         return csprintf(buffer, buffer_len, "\"%s\"", this->string_value.c_str());
     case identifier:
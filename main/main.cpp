@@ -11,6 +11,7 @@
 #include "compilation/variable_assignment.h"
 #include "global.h"
 #include "modules/bluetooth.h"
+#include "modules/can.h"
 #include "modules/core.h"
 #include "modules/expander.h"
 #include "modules/module.h"
@@ -21,11 +22,17 @@
 #include "storage.h"
 #include "utils/bus_backup.h"
 #include "utils/interpreter_lock.h"
+#include "utils/proxy_channel.h"
 #include "utils/scheduler.h"
+#include "utils/telemetry.h"
 #include "utils/tictoc.h"
 #include "utils/timing.h"
 #include "utils/uart.h"
+#include <algorithm>
 #include <chrono>
+#include <cstdarg>
+#include <cstdlib>
+#include <cstring>
 #include <functional>
 #include <memory>
 #include <stdexcept>
@@ -36,6 +43,9 @@
 #include <vector>
 
 #define BUFFER_SIZE 1024
+#define ECHO_BUFFER_SIZE 8192
+#define FRAME_BUFFER_SIZE (telemetry::MAX_PAYLOAD_SIZE + telemetry::MAX_PAYLOAD_SIZE / 254 + 4)
+#define INPUT_BUFFER_SIZE (std::max<size_t>(BUFFER_SIZE, FRAME_BUFFER_SIZE) + 1) // + 1 for the terminator added by strip()
 
 Core_ptr core_module;
 
@@ -314,6 +324,22 @@ void process_tree(owl_tree *const tree, bool from_expander) {
     }
 }
 
+// set while a command with an ID is processed, so that its reply can carry the error
+static bool tracking_command = false;
+static std::string command_error;
+
+static void report_parse_error(const char *format, ...) {
+    static char buffer[256];
+    va_list args;
+    va_start(args, format);
+    std::vsnprintf(buffer, sizeof(buffer), format, args);
+    va_end(args);
+    echo("error: %s", buffer);
+    if (tracking_command) {
+        command_error = buffer;
+    }
+}
+
 void process_lizard(const char *line, bool trigger_keep_alive, bool from_expander) {
     InterpreterLock lock;
     if (trigger_keep_alive) {
@@ -330,30 +356,30 @@ void process_lizard(const char *line, bool trigger_keep_alive, bool from_expande
         toc("Tree creation");
     }
     if (!tree) {
-        echo("error: allocation failure while parsing");
+        report_parse_error("allocation failure while parsing");
         return;
     }
     struct source_range range;
     switch (owl_tree_get_error(tree.get(), &range)) {
     case ERROR_INVALID_FILE:
-        echo("error: invalid file");
+        report_parse_error("invalid file");
         break;
     case ERROR_INVALID_OPTIONS:
-        echo("error: invalid options");
+        report_parse_error("invalid options");
         break;
     case ERROR_INVALID_TOKEN:
-        echo("error: invalid token at range %zu %zu \"%s\"", range.start, range.end,
+        report_parse_error("invalid token at range %zu %zu \"%s\"", range.start, range.end,
              std::string(line, range.start, range.end - range.start).c_str());
         break;
     case ERROR_UNEXPECTED_TOKEN:
-        echo("error: unexpected token at range %zu %zu \"%s\"", range.start, range.end,
+        report_parse_error("unexpected token at range %zu %zu \"%s\"", range.start, range.end,
              std::string(line, range.start, range.end - range.start).c_str());
         break;
     case ERROR_MORE_INPUT_NEEDED:
-        echo("error: more input needed at range %zu %zu", range.start, range.end);
+        report_parse_error("more input needed at range %zu %zu", range.start, range.end);
         break;
     case ERROR_ALLOCATION_FAILURE:
-        echo("error: allocation failure while parsing");
+        report_parse_error("allocation failure while parsing");
         break;
     case ERROR_NONE:
         if (debug) {
@@ -367,14 +393,18 @@ void process_lizard(const char *line, bool trigger_keep_alive, bool from_expande
         break;
     default:
         // owl's accessors exit() on a failed tree (aborting on ESP-IDF), so never let an error reach process_tree.
-        echo("error: unknown parse error");
+        report_parse_error("unknown parse error");
         break;
     }
 }
 
+static void process_tracked_line(const char *line, const int len);
+
 void process_line(const char *line, const int len) {
     InterpreterLock lock;
-    if (len >= 2 && line[0] == '!') {
+    if (len >= 2 && line[0] == '~') {
+        process_tracked_line(line, len);
+    } else if (len >= 2 && line[0] == '!') {
         switch (line[1]) {
         case '+':
             Storage::append_to_startup(line + 2);
@@ -402,14 +432,177 @@ void process_line(const char *line, const int len) {
     }
 }
 
+static void send_command_reply(const uint8_t type, const uint16_t sequence, const uint8_t status) {
+    telemetry::Packet packet(type);
+    packet.put_u16(sequence);
+    packet.put_u8(status);
+    packet.send();
+}
+
+// "~<id> <statement>" is answered with "~<id> ok <duration>" or "~<id> error <duration> <message>" (duration in µs)
+static void process_tracked_line(const char *line, const int len) {
+    char *statement;
+    const unsigned long id = std::strtoul(line + 1, &statement, 10);
+    if (statement == line + 1 || (*statement != ' ' && *statement != '\0')) {
+        throw std::runtime_error("invalid command ID");
+    }
+    while (*statement == ' ') {
+        statement++;
+    }
+    if (tracking_command) {
+        throw std::runtime_error("command IDs cannot be nested");
+    }
+    tracking_command = true;
+    command_error.clear();
+    const unsigned long start = micros();
+    try {
+        process_line(statement, len - (statement - line));
+    } catch (const std::runtime_error &e) {
+        command_error = e.what();
+    }
+    tracking_command = false;
+    const unsigned long duration = micros_since(start);
+    if (command_error.empty()) {
+        echo("~%lu ok %lu", id, duration);
+    } else {
+        echo("~%lu error %lu %s", id, duration, command_error.c_str());
+    }
+}
+
+static bool in_command_session = false;
+static uint16_t last_command_sequence = 0;
+
+static void process_frame(const uint8_t *frame, const size_t length) {
+    static uint8_t payload[FRAME_BUFFER_SIZE];
+
+    // COBS decoding never grows the data, so the payload buffer is large enough
+    const size_t payload_len = telemetry::cobs_decode(frame, length, payload);
+    if (payload_len >= 3 && payload[0] == telemetry::PACKET_PROXY_UPDATE) {
+        // property writes from the core if this is an expander; unacknowledged like the text lines they replace
+        const uint16_t crc = payload[payload_len - 2] | payload[payload_len - 1] << 8;
+        if (telemetry::crc16(payload, payload_len - 2) != crc) {
+            echo("warning: CRC mismatch in proxy update");
+            return;
+        }
+        InterpreterLock lock;
+        proxy_channel::handle_update(&payload[1], payload_len - 3);
+        return;
+    }
+    if (payload_len < 6 || payload[0] != telemetry::PACKET_COMMAND) {
+        send_command_reply(telemetry::PACKET_NACK, last_command_sequence + 1, telemetry::NACK_INVALID);
+        return;
+    }
+    const size_t text_len = payload_len - 6;
+    const uint16_t crc = payload[payload_len - 2] | payload[payload_len - 1] << 8;
+    if (telemetry::crc16(payload, payload_len - 2) != crc) {
+        send_command_reply(telemetry::PACKET_NACK, last_command_sequence + 1, telemetry::NACK_CRC);
+        return;
+    }
+    const uint8_t flags = payload[1];
+    const uint16_t sequence = payload[2] | payload[3] << 8;
+    if (in_command_session && !(flags & telemetry::FLAG_NEW_SESSION)) {
+        const int16_t distance = sequence - last_command_sequence;
+        if (distance <= 0) {
+            send_command_reply(telemetry::PACKET_ACK, sequence, telemetry::ACK_DUPLICATE);
+            return;
+        }
+        if (distance > 1) {
+            send_command_reply(telemetry::PACKET_NACK, last_command_sequence + 1, telemetry::NACK_SEQUENCE);
+            return;
+        }
+    }
+    in_command_session = true;
+    last_command_sequence = sequence;
+
+    // the statements are separated by newlines; the CRC is no longer needed and makes room for the terminating '\0'
+    char *const text = reinterpret_cast<char *>(&payload[4]);
+    text[text_len] = '\0';
+    uint8_t status = telemetry::ACK_OK;
+    char *line = text;
+    while (line <= text + text_len) {
+        char *end = std::strchr(line, '\n');
+        if (end) {
+            *end = '\0';
+        } else {
+            end = text + text_len;
+        }
+        const int len = strip(line, end - line);
+        if (len > 0) {
+            try {
+                process_line(line, len);
+            } catch (const std::runtime_error &e) {
+                echo("error processing frame %u: %s", sequence, e.what());
+                status = telemetry::ACK_ERROR;
+            }
+        }
+        line = end + 1;
+    }
+    send_command_reply(telemetry::PACKET_ACK, sequence, status);
+}
+
 void process_uart() {
-    static char input[BUFFER_SIZE];
+    static char input[INPUT_BUFFER_SIZE];
+    static uint8_t frame[FRAME_BUFFER_SIZE];
+    static size_t frame_len = 0;
+    static bool discarding_frame = false;
     while (true) {
         const int pos = uart_pattern_pop_pos(UART_NUM_0);
         if (pos < 0) {
             break;
         }
+        if (pos >= static_cast<int>(sizeof(input)) - 1) {
+            // Neither a line nor a piece of a valid frame is this long: drain it in chunks and discard it.
+            const bool in_frame = frame_len > 0 || discarding_frame;
+            bool starts_frame = false;
+            bool ends_frame = false;
+            for (int offset = 0; offset <= pos;) {
+                const int len = uart_read_bytes(UART_NUM_0, (uint8_t *)input, std::min(pos + 1 - offset, BUFFER_SIZE), 0);
+                if (len <= 0) {
+                    break;
+                }
+                for (int i = 0; i < len; i++) {
+                    if (input[i] == '\0') {
+                        (offset + i == 0 && !in_frame ? starts_frame : ends_frame) = true;
+                    }
+                }
+                offset += len;
+            }
+            if (in_frame || starts_frame) {
+                if (!discarding_frame) {
+                    send_command_reply(telemetry::PACKET_NACK, last_command_sequence + 1, telemetry::NACK_TOO_LONG);
+                }
+                discarding_frame = !ends_frame;
+                frame_len = 0;
+            } else {
+                echo("error: line too long, discarded %d bytes", pos + 1);
+            }
+            continue;
+        }
         int len = uart_read_bytes(UART_NUM_0, (uint8_t *)input, pos + 1, 0);
+
+        // A binary command frame "0x00 <COBS data> 0x00" is followed by a newline for the line detection.
+        // The COBS data may contain newlines as well, so a frame can arrive in several pieces.
+        if (len > 0 && (frame_len > 0 || discarding_frame || input[0] == '\0')) {
+            const void *frame_end = std::memchr(frame_len > 0 || discarding_frame ? input : input + 1, '\0',
+                                                frame_len > 0 || discarding_frame ? len : len - 1);
+            if (discarding_frame || frame_len + len > sizeof(frame)) {
+                if (!discarding_frame) {
+                    send_command_reply(telemetry::PACKET_NACK, last_command_sequence + 1, telemetry::NACK_TOO_LONG);
+                }
+                discarding_frame = !frame_end;
+                frame_len = 0;
+                continue;
+            }
+            std::memcpy(&frame[frame_len], input, len);
+            frame_len += len;
+            if (frame_end) {
+                const size_t end = frame_len - len + (static_cast<const char *>(frame_end) - input);
+                process_frame(&frame[1], end - 1);
+                frame_len = 0;
+            }
+            continue;
+        }
+
         bool checksum_ok = true;
         len = check(input, len, &checksum_ok);
         if (!checksum_ok) {
@@ -454,6 +647,11 @@ void app_main() {
     uart_driver_install(UART_NUM_0, BUFFER_SIZE * 2, 0, 20, &uart_queue, 0);
     uart_enable_pattern_det_baud_intr(UART_NUM_0, '\n', 1, 9, 0, 0);
     uart_pattern_queue_reset(UART_NUM_0, 100);
+    try {
+        start_echo_writer(ECHO_BUFFER_SIZE);
+    } catch (const std::runtime_error &e) {
+        echo("error while starting echo writer: %s", e.what());
+    }
 
     try {
         Global::add_module("core", core_module = std::make_shared<Core>("core"));
@@ -473,7 +671,7 @@ void app_main() {
     bus_backup::save_if_present();
     bus_backup::restore_if_needed();
 
-    printf("\nReady.\n");
+    echo_raw("\nReady.\n", sizeof("\nReady.\n") - 1);
 
     // Anchor for the deadline loop below: xTaskDelayUntil advances this by one period
     // each iteration, giving a drift-free 10 ms cadence (no millis() re-read per loop).
@@ -514,6 +712,31 @@ void app_main() {
             }
         }
 
+        {
+            InterpreterLock lock;
+
+            // property updates of the modules bound to proxies are sent to the controlling core in one go
+            try {
+                proxy_channel::flush();
+            } catch (const std::runtime_error &e) {
+                echo("error while sending proxy updates: %s", e.what());
+            }
+
+            // proxy operations of this cycle are sent to the expanders in one go
+            try {
+                Expander::flush_all();
+            } catch (const std::runtime_error &e) {
+                echo("error while sending to expanders: %s", e.what());
+            }
+
+            // CAN setpoints of this cycle, after repeated ones have been coalesced
+            try {
+                Can::flush_all();
+            } catch (const std::runtime_error &e) {
+                echo("error while sending CAN setpoints: %s", e.what());
+            }
+        }
+
         // Sleep until the next 10 ms period boundary instead of a full vTaskDelay(10) after
         // work, so the period is max(10 ms, work) and drift-free (#213). On overrun
         // xTaskDelayUntil returns pdFALSE without blocking; floor at 1 tick so the idle task
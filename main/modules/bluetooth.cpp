@@ -90,3 +90,8 @@ void Bluetooth::call(const std::string method_name, const std::vector<ConstExpre
         Module::call(method_name, arguments);
     }
 }
+
+bool Bluetooth::send_line(const long, const char *line) {
+    // a notification is only queued by NimBLE, it fails instead of blocking if no buffer is free or no client is connected
+    return ZZ::BleCommand::send(line) == 0;
+}
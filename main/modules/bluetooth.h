@@ -23,5 +23,6 @@ public:
 
     void step() override;
     void call(const std::string method_name, const std::vector<ConstExpression_ptr> arguments) override;
+    bool send_line(const long address, const char *line) override;
     static const std::map<std::string, Variable_ptr> get_defaults();
 };
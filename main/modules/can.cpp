@@ -3,14 +3,29 @@
 #include "../utils/timing.h"
 #include "../utils/uart.h"
 #include "driver/twai.h"
+#include "esp_timer.h"
+#include <cstring>
 #include <stdexcept>
 
+static std::vector<std::weak_ptr<Can>> cans; // for flush_all()
+
 static Module_ptr create_can(const std::string &name, const std::vector<ConstExpression_ptr> &arguments, MessageHandler) {
-    Module::expect(arguments, 3, integer, integer, integer);
+    if (arguments.size() < 3 || arguments.size() > 6) {
+        throw std::runtime_error("unexpected number of arguments");
+    }
+    Module::expect(arguments, -1, integer, integer, integer, integer, integer, integer);
     const gpio_num_t rx_pin = (gpio_num_t)arguments[0]->evaluate_integer();
     const gpio_num_t tx_pin = (gpio_num_t)arguments[1]->evaluate_integer();
     const long baud_rate = arguments[2]->evaluate_integer();
-    return std::make_shared<Can>(name, rx_pin, tx_pin, baud_rate);
+    const long rx_queue_len = arguments.size() > 3 ? arguments[3]->evaluate_integer() : 20;
+    const long tx_queue_len = arguments.size() > 4 ? arguments[4]->evaluate_integer() : 20;
+    const long rx_ring_len = arguments.size() > 5 ? arguments[5]->evaluate_integer() : 256;
+    if (rx_queue_len < 1 || tx_queue_len < 1 || rx_ring_len < 1) {
+        throw std::runtime_error("queue lengths must be positive");
+    }
+    const Can_ptr can = std::make_shared<Can>(name, rx_pin, tx_pin, baud_rate, rx_queue_len, tx_queue_len, rx_ring_len);
+    cans.push_back(can);
+    return can;
 }
 REGISTER_MODULE(Can, &create_can)
 
@@ -26,11 +41,44 @@ const std::map<std::string, Variable_ptr> Can::get_defaults() {
         {"rx_overrun_count", std::make_shared<IntegerVariable>()},
         {"arb_lost_count", std::make_shared<IntegerVariable>()},
         {"bus_error_count", std::make_shared<IntegerVariable>()},
+        {"rx_ring_high_water", std::make_shared<IntegerVariable>()},
+        {"rx_ring_dropped", std::make_shared<IntegerVariable>()},
+        {"auto_filter", std::make_shared<BooleanVariable>(false)},
+        {"rx_frame_rate", std::make_shared<NumberVariable>()},
+        {"setpoint_deadline", std::make_shared<IntegerVariable>(50)},
+        {"tx_safety_queued", std::make_shared<IntegerVariable>()},
+        {"tx_safety_high_water", std::make_shared<IntegerVariable>()},
+        {"tx_safety_dropped", std::make_shared<IntegerVariable>()},
+        {"tx_setpoint_queued", std::make_shared<IntegerVariable>()},
+        {"tx_setpoint_high_water", std::make_shared<IntegerVariable>()},
+        {"tx_setpoint_dropped", std::make_shared<IntegerVariable>()},
+        {"tx_setpoint_stale", std::make_shared<IntegerVariable>()},
+        {"tx_setpoint_coalesced", std::make_shared<IntegerVariable>()},
+        {"tx_config_queued", std::make_shared<IntegerVariable>()},
+        {"tx_config_high_water", std::make_shared<IntegerVariable>()},
+        {"tx_config_dropped", std::make_shared<IntegerVariable>()},
+        {"tx_diagnostic_queued", std::make_shared<IntegerVariable>()},
+        {"tx_diagnostic_high_water", std::make_shared<IntegerVariable>()},
+        {"tx_diagnostic_dropped", std::make_shared<IntegerVariable>()},
     };
 }
 
-Can::Can(const std::string name, const gpio_num_t rx_pin, const gpio_num_t tx_pin, const long baud_rate)
-    : Module(name) {
+static size_t rx_ring_capacity(const size_t frames, const size_t record_size) {
+    size_t capacity = 64;
+    while (capacity < frames * record_size) {
+        capacity *= 2;
+    }
+    return capacity;
+}
+
+Can::Can(const std::string name,
+         const gpio_num_t rx_pin,
+         const gpio_num_t tx_pin,
+         const long baud_rate,
+         const uint32_t rx_queue_len,
+         const uint32_t tx_queue_len,
+         const size_t rx_ring_len)
+    : Module(name), tx_queue(tx_queue_len), rx_ring(rx_ring_capacity(rx_ring_len, RX_RECORD_SIZE)) {
     this->g_config = TWAI_GENERAL_CONFIG_DEFAULT(tx_pin, rx_pin, TWAI_MODE_NORMAL);
     this->f_config = TWAI_FILTER_CONFIG_ACCEPT_ALL();
 
@@ -63,19 +111,84 @@ Can::Can(const std::string name, const gpio_num_t rx_pin, const gpio_num_t tx_pi
         throw std::runtime_error("invalid baud rate");
     }
 
-    this->g_config.rx_queue_len = 20;
-    this->g_config.tx_queue_len = 20;
+    this->g_config.rx_queue_len = rx_queue_len;
+    this->g_config.tx_queue_len = tx_queue_len;
 
     this->properties = Can::get_defaults();
 
     ESP_ERROR_CHECK(twai_driver_install(&this->g_config, &this->t_config, &this->f_config));
     ESP_ERROR_CHECK(twai_start());
+
+    // above the serial bus communication task, so that a busy bus does not overrun the driver's queue
+    if (xTaskCreatePinnedToCore(Can::rx_loop, "can_rx", 2048, this, 6, &this->rx_task, 1) != pdPASS) {
+        throw std::runtime_error("failed to create CAN receive task");
+    }
+}
+
+void Can::rx_loop(void *parameter) {
+    Can *const can = static_cast<Can *>(parameter);
+    while (true) {
+        if (can->rx_paused.load()) {
+            can->rx_idle = true;
+            vTaskDelay(1);
+            continue;
+        }
+        ReceivedFrame frame;
+        // the timeout only bounds how long pause_rx() waits, frames are returned as soon as they arrive
+        const esp_err_t result = twai_receive(&frame.message, pdMS_TO_TICKS(10));
+        if (result != ESP_OK) {
+            if (result != ESP_ERR_TIMEOUT) {
+                vTaskDelay(1); // e.g. the driver is not installed after a failed reset
+            }
+            continue;
+        }
+        frame.time = esp_timer_get_time();
+        can->rx_frame_count++;
+        uint8_t *const record = can->rx_ring.reserve(sizeof(frame));
+        if (!record) {
+            can->rx_ring_dropped++;
+            continue;
+        }
+        std::memcpy(record, &frame, sizeof(frame));
+        can->rx_ring.commit();
+    }
+}
+
+void Can::pause_rx() {
+    this->rx_idle = false;
+    this->rx_paused = true;
+    while (!this->rx_idle) {
+        delay(1);
+    }
+}
+
+void Can::resume_rx() {
+    this->rx_paused = false;
 }
 
 void Can::step() {
     while (this->receive()) {
     }
 
+    if (this->is_filter_wanted() != this->filter_selected || (this->filter_selected && this->filter_outdated)) {
+        try {
+            this->update_filter();
+        } catch (const std::exception &e) {
+            echo("CAN filter update failed: %s", e.what());
+        }
+    }
+
+    const unsigned long rate_interval = millis_since(this->rate_time);
+    if (rate_interval >= 1000) {
+        const uint32_t frame_count = this->rx_frame_count.load();
+        this->properties.at("rx_frame_rate")->number_value = (frame_count - this->rate_frame_count) * 1000.0 / rate_interval;
+        this->rate_frame_count = frame_count;
+        this->rate_time = millis();
+    }
+
+    // frames that did not fit into the driver's queue in the last cycle
+    this->transmit(true);
+
     twai_status_info_t status_info;
     if (twai_get_status_info(&status_info) != ESP_OK) {
         throw std::runtime_error("could not get status info");
@@ -94,6 +207,18 @@ void Can::step() {
     this->properties.at("rx_overrun_count")->integer_value = status_info.rx_overrun_count;
     this->properties.at("arb_lost_count")->integer_value = status_info.arb_lost_count;
     this->properties.at("bus_error_count")->integer_value = status_info.bus_error_count;
+    this->properties.at("rx_ring_high_water")->integer_value = this->rx_ring.get_high_water() / RX_RECORD_SIZE;
+    this->properties.at("rx_ring_dropped")->integer_value = this->rx_ring_dropped.load();
+    for (int p = 0; p < CanTxQueue::PRIORITY_COUNT; ++p) {
+        const CanTxQueue::Metrics &metrics = this->tx_queue.get_metrics(static_cast<CanTxQueue::Priority>(p));
+        const std::string prefix = std::string("tx_") + CanTxQueue::get_name(static_cast<CanTxQueue::Priority>(p));
+        this->properties.at(prefix + "_queued")->integer_value = metrics.queued;
+        this->properties.at(prefix + "_high_water")->integer_value = metrics.high_water;
+        this->properties.at(prefix + "_dropped")->integer_value = metrics.dropped;
+    }
+    const CanTxQueue::Metrics &setpoint_metrics = this->tx_queue.get_metrics(CanTxQueue::SETPOINT);
+    this->properties.at("tx_setpoint_stale")->integer_value = setpoint_metrics.stale;
+    this->properties.at("tx_setpoint_coalesced")->integer_value = setpoint_metrics.coalesced;
 
     if (status_info.state == TWAI_STATE_BUS_OFF && this->previous_state != TWAI_STATE_BUS_OFF) {
         try {
@@ -108,22 +233,21 @@ void Can::step() {
 }
 
 bool Can::receive() {
-    twai_message_t message;
-    const esp_err_t result = twai_receive(&message, pdMS_TO_TICKS(0));
-    if (result == ESP_ERR_TIMEOUT) {
-        // no message available
-        return false;
-    }
-
-    if (result != ESP_OK) {
+    size_t length;
+    const uint8_t *const record = this->rx_ring.front(length);
+    if (!record) {
         return false;
     }
+    ReceivedFrame frame;
+    std::memcpy(&frame, record, sizeof(frame));
+    this->rx_ring.release();
+    const twai_message_t &message = frame.message;
+    this->receive_time = frame.time;
 
-    if (this->subscribers.count(message.identifier)) {
-        this->subscribers[message.identifier]->handle_can_msg(
-            message.identifier,
-            message.data_length_code,
-            message.data);
+    if (const CanDispatchTable::Subscribers *subscribers = this->subscribers.find(message.identifier)) {
+        for (const Module_ptr &subscriber : *subscribers) {
+            subscriber->handle_can_msg(message.identifier, message.data_length_code, message.data);
+        }
     }
 
     if (this->output_on) {
@@ -140,7 +264,8 @@ bool Can::receive() {
     return true;
 }
 
-void Can::send(const uint32_t id, const uint8_t data[8], const bool rtr, uint8_t dlc) const {
+void Can::send(const uint32_t id, const uint8_t data[8], const bool rtr, uint8_t dlc, const CanTxQueue::Priority priority,
+               const uint32_t node_mask) {
     twai_status_info_t status_info;
     if (twai_get_status_info(&status_info) != ESP_OK || status_info.state != TWAI_STATE_RUNNING) {
         static unsigned long last_drop_log = 0;
@@ -151,23 +276,54 @@ void Can::send(const uint32_t id, const uint8_t data[8], const bool rtr, uint8_t
         return;
     }
 
-    twai_message_t message;
-    message.identifier = id;
-    message.flags = rtr ? TWAI_MSG_FLAG_RTR : TWAI_MSG_FLAG_NONE;
-    message.data_length_code = dlc;
+    CanTxQueue::Frame frame;
+    frame.id = id;
+    frame.dlc = dlc;
+    frame.rtr = rtr;
     for (int i = 0; i < dlc; ++i) {
-        message.data[i] = data[i];
+        frame.data[i] = data[i];
+    }
+    frame.deadline = millis() + this->properties.at("setpoint_deadline")->integer_value;
+    if (!this->tx_queue.push(priority, frame, node_mask)) {
+        return; // counted in the queue's metrics
+    }
+
+    // setpoints wait for the end of the cycle, so that repeated ones can be coalesced
+    if (priority != CanTxQueue::SETPOINT) {
+        this->transmit(false);
     }
+}
 
-    twai_transmit(&message, pdMS_TO_TICKS(0));
+void Can::transmit(const bool include_setpoints) {
+    twai_status_info_t status_info;
+    if (twai_get_status_info(&status_info) != ESP_OK || status_info.state != TWAI_STATE_RUNNING) {
+        return;
+    }
+    const size_t free_slots = status_info.msgs_to_tx < this->g_config.tx_queue_len ? this->g_config.tx_queue_len - status_info.msgs_to_tx : 0;
+    this->tx_queue.transmit(free_slots, millis(), include_setpoints, [](const CanTxQueue::Frame &frame) {
+        twai_message_t message;
+        message.identifier = frame.id;
+        message.flags = frame.rtr ? TWAI_MSG_FLAG_RTR : TWAI_MSG_FLAG_NONE;
+        message.data_length_code = frame.dlc;
+        std::memcpy(message.data, frame.data, frame.dlc);
+        return twai_transmit(&message, pdMS_TO_TICKS(0)) == ESP_OK;
+    });
+}
+
+void Can::flush_all() {
+    for (const std::weak_ptr<Can> &weak_can : cans) {
+        if (const Can_ptr can = weak_can.lock()) {
+            can->transmit(true);
+        }
+    }
 }
 
 void Can::send(uint32_t id,
                uint8_t d0, uint8_t d1, uint8_t d2, uint8_t d3,
                uint8_t d4, uint8_t d5, uint8_t d6, uint8_t d7,
-               bool rtr) const {
+               bool rtr, CanTxQueue::Priority priority, uint32_t node_mask) {
     uint8_t data[8] = {d0, d1, d2, d3, d4, d5, d6, d7};
-    this->send(id, data, rtr);
+    this->send(id, data, rtr, 8, priority, node_mask);
 }
 
 void Can::call(const std::string method_name, const std::vector<ConstExpression_ptr> arguments) {
@@ -184,16 +340,37 @@ void Can::call(const std::string method_name, const std::vector<ConstExpression_
                    arguments[8]->evaluate_integer());
     } else if (method_name == "get_status") {
         Module::expect(arguments, 0);
-        echo("state:            %s", this->properties.at("state")->string_value.c_str());
-        echo("msgs_to_tx:       %d", (int)this->properties.at("msgs_to_tx")->integer_value);
-        echo("msgs_to_rx:       %d", (int)this->properties.at("msgs_to_rx")->integer_value);
-        echo("tx_error_counter: %d", (int)this->properties.at("tx_error_counter")->integer_value);
-        echo("rx_error_counter: %d", (int)this->properties.at("rx_error_counter")->integer_value);
-        echo("tx_failed_count:  %d", (int)this->properties.at("tx_failed_count")->integer_value);
-        echo("rx_missed_count:  %d", (int)this->properties.at("rx_missed_count")->integer_value);
-        echo("rx_overrun_count: %d", (int)this->properties.at("rx_overrun_count")->integer_value);
-        echo("arb_lost_count:   %d", (int)this->properties.at("arb_lost_count")->integer_value);
-        echo("bus_error_count:  %d", (int)this->properties.at("bus_error_count")->integer_value);
+        echo("state:              %s", this->properties.at("state")->string_value.c_str());
+        echo("msgs_to_tx:         %d", (int)this->properties.at("msgs_to_tx")->integer_value);
+        echo("msgs_to_rx:         %d", (int)this->properties.at("msgs_to_rx")->integer_value);
+        echo("tx_error_counter:   %d", (int)this->properties.at("tx_error_counter")->integer_value);
+        echo("rx_error_counter:   %d", (int)this->properties.at("rx_error_counter")->integer_value);
+        echo("tx_failed_count:    %d", (int)this->properties.at("tx_failed_count")->integer_value);
+        echo("rx_missed_count:    %d", (int)this->properties.at("rx_missed_count")->integer_value);
+        echo("rx_overrun_count:   %d", (int)this->properties.at("rx_overrun_count")->integer_value);
+        echo("arb_lost_count:     %d", (int)this->properties.at("arb_lost_count")->integer_value);
+        echo("bus_error_count:    %d", (int)this->properties.at("bus_error_count")->integer_value);
+        echo("rx_ring_high_water: %d", (int)this->properties.at("rx_ring_high_water")->integer_value);
+        echo("rx_ring_dropped:    %d", (int)this->properties.at("rx_ring_dropped")->integer_value);
+        echo("rx_frame_rate:      %.1f", this->properties.at("rx_frame_rate")->number_value);
+        if (this->filter.accepted_ids < can_filter::STANDARD_ID_COUNT) {
+            echo("filter:             %s, code 0x%08lx, mask 0x%08lx, %d ids",
+                 this->filter.single_filter ? "single" : "dual",
+                 (unsigned long)this->filter.acceptance_code,
+                 (unsigned long)this->filter.acceptance_mask,
+                 (int)this->filter.accepted_ids);
+        } else {
+            echo("filter:             accept all");
+        }
+        for (int p = 0; p < CanTxQueue::PRIORITY_COUNT; ++p) {
+            const CanTxQueue::Metrics &metrics = this->tx_queue.get_metrics(static_cast<CanTxQueue::Priority>(p));
+            const std::string label = std::string("tx_") + CanTxQueue::get_name(static_cast<CanTxQueue::Priority>(p)) + ":";
+            echo("%-20squeued %d, high water %d, sent %lu, dropped %lu, stale %lu, coalesced %lu",
+                 label.c_str(),
+                 (int)metrics.queued, (int)metrics.high_water,
+                 (unsigned long)metrics.sent, (unsigned long)metrics.dropped,
+                 (unsigned long)metrics.stale, (unsigned long)metrics.coalesced);
+        }
     } else if (method_name == "start") {
         Module::expect(arguments, 0);
         if (twai_start() != ESP_OK) {
@@ -218,10 +395,36 @@ void Can::call(const std::string method_name, const std::vector<ConstExpression_
 }
 
 void Can::subscribe(const uint32_t id, const Module_ptr module) {
-    if (this->subscribers.count(id)) {
-        throw std::runtime_error("there is already a subscriber for this CAN ID");
+    this->subscribers.add(id, module);
+    this->filter_outdated = true;
+}
+
+bool Can::is_filter_wanted() const {
+    // raw output shows all traffic on the bus
+    return this->properties.at("auto_filter")->boolean_value && !this->output_on;
+}
+
+void Can::select_filter() {
+    this->filter_selected = this->is_filter_wanted();
+    this->filter = this->filter_selected ? can_filter::compute(this->subscribers.get_ids()) : can_filter::ACCEPT_ALL;
+    this->filter_outdated = false;
+    this->f_config.acceptance_code = this->filter.acceptance_code;
+    this->f_config.acceptance_mask = this->filter.acceptance_mask;
+    this->f_config.single_filter = this->filter.single_filter;
+}
+
+void Can::update_filter() {
+    this->select_filter();
+
+    // the filter can only be changed while the driver is not installed
+    twai_status_info_t status_info;
+    if (twai_get_status_info(&status_info) != ESP_OK || status_info.state != TWAI_STATE_RUNNING) {
+        return; // installed with the next reset
     }
-    this->subscribers[id] = module;
+    if (twai_stop() != ESP_OK) {
+        throw std::runtime_error("could not stop TWAI driver");
+    }
+    this->reinstall_driver();
 }
 
 void Can::reset_can_bus() {
@@ -262,21 +465,32 @@ void Can::reset_can_bus() {
         }
     }
 
+    this->select_filter();
+
     // Tear down and rebuild the driver instead of calling twai_initiate_recovery():
     // ESP-IDF v5.3.1 asserts tx_msg_count >= 0 in the TX ISR while leaving BUS_OFF,
     // which would call abort() from interrupt context.
+    this->reinstall_driver();
+    if (twai_get_status_info(&status_info) != ESP_OK || status_info.state != TWAI_STATE_RUNNING) {
+        throw std::runtime_error("TWAI driver didn't start properly");
+    }
+
+    echo("CAN bus reset successful, state: RUNNING");
+}
+
+void Can::reinstall_driver() {
+    // the RX task must not wait on the driver's queue while it is deleted
+    this->pause_rx();
     if (twai_driver_uninstall() != ESP_OK) {
+        this->resume_rx();
         throw std::runtime_error("could not uninstall TWAI driver");
     }
     if (twai_driver_install(&this->g_config, &this->t_config, &this->f_config) != ESP_OK) {
+        this->resume_rx();
         throw std::runtime_error("could not reinstall TWAI driver");
     }
+    this->resume_rx();
     if (twai_start() != ESP_OK) {
         throw std::runtime_error("could not start TWAI driver");
     }
-    if (twai_get_status_info(&status_info) != ESP_OK || status_info.state != TWAI_STATE_RUNNING) {
-        throw std::runtime_error("TWAI driver didn't start properly");
-    }
-
-    echo("CAN bus reset successful, state: RUNNING");
 }
@@ -2,7 +2,14 @@
 
 #include "driver/gpio.h"
 #include "driver/twai.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
 #include "module.h"
+#include "utils/can_dispatch.h"
+#include "utils/can_filter.h"
+#include "utils/can_tx_queue.h"
+#include "utils/message_ring.h"
+#include <atomic>
 #include <memory>
 
 class Can;
@@ -10,26 +17,69 @@ using Can_ptr = std::shared_ptr<Can>;
 
 class Can : public Module {
 private:
-    std::map<uint32_t, Module_ptr> subscribers;
+    CanDispatchTable subscribers;
     twai_general_config_t g_config;
     twai_timing_config_t t_config;
     twai_filter_config_t f_config;
     twai_state_t previous_state = TWAI_STATE_RUNNING;
 
+    can_filter::Filter filter;     // installed in the driver
+    bool filter_selected = false;  // whether the filter was computed from the subscriptions
+    bool filter_outdated = false;  // the subscriptions changed since the filter was computed
+    std::atomic<uint32_t> rx_frame_count{0};
+    uint32_t rate_frame_count = 0; // rx_frame_count at rate_time
+    unsigned long rate_time = 0;
+
+    CanTxQueue tx_queue;
+
+    // The RX task moves frames from the driver's queue into this ring as soon as they arrive;
+    // receive() delivers them to the subscribers on the main task.
+    struct ReceivedFrame {
+        int64_t time; // esp_timer_get_time() when the frame was taken from the driver (µs)
+        twai_message_t message;
+    };
+    static constexpr size_t RX_RECORD_SIZE = MessageRing::record_size(sizeof(ReceivedFrame));
+    MessageRing rx_ring;
+    std::atomic<uint32_t> rx_ring_dropped{0};
+    std::atomic<bool> rx_paused{false}; // set while the driver is reinstalled
+    std::atomic<bool> rx_idle{false};   // the RX task has seen rx_paused
+    TaskHandle_t rx_task = nullptr;
+    int64_t receive_time = 0;
+
+    static void rx_loop(void *parameter);
+    void pause_rx();
+    void resume_rx();
+    void reinstall_driver();
+    bool is_filter_wanted() const;
+    void select_filter();
+    void update_filter();
+    void transmit(const bool include_setpoints);
+
 public:
     static inline constexpr const char *TYPE = "Can";
 
-    Can(const std::string name, const gpio_num_t rx_pin, const gpio_num_t tx_pin, const long baud_rate);
+    Can(const std::string name,
+        const gpio_num_t rx_pin,
+        const gpio_num_t tx_pin,
+        const long baud_rate,
+        const uint32_t rx_queue_len,
+        const uint32_t tx_queue_len,
+        const size_t rx_ring_len);
     void step() override;
     void call(const std::string method_name, const std::vector<ConstExpression_ptr> arguments) override;
     static const std::map<std::string, Variable_ptr> get_defaults();
 
     bool receive();
-    void send(const uint32_t id, const uint8_t data[8], const bool rtr = false, const uint8_t dlc = 8) const;
+    int64_t get_receive_time() const { return this->receive_time; } // of the frame being handled (µs, esp_timer)
+    // node_mask: id bits of the node whose queued setpoints a safety frame cancels (see CanTxQueue)
+    void send(const uint32_t id, const uint8_t data[8], const bool rtr = false, const uint8_t dlc = 8,
+              const CanTxQueue::Priority priority = CanTxQueue::CONFIG, const uint32_t node_mask = 0);
     void send(const uint32_t id,
               const uint8_t d0, const uint8_t d1, const uint8_t d2, const uint8_t d3,
               const uint8_t d4, const uint8_t d5, const uint8_t d6, const uint8_t d7,
-              const bool rtr = false) const;
+              const bool rtr = false, const CanTxQueue::Priority priority = CanTxQueue::CONFIG,
+              const uint32_t node_mask = 0);
     void subscribe(const uint32_t id, const Module_ptr module);
     void reset_can_bus();
+    static void flush_all(); // sends the setpoints of this cycle, called at the end of each main loop cycle
 };
@@ -1,4 +1,7 @@
 #include "canopen.h"
+#include "utils/timing.h"
+#include "utils/uart.h"
+#include <algorithm>
 
 uint32_t wrap_cob_id(CobFunction function, uint8_t node_id) {
     return (function << (11 - 4)) | (node_id);
@@ -36,3 +39,316 @@ uint8_t check_node_id(int64_t id) {
 
     return static_cast<uint8_t>(id);
 }
+
+const char *get_sdo_abort_text(const uint32_t abort_code) {
+    switch (abort_code) {
+    case SDO_ABORT_TOGGLE:
+        return "toggle bit not alternated";
+    case SDO_ABORT_TIMEOUT:
+        return "SDO protocol timed out";
+    case SDO_ABORT_COMMAND:
+        return "invalid command specifier";
+    case 0x06010000:
+        return "unsupported access to an object";
+    case 0x06010001:
+        return "attempt to read a write only object";
+    case 0x06010002:
+        return "attempt to write a read only object";
+    case NonExistantObject:
+        return "object does not exist";
+    case SizeMismatch:
+        return "data type does not match";
+    case 0x06090011:
+        return "subindex does not exist";
+    case 0x06090030:
+        return "value range of parameter exceeded";
+    case SDO_ABORT_GENERAL:
+        return "general error";
+    case 0x08000022:
+        return "not possible in the present device state";
+    default:
+        return "unknown error";
+    }
+}
+
+uint32_t SdoResult::get_u32() const {
+    uint32_t value = 0;
+    for (size_t i = 0; i < this->data.size() && i < 4; ++i) {
+        value |= static_cast<uint32_t>(this->data[i]) << 8 * i;
+    }
+    return value;
+}
+
+SdoClient::SdoClient(const Can_ptr can, const uint8_t node_id, const size_t max_in_flight)
+    : can(can), node_id(node_id), max_in_flight(std::max<size_t>(max_in_flight, 1)) {
+}
+
+void SdoClient::read(const uint16_t index, const uint8_t sub, const SdoCallback callback, const CanTxQueue::Priority priority) {
+    this->enqueue({false, index, sub, {}, callback, priority, false});
+}
+
+void SdoClient::write(const uint16_t index, const uint8_t sub, const std::vector<uint8_t> &data, const SdoCallback callback) {
+    if (data.empty()) {
+        throw std::runtime_error("SDO write without data");
+    }
+    this->enqueue({true, index, sub, data, callback, CanTxQueue::CONFIG, data.size() > 4});
+}
+
+void SdoClient::write(const uint16_t index, const uint8_t sub, const uint8_t bits, const uint32_t value,
+                      const SdoCallback callback, const bool replace_queued) {
+    if (bits != 8 && bits != 16 && bits != 32) {
+        throw std::runtime_error("SDO writes need 8, 16 or 32 bits");
+    }
+    std::vector<uint8_t> data(bits / 8);
+    for (size_t i = 0; i < data.size(); ++i) {
+        data[i] = (value >> 8 * i) & 0xFF;
+    }
+    if (replace_queued) {
+        for (Transfer &transfer : this->queue) {
+            if (transfer.is_write && transfer.index == index && transfer.sub == sub) {
+                transfer.data = data;
+                transfer.callback = callback;
+                return;
+            }
+        }
+    }
+    this->enqueue({true, index, sub, data, callback, CanTxQueue::CONFIG, false});
+}
+
+void SdoClient::enqueue(Transfer transfer) {
+    if (this->queue.size() >= MAX_QUEUED) {
+        throw std::runtime_error("too many SDO transfers queued for node " + std::to_string(this->node_id));
+    }
+    this->queue.push_back(std::move(transfer));
+    this->start_queued();
+}
+
+void SdoClient::start_queued() {
+    while (!this->queue.empty() && this->in_flight.size() < this->max_in_flight) {
+        const bool channel_busy = std::any_of(this->in_flight.begin(), this->in_flight.end(), [](const Transfer &transfer) {
+            return transfer.exclusive || transfer.is_write || transfer.segmented;
+        });
+        const Transfer &next = this->queue.front();
+        if (channel_busy || ((next.exclusive || next.is_write) && !this->in_flight.empty())) {
+            return;
+        }
+        this->in_flight.push_back(std::move(this->queue.front()));
+        this->queue.pop_front();
+        this->initiate(this->in_flight.back());
+    }
+}
+
+void SdoClient::send(const uint8_t command, const uint16_t index, const uint8_t sub, const uint8_t *const data, const size_t length,
+                     const CanTxQueue::Priority priority) {
+    uint8_t frame[8] = {command};
+    marshal_index(index, sub, &frame[1]);
+    std::copy(data, data + std::min<size_t>(length, 4), &frame[4]);
+    this->can->send(wrap_cob_id(COB_SDO_CLIENT2SERVER, this->node_id), frame, false, 8, priority);
+}
+
+void SdoClient::initiate(Transfer &transfer) {
+    transfer.segmented = false;
+    transfer.toggle = false;
+    transfer.offset = 0;
+    transfer.attempts++;
+    transfer.deadline = millis() + this->timeout_ms;
+    if (!transfer.is_write) {
+        transfer.data.clear();
+        this->send(sdo_read_header, transfer.index, transfer.sub, nullptr, 0, transfer.priority);
+    } else if (transfer.data.size() <= 4) {
+        // expedited, size indicated: the number of unused bytes is encoded in bits 2 and 3
+        const uint8_t command = 0x23 | (4 - transfer.data.size()) << 2;
+        this->send(command, transfer.index, transfer.sub, transfer.data.data(), transfer.data.size(), transfer.priority);
+    } else {
+        // segmented, size indicated
+        uint8_t size[4];
+        marshal_unsigned(static_cast<uint32_t>(transfer.data.size()), size);
+        this->send(0x21, transfer.index, transfer.sub, size, sizeof(size), transfer.priority);
+    }
+}
+
+void SdoClient::send_segment(Transfer &transfer) {
+    uint8_t frame[8] = {0};
+    if (transfer.is_write) {
+        const size_t length = std::min<size_t>(transfer.data.size() - transfer.offset, 7);
+        const bool is_last = transfer.offset + length == transfer.data.size();
+        frame[0] = transfer.toggle << 4 | (7 - length) << 1 | is_last;
+        std::copy(&transfer.data[transfer.offset], &transfer.data[transfer.offset] + length, &frame[1]);
+    } else {
+        frame[0] = 0x60 | transfer.toggle << 4;
+    }
+    transfer.deadline = millis() + this->timeout_ms;
+    this->can->send(wrap_cob_id(COB_SDO_CLIENT2SERVER, this->node_id), frame, false, 8, transfer.priority);
+}
+
+void SdoClient::abort(const Transfer &transfer, const uint32_t abort_code) {
+    uint8_t code[4];
+    marshal_unsigned(abort_code, code);
+    this->send(0x80, transfer.index, transfer.sub, code, sizeof(code), transfer.priority);
+}
+
+void SdoClient::report(Transfer &transfer, const uint32_t abort_code, const uint8_t node_id) {
+    if (transfer.callback) {
+        transfer.callback({transfer.is_write, transfer.index, transfer.sub, abort_code, std::move(transfer.data)});
+    } else if (abort_code) {
+        echo("error: SDO %s of 0x%04X.%02X on node %d failed: %s (0x%08lX)",
+             transfer.is_write ? "write" : "read", transfer.index, transfer.sub, node_id,
+             get_sdo_abort_text(abort_code), (unsigned long)abort_code);
+    }
+}
+
+void SdoClient::finish(const size_t i, const uint32_t abort_code) {
+    // removed before calling back, because the callback may start further transfers
+    Transfer transfer = std::move(this->in_flight[i]);
+    this->in_flight.erase(this->in_flight.begin() + i);
+    // later writes usually build on this one, e.g. a mapping count written after the mapping entries
+    std::vector<Transfer> skipped;
+    if (transfer.is_write && abort_code) {
+        for (auto it = this->queue.begin(); it != this->queue.end();) {
+            if (it->is_write) {
+                skipped.push_back(std::move(*it));
+                it = this->queue.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+    report(transfer, abort_code, this->node_id);
+    for (Transfer &skipped_transfer : skipped) {
+        report(skipped_transfer, SDO_ABORT_GENERAL, this->node_id);
+    }
+    this->start_queued();
+}
+
+bool SdoClient::handle_can_msg(const uint32_t id, const int count, const uint8_t *const data) {
+    if (id != wrap_cob_id(COB_SDO_SERVER2CLIENT, this->node_id)) {
+        return false;
+    }
+    if (count < 8) {
+        return true;
+    }
+
+    const uint8_t scs = data[0] >> 5;
+    const uint16_t index = data[1] | data[2] << 8;
+    const uint8_t sub = data[3];
+    const auto is_addressed = [index, sub](const Transfer &transfer) {
+        return transfer.index == index && transfer.sub == sub;
+    };
+    if (scs == WriteFailure) {
+        // an abort names the transfer's index and subindex, also during the segment phase
+        auto it = std::find_if(this->in_flight.begin(), this->in_flight.end(), is_addressed);
+        if (it == this->in_flight.end()) {
+            it = std::find_if(this->in_flight.begin(), this->in_flight.end(), [](const Transfer &transfer) {
+                return transfer.segmented;
+            });
+        }
+        if (it != this->in_flight.end()) {
+            this->finish(it - this->in_flight.begin(), demarshal_unsigned<uint32_t>(&data[4]));
+        }
+        return true;
+    }
+    if (scs == UploadSegmentData || scs == DownloadSegmentSuccess) {
+        const auto it = std::find_if(this->in_flight.begin(), this->in_flight.end(), [](const Transfer &transfer) {
+            return transfer.segmented;
+        });
+        if (it == this->in_flight.end()) {
+            return true; // e.g. a late response to an aborted transfer
+        }
+        const size_t i = it - this->in_flight.begin();
+        Transfer &transfer = *it;
+        if (transfer.is_write != (scs == DownloadSegmentSuccess) || ((data[0] >> 4) & 1) != transfer.toggle) {
+            this->abort(transfer, SDO_ABORT_TOGGLE);
+            this->finish(i, SDO_ABORT_TOGGLE);
+            return true;
+        }
+        if (transfer.is_write) {
+            transfer.offset = std::min<size_t>(transfer.offset + 7, transfer.data.size());
+            if (transfer.offset == transfer.data.size()) {
+                this->finish(i, 0);
+                return true;
+            }
+        } else {
+            const size_t length = 7 - ((data[0] >> 1) & 0x7);
+            transfer.data.insert(transfer.data.end(), &data[1], &data[1] + length);
+            if (data[0] & 1) {
+                this->finish(i, 0);
+                return true;
+            }
+        }
+        transfer.toggle = !transfer.toggle;
+        this->send_segment(transfer);
+        return true;
+    }
+
+    const auto it = std::find_if(this->in_flight.begin(), this->in_flight.end(), [&is_addressed](const Transfer &transfer) {
+        return !transfer.segmented && is_addressed(transfer);
+    });
+    if (it == this->in_flight.end()) {
+        return true;
+    }
+    const size_t i = it - this->in_flight.begin();
+    Transfer &transfer = *it;
+    if (scs == ExpeditedWriteSuccess && transfer.is_write) {
+        if (transfer.data.size() <= 4) {
+            this->finish(i, 0);
+        } else {
+            transfer.segmented = true;
+            this->send_segment(transfer);
+        }
+    } else if (scs == ExpeditedReadData && !transfer.is_write) {
+        const bool is_expedited = data[0] & 0x02;
+        const bool is_size_indicated = data[0] & 0x01;
+        if (is_expedited) {
+            const size_t length = is_size_indicated ? 4 - ((data[0] >> 2) & 0x3) : 4;
+            transfer.data.assign(&data[4], &data[4] + length);
+            this->finish(i, 0);
+        } else if (std::any_of(this->in_flight.begin(), this->in_flight.end(), [](const Transfer &t) { return t.segmented; })) {
+            // another upload is segmented already, this one is repeated on its own
+            this->abort(transfer, SDO_ABORT_GENERAL);
+            transfer.exclusive = true;
+            transfer.attempts--;
+            this->queue.push_front(std::move(transfer));
+            this->in_flight.erase(this->in_flight.begin() + i);
+        } else {
+            transfer.segmented = true;
+            this->send_segment(transfer);
+        }
+    } else {
+        this->abort(transfer, SDO_ABORT_COMMAND);
+        this->finish(i, SDO_ABORT_COMMAND);
+    }
+    return true;
+}
+
+void SdoClient::step() {
+    const unsigned long now = millis();
+    for (size_t i = 0; i < this->in_flight.size();) {
+        Transfer &transfer = this->in_flight[i];
+        if (static_cast<long>(now - transfer.deadline) <= 0) {
+            ++i;
+            continue;
+        }
+        if (transfer.attempts < this->max_attempts) {
+            if (transfer.segmented) {
+                this->abort(transfer, SDO_ABORT_TIMEOUT);
+            }
+            this->initiate(transfer);
+            ++i;
+        } else {
+            this->abort(transfer, SDO_ABORT_TIMEOUT);
+            this->finish(i, SDO_ABORT_TIMEOUT);
+        }
+    }
+    this->start_queued();
+}
+
+void SdoClient::clear() {
+    this->queue.clear();
+    this->in_flight.clear();
+}
+
+size_t SdoClient::get_pending(const bool writes) const {
+    const auto is_matching = [writes](const Transfer &transfer) { return transfer.is_write == writes; };
+    return std::count_if(this->queue.begin(), this->queue.end(), is_matching) +
+           std::count_if(this->in_flight.begin(), this->in_flight.end(), is_matching);
+}
@@ -1,8 +1,12 @@
 #pragma once
 
+#include "can.h"
 #include <cassert>
 #include <cinttypes>
+#include <deque>
+#include <functional>
 #include <stdexcept>
+#include <vector>
 
 enum CobFunction {
     COB_SYNC_EMCY = 0x1,
@@ -51,6 +55,8 @@ enum InitState {
 };
 
 enum ServerCommandSpecifier {
+    UploadSegmentData = 0,
+    DownloadSegmentSuccess = 1,
     ExpeditedReadData = 2,
     ExpeditedWriteSuccess = 3,
     WriteFailure = 4,
@@ -61,6 +67,15 @@ enum SdoWriteFailureReason {
     SizeMismatch = 0x06070010,
 };
 
+enum SdoAbortCode {
+    SDO_ABORT_TOGGLE = 0x05030000,
+    SDO_ABORT_TIMEOUT = 0x05040000,
+    SDO_ABORT_COMMAND = 0x05040001,
+    SDO_ABORT_GENERAL = 0x08000000,
+};
+
+const char *get_sdo_abort_text(const uint32_t abort_code);
+
 uint32_t wrap_cob_id(CobFunction function, uint8_t node_id);
 
 void unwrap_cob_id(uint32_t id, uint8_t &function_out, uint8_t &node_id_out);
@@ -118,3 +133,78 @@ static constexpr uint8_t sdo_read_header = (0x2 /* read */ << (8 - 3));
 void marshal_index(uint16_t index, uint8_t sub, uint8_t *const data);
 
 uint8_t check_node_id(int64_t id);
+
+struct SdoResult {
+    bool is_write;
+    uint16_t index;
+    uint8_t sub;
+    uint32_t abort_code;       // 0 on success, SDO_ABORT_TIMEOUT if the server did not answer,
+                               // SDO_ABORT_GENERAL for writes skipped after a previous write failed
+    std::vector<uint8_t> data; // uploaded bytes
+
+    uint32_t get_u32() const; // little-endian value of up to 4 uploaded bytes
+};
+
+using SdoCallback = std::function<void(const SdoResult &result)>;
+
+// Asynchronous client for the SDO server of one CANopen node.
+//
+// Reads are queued and started without waiting for each other, up to `max_in_flight` at once. Writes run alone and in
+// order, so that a repeated write cannot overtake a later one; when a write fails, the writes queued after it are
+// skipped. Responses are matched to the running transfers by index and subindex, segment responses by their command
+// specifier. A segmented transfer runs alone, because its segments carry no index. Timed out requests are repeated,
+// and after the last attempt the transfer is aborted. Each transfer reports its result to its callback, or prints
+// failures if it has none.
+// The owning module forwards SDO responses to handle_can_msg() and calls step() in its own step().
+class SdoClient {
+private:
+    struct Transfer {
+        bool is_write;
+        uint16_t index;
+        uint8_t sub;
+        std::vector<uint8_t> data; // to download, or uploaded so far
+        SdoCallback callback;
+        CanTxQueue::Priority priority;
+        bool exclusive;         // may not run alongside other transfers, like all writes
+        bool segmented = false; // in the segment phase
+        bool toggle = false;
+        size_t offset = 0; // of the next segment to download
+        int attempts = 0;
+        unsigned long deadline = 0;
+    };
+
+    const Can_ptr can;
+    const uint8_t node_id;
+    const size_t max_in_flight;
+    std::deque<Transfer> queue;
+    std::deque<Transfer> in_flight;
+
+    void send(const uint8_t command, const uint16_t index, const uint8_t sub, const uint8_t *const data, const size_t length,
+              const CanTxQueue::Priority priority);
+    void enqueue(Transfer transfer);
+    void start_queued();
+    void initiate(Transfer &transfer);
+    void send_segment(Transfer &transfer);
+    void abort(const Transfer &transfer, const uint32_t abort_code);
+    void finish(const size_t i, const uint32_t abort_code);
+    static void report(Transfer &transfer, const uint32_t abort_code, const uint8_t node_id);
+
+public:
+    static constexpr size_t MAX_QUEUED = 64;
+
+    unsigned long timeout_ms = 100;
+    int max_attempts = 3;
+
+    SdoClient(const Can_ptr can, const uint8_t node_id, const size_t max_in_flight = 1);
+
+    void read(const uint16_t index, const uint8_t sub, const SdoCallback callback,
+              const CanTxQueue::Priority priority = CanTxQueue::CONFIG);
+    void write(const uint16_t index, const uint8_t sub, const std::vector<uint8_t> &data, const SdoCallback callback = nullptr);
+    // expedited write of an 8, 16 or 32 bit value, optionally replacing a queued write of the same object
+    void write(const uint16_t index, const uint8_t sub, const uint8_t bits, const uint32_t value,
+               const SdoCallback callback = nullptr, const bool replace_queued = false);
+    bool handle_can_msg(const uint32_t id, const int count, const uint8_t *const data); // false if not an SDO response
+    void step();
+    void clear(); // drops all transfers without calling their callbacks, e.g. after the node rebooted
+    size_t get_pending(const bool writes) const;
+};
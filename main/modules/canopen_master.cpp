@@ -25,6 +25,6 @@ void CanOpenMaster::step() {
 
     if (sync_interval > 0 && this->sync_interval_counter >= sync_interval) {
         this->sync_interval_counter = 0;
-        this->can->send(0x80, nullptr, false, 0);
+        this->can->send(0x80, nullptr, false, 0, CanTxQueue::SETPOINT);
     }
 }
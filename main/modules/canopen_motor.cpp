@@ -1,13 +1,11 @@
 #include "canopen_motor.h"
 #include "canopen.h"
 #include "module_helpers.h"
-#include "timing.h"
 #include "uart.h"
 #include <cassert>
 #include <cinttypes>
 #include <esp_timer.h>
 #include <stdexcept>
-#include <unistd.h>
 
 #define TARGET_POSITION_I32 0x607A
 #define ACTUAL_POSITION_I32 0x6064
@@ -83,52 +81,61 @@ const std::map<std::string, Variable_ptr> CanOpenMotor::get_defaults() {
 }
 
 CanOpenMotor::CanOpenMotor(const std::string &name, Can_ptr can, int64_t node_id)
-    : Module(name), can(can), node_id(check_node_id(node_id)),
+    : Module(name), can(can), node_id(check_node_id(node_id)), sdo(can, this->node_id),
       current_op_mode_disp(OP_MODE_NONE), current_op_mode(OP_MODE_NONE) {
 
     this->properties = CanOpenMotor::get_defaults();
 }
 
-void CanOpenMotor::wait_for_sdo_writes(uint32_t timeout_ms) {
-    const uint32_t ms_per_sleep = 10;
-    uint32_t cycles = timeout_ms / ms_per_sleep;
+void CanOpenMotor::send_in_mode(const std::function<void()> send) {
+    if (this->entering_mode) {
+        this->deferred_pdos.push_back(send);
+    } else {
+        send();
+    }
+}
 
-    for (uint32_t i = 0; i < cycles; ++i) {
-        try {
-            while (this->can->receive())
-                ;
-        } catch (const std::exception &e) {
-            echo("CAN receive error during SDO write wait: %s", e.what());
+void CanOpenMotor::change_mode(const uint8_t op_mode, const char *mode_name, const std::function<void()> on_entered) {
+    /* The PDOs only take effect in the new mode; those meant for a previously requested mode are dropped */
+    const uint32_t request = ++this->mode_request;
+    this->entering_mode = true;
+    this->deferred_pdos.clear();
+    write_od_u8(OP_MODE_U8, 0x00, op_mode, [this, request, mode_name, on_entered](const SdoResult &result) {
+        if (request != this->mode_request) {
+            return;
         }
-
-        delay(ms_per_sleep);
-
-        if (this->properties[PROP_PENDING_WRITES]->integer_value == 0) {
+        this->entering_mode = false;
+        std::vector<std::function<void()>> deferred_pdos;
+        std::swap(deferred_pdos, this->deferred_pdos);
+        if (result.abort_code) {
+            echo("Failed to enter %s mode: %s", mode_name, get_sdo_abort_text(result.abort_code));
             return;
         }
-    }
+        on_entered();
+        for (const auto &send : deferred_pdos) {
+            send();
+        }
+    });
 
-    throw std::runtime_error("SDO writes timed out. Aborting.");
+    current_op_mode = op_mode;
 }
 
 void CanOpenMotor::enter_position_mode(int velocity) {
-    write_od_u8(OP_MODE_U8, 0x00, OP_MODE_PROFILE_POSITION);
-    send_target_velocity(velocity);
-    /* Take off halt (=brake) for positioning by default */
-    this->properties[PROP_CTRL_HALT]->boolean_value = false;
-    send_control_word(build_ctrl_word(false));
-
-    current_op_mode = OP_MODE_PROFILE_POSITION;
+    change_mode(OP_MODE_PROFILE_POSITION, "profile position", [this, velocity]() {
+        send_target_velocity(velocity);
+        /* Take off halt (=brake) for positioning by default */
+        this->properties[PROP_CTRL_HALT]->boolean_value = false;
+        send_control_word(build_ctrl_word(false));
+    });
 }
 
 void CanOpenMotor::enter_velocity_mode(int velocity) {
-    /* Put in halt for velocity mode since it directly controls motion */
-    this->properties[PROP_CTRL_HALT]->boolean_value = true;
-    send_control_word(build_ctrl_word(false));
-    send_target_velocity(velocity);
-    write_od_u8(OP_MODE_U8, 0x00, OP_MODE_PROFILE_VELOCITY);
-
-    current_op_mode = OP_MODE_PROFILE_VELOCITY;
+    change_mode(OP_MODE_PROFILE_VELOCITY, "profile velocity", [this, velocity]() {
+        /* Put in halt for velocity mode since it directly controls motion */
+        this->properties[PROP_CTRL_HALT]->boolean_value = true;
+        send_control_word(build_ctrl_word(false));
+        send_target_velocity(velocity);
+    });
 }
 
 void CanOpenMotor::set_profile_acceleration(uint16_t acceleration) {
@@ -167,19 +174,27 @@ void CanOpenMotor::call(const std::string method_name, const std::vector<ConstEx
         expect(arguments, 1, integer);
         int32_t target_position = arguments[0]->evaluate_integer();
         int32_t offset = this->properties[PROP_OFFSET]->integer_value;
-        send_target_position(target_position + offset);
+        send_in_mode([this, target_position, offset]() { send_target_position(target_position + offset); });
     } else if (method_name == "commit_target_position") {
         expect(arguments, 0);
         /* toggle new set point bit in control word */
-        send_control_word(build_ctrl_word(true));
+        send_in_mode([this]() { send_control_word(build_ctrl_word(true)); });
     } else if (method_name == "set_target_velocity") {
         expect(arguments, 1, integer);
         int32_t target_velocity = arguments[0]->evaluate_integer();
-        send_target_velocity(target_velocity);
+        send_in_mode([this, target_velocity]() { send_target_velocity(target_velocity); });
     } else if (method_name == "set_ctrl_halt") {
         expect(arguments, 1, boolean);
-        this->properties[PROP_CTRL_HALT]->boolean_value = arguments[0]->evaluate_boolean();
-        send_control_word(build_ctrl_word(false));
+        const bool halt = arguments[0]->evaluate_boolean();
+        const auto send_halt = [this, halt]() {
+            this->properties[PROP_CTRL_HALT]->boolean_value = halt;
+            send_control_word(build_ctrl_word(false));
+        };
+        /* Halting is never delayed, but repeated after a pending mode change, which sets the halt bit itself */
+        if (halt) {
+            send_halt();
+        }
+        send_in_mode(send_halt);
     } else if (method_name == "set_ctrl_enable") {
         expect(arguments, 1, boolean);
         this->properties[PROP_CTRL_ENA_OP]->boolean_value = arguments[0]->evaluate_boolean();
@@ -235,96 +250,56 @@ void CanOpenMotor::transition_operational() {
     this->can->send(0, data, false, sizeof(data));
 }
 
-bool CanOpenMotor::send_sdo_with_retry(uint32_t cob_id, const uint8_t *data) {
-    const int max_attempts = 3;
-
-    for (int attempt = 0; attempt < max_attempts; attempt++) {
-        try {
-            this->properties[PROP_PENDING_WRITES]->integer_value++;
-            this->can->send(cob_id, data);
-            wait_for_sdo_writes(100);
-            return true;
-        } catch (const std::exception &e) {
-            this->properties[PROP_PENDING_WRITES]->integer_value--;
-            if (attempt < max_attempts - 1) {
-                try {
-                    this->can->reset_can_bus();
-                    delay(50);
-                } catch (const std::exception &e) {
-                    echo("CAN recovery failed: %s", e.what());
-                }
-            }
-        }
-    }
-
-    return false;
+void CanOpenMotor::write_od_u8(uint16_t index, uint8_t sub, uint8_t value, const SdoCallback callback) {
+    this->sdo.write(index, sub, 8, value, callback);
 }
 
-void CanOpenMotor::write_od_u8(uint16_t index, uint8_t sub, uint8_t value) {
-    uint8_t data[8];
-    data[0] = sdo_write_u8_header;
-    marshal_index(index, sub, &data[1]);
-    marshal_unsigned(value, &data[4]);
-
-    if (!send_sdo_with_retry(wrap_cob_id(COB_SDO_CLIENT2SERVER, node_id), data)) {
-        throw std::runtime_error("Failed to send SDO write command after multiple retries");
-    }
+void CanOpenMotor::write_od_u16(uint16_t index, uint8_t sub, uint16_t value, const SdoCallback callback) {
+    this->sdo.write(index, sub, 16, value, callback);
 }
 
-void CanOpenMotor::write_od_u16(uint16_t index, uint8_t sub, uint16_t value) {
-    uint8_t data[8];
-    data[0] = sdo_write_u16_header;
-    marshal_index(index, sub, &data[1]);
-    marshal_unsigned(value, &data[4]);
-
-    if (!send_sdo_with_retry(wrap_cob_id(COB_SDO_CLIENT2SERVER, node_id), data)) {
-        throw std::runtime_error("Failed to send SDO write command after multiple retries");
-    }
+void CanOpenMotor::write_od_u32(uint16_t index, uint8_t sub, uint32_t value, const SdoCallback callback) {
+    this->sdo.write(index, sub, 32, value, callback);
 }
 
-void CanOpenMotor::write_od_u32(uint16_t index, uint8_t sub, uint32_t value) {
-    uint8_t data[8];
-    data[0] = sdo_write_u32_header;
-    marshal_index(index, sub, &data[1]);
-    marshal_unsigned(value, &data[4]);
-
-    if (!send_sdo_with_retry(wrap_cob_id(COB_SDO_CLIENT2SERVER, node_id), data)) {
-        throw std::runtime_error("Failed to send SDO write command after multiple retries");
-    }
-}
-
-void CanOpenMotor::write_od_i32(uint16_t index, uint8_t sub, int32_t value) {
-    uint8_t data[8];
-    data[0] = sdo_write_u32_header;
-    marshal_index(index, sub, &data[1]);
-    marshal_i32(value, &data[4]);
-
-    if (!send_sdo_with_retry(wrap_cob_id(COB_SDO_CLIENT2SERVER, node_id), data)) {
-        throw std::runtime_error("Failed to send SDO write command after multiple retries");
-    }
+void CanOpenMotor::write_od_i32(uint16_t index, uint8_t sub, int32_t value, const SdoCallback callback) {
+    this->sdo.write(index, sub, 32, static_cast<uint32_t>(value), callback);
 }
 
 void CanOpenMotor::sdo_read(uint16_t index, uint8_t sub) {
-    uint8_t data[8] = {sdo_read_header};
-    marshal_index(index, sub, &data[1]);
+    this->sdo.read(index, sub, [this](const SdoResult &result) {
+        if (result.abort_code) {
+            echo("Failed to read object [%02X.%01X]: %s", result.index, result.sub, get_sdo_abort_text(result.abort_code));
+            return;
+        }
+        this->handle_sdo_read(result);
+    });
+}
 
-    this->can->send(wrap_cob_id(COB_SDO_CLIENT2SERVER, node_id), data);
+SdoCallback CanOpenMotor::check_init_write() {
+    return [this](const SdoResult &result) {
+        if (result.abort_code) {
+            echo("Failed to write object [%02X.%01X] during initialization: %s", result.index, result.sub,
+                 get_sdo_abort_text(result.abort_code));
+            this->init_write_failed = true;
+        }
+    };
 }
 
 void CanOpenMotor::write_rpdo_mapping(uint32_t *entries, uint8_t entry_count, uint8_t rpdo) {
     assert(rpdo >= 1 && rpdo <= 4);
 
     /* Disable PDO (set invalid COB-ID) */
-    write_od_u32(rpdo_com_param_index(rpdo), 0x01, (uint32_t)-1);
+    write_od_u32(rpdo_com_param_index(rpdo), 0x01, (uint32_t)-1, check_init_write());
     /* Set mapping count to 0 before filling entries */
-    write_od_u8(rpdo_mappings_index(rpdo), 0x00, 0);
+    write_od_u8(rpdo_mappings_index(rpdo), 0x00, 0, check_init_write());
     /* Write mappings */
     for (uint8_t i = 0; i < entry_count; ++i) {
-        write_od_u32(rpdo_mappings_index(rpdo), i + 1, entries[i]);
+        write_od_u32(rpdo_mappings_index(rpdo), i + 1, entries[i], check_init_write());
     }
     /* Update mapping count to actual value */
-    write_od_u8(rpdo_mappings_index(rpdo), 0x00, entry_count);
-    write_od_u32(rpdo_com_param_index(rpdo), 0x01, wrap_cob_id(rpdo_func(rpdo), this->node_id));
+    write_od_u8(rpdo_mappings_index(rpdo), 0x00, entry_count, check_init_write());
+    write_od_u32(rpdo_com_param_index(rpdo), 0x01, wrap_cob_id(rpdo_func(rpdo), this->node_id), check_init_write());
 }
 
 void CanOpenMotor::configure_rpdos() {
@@ -339,11 +314,11 @@ void CanOpenMotor::configure_rpdos() {
 }
 
 void CanOpenMotor::configure_constants() {
-    write_od_u8(OP_MODE_U8, 0x00, OP_MODE_NONE);
-    write_od_u16(PROFILE_ACCELERATION_U32, 0x00, 1000);
-    write_od_u16(PROFILE_DECELERATION_U32, 0x00, 1000);
-    write_od_u16(QUICK_STOP_DECELERATION_U32, 0x00, 3000);
-    write_od_u16(CONTROL_WORD_U16, 0x00, build_ctrl_word(false));
+    write_od_u8(OP_MODE_U8, 0x00, OP_MODE_NONE, check_init_write());
+    write_od_u16(PROFILE_ACCELERATION_U32, 0x00, 1000, check_init_write());
+    write_od_u16(PROFILE_DECELERATION_U32, 0x00, 1000, check_init_write());
+    write_od_u16(QUICK_STOP_DECELERATION_U32, 0x00, 3000, check_init_write());
+    write_od_u16(CONTROL_WORD_U16, 0x00, build_ctrl_word(false), check_init_write());
 
     configure_rpdos();
 }
@@ -359,6 +334,9 @@ void CanOpenMotor::handle_heartbeat(const uint8_t *const data) {
 
     if (actual_state == Booting) {
         /* Possible reboot, restart initialization */
+        this->sdo.clear();
+        this->entering_mode = false;
+        this->deferred_pdos.clear();
         init_state = WaitingForPreoperational;
         this->properties[PROP_INITIALIZED]->boolean_value = false;
         return;
@@ -368,6 +346,7 @@ void CanOpenMotor::handle_heartbeat(const uint8_t *const data) {
         if (actual_state == Operational) {
             transition_preoperational();
         } else if (actual_state == Preoperational) {
+            this->init_write_failed = false;
             configure_constants();
             init_state = WaitingForSdoWrites;
         } else if (actual_state == Stopped) {
@@ -375,7 +354,13 @@ void CanOpenMotor::handle_heartbeat(const uint8_t *const data) {
         }
     } else if (init_state == WaitingForSdoWrites) {
         if (actual_state == Preoperational) {
-            if (this->properties[PROP_PENDING_WRITES]->integer_value > 0) {
+            if (this->sdo.get_pending(true) > 0) {
+                return;
+            }
+            if (this->init_write_failed) {
+                /* Do not go operational half-configured, try again */
+                this->init_write_failed = false;
+                configure_constants();
                 return;
             }
             transition_operational();
@@ -393,47 +378,13 @@ void CanOpenMotor::handle_heartbeat(const uint8_t *const data) {
     }
 }
 
-void CanOpenMotor::handle_sdo_reply(const uint8_t *const data) {
-    uint8_t scs = data[0] >> (8 - 3);
-    uint16_t index = data[1] | data[2] << 8;
-    uint8_t sub_index = data[3];
-    uint32_t value = demarshal_unsigned<uint32_t>(data + 4);
-
-    switch (scs) {
-    case ExpeditedReadData:
-        echo("Incoming read: [%02X.%01X]: %04X (%d)", index, sub_index, value, *reinterpret_cast<int32_t *>(&value));
-        switch (index) {
-        case OP_MODE_DISP_U16:
-            this->current_op_mode_disp = static_cast<uint16_t>(value);
-            break;
-        }
+void CanOpenMotor::handle_sdo_read(const SdoResult &result) {
+    const uint32_t value = result.get_u32();
+    echo("Incoming read: [%02X.%01X]: %04X (%d)", result.index, result.sub, value, static_cast<int32_t>(value));
+    switch (result.index) {
+    case OP_MODE_DISP_U16:
+        this->current_op_mode_disp = static_cast<uint16_t>(value);
         break;
-
-    case ExpeditedWriteSuccess:
-        assert(this->properties[PROP_PENDING_WRITES]->integer_value > 0);
-        this->properties[PROP_PENDING_WRITES]->integer_value--;
-        break;
-
-    case WriteFailure:
-        /* A failure still acknowledges the write operation */
-        this->properties[PROP_PENDING_WRITES]->integer_value--;
-
-        switch (value) {
-        case NonExistantObject:
-            echo("Attempting to write non-existant object [%02X.%01X]", index, sub_index);
-            break;
-
-        case SizeMismatch:
-            echo("Written size for object [%02X.%01X] does not match", index, sub_index);
-            break;
-
-        default:
-            echo("Unknown error [%04X] attempting to write object [%02X.%01X]", value, index, sub_index);
-        }
-        break;
-
-    default:
-        echo("Unknown server command specifier %u", scs);
     }
 }
 
@@ -510,7 +461,7 @@ void CanOpenMotor::handle_can_msg(const uint32_t id, const int count, const uint
         break;
 
     case COB_SDO_SERVER2CLIENT:
-        handle_sdo_reply(data);
+        this->sdo.handle_can_msg(id, count, data);
         break;
 
     case COB_TPDO1:
@@ -536,9 +487,12 @@ void CanOpenMotor::position(const double position, const double speed, const dou
     if (!this->enabled) {
         return;
     }
+    const int32_t target_position = static_cast<int32_t>(position) + this->properties[PROP_OFFSET]->integer_value;
     this->enter_position_mode(static_cast<int32_t>(speed));
-    this->send_target_position(static_cast<int32_t>(position) + this->properties[PROP_OFFSET]->integer_value);
-    send_control_word(build_ctrl_word(true));
+    this->send_in_mode([this, target_position]() {
+        this->send_target_position(target_position);
+        send_control_word(build_ctrl_word(true));
+    });
 }
 
 double CanOpenMotor::get_speed() {
@@ -550,11 +504,17 @@ void CanOpenMotor::speed(const double speed, const double acceleration) {
         return;
     }
     this->enter_velocity_mode(speed);
-    this->properties[PROP_CTRL_HALT]->boolean_value = false;
-    send_control_word(build_ctrl_word(false));
+    send_in_mode([this]() {
+        this->properties[PROP_CTRL_HALT]->boolean_value = false;
+        send_control_word(build_ctrl_word(false));
+    });
 }
 
 void CanOpenMotor::step() {
+    this->sdo.step();
+    this->properties[PROP_PENDING_READS]->integer_value = this->sdo.get_pending(false);
+    this->properties[PROP_PENDING_WRITES]->integer_value = this->sdo.get_pending(true);
+
     if (!this->properties[PROP_INITIALIZED]->boolean_value) {
         return;
     }
@@ -5,7 +5,9 @@
 #include "module.h"
 #include "motor.h"
 #include <cstdint>
+#include <functional>
 #include <memory>
+#include <vector>
 
 class CanOpenMotor;
 using CanOpenMotor_ptr = std::shared_ptr<CanOpenMotor>;
@@ -13,9 +15,11 @@ using CanOpenMotor_ptr = std::shared_ptr<CanOpenMotor>;
 class CanOpenMotor : public Module, public std::enable_shared_from_this<CanOpenMotor>, virtual public Motor {
     Can_ptr can;
     const uint8_t node_id;
+    SdoClient sdo;
     bool enabled = true;
 
     enum InitState init_state = WaitingForPreoperational;
+    bool init_write_failed = false; // configuration is repeated on the next heartbeat
 
     /* What the motor says it's in (currently not regularly polled) */
     uint16_t current_op_mode_disp;
@@ -23,18 +27,24 @@ class CanOpenMotor : public Module, public std::enable_shared_from_this<CanOpenM
     /* What we last requested */
     uint16_t current_op_mode;
 
+    /* PDOs for the requested mode, held back until the drive has acknowledged the mode change */
+    bool entering_mode = false;
+    uint32_t mode_request = 0; // acknowledgements of superseded mode changes are ignored
+    std::vector<std::function<void()>> deferred_pdos;
+
     void transition_preoperational();
     void transition_operational();
-    void write_od_u8(uint16_t index, uint8_t sub, uint8_t value);
-    void write_od_u16(uint16_t index, uint8_t sub, uint16_t value);
-    void write_od_u32(uint16_t index, uint8_t sub, uint32_t value);
-    void write_od_i32(uint16_t index, uint8_t sub, int32_t value);
+    void write_od_u8(uint16_t index, uint8_t sub, uint8_t value, const SdoCallback callback = nullptr);
+    void write_od_u16(uint16_t index, uint8_t sub, uint16_t value, const SdoCallback callback = nullptr);
+    void write_od_u32(uint16_t index, uint8_t sub, uint32_t value, const SdoCallback callback = nullptr);
+    void write_od_i32(uint16_t index, uint8_t sub, int32_t value, const SdoCallback callback = nullptr);
     void sdo_read(uint16_t index, uint8_t sub);
+    SdoCallback check_init_write();
     void write_rpdo_mapping(uint32_t *entries, uint8_t entry_count, uint8_t rpdo);
     void configure_rpdos();
     void configure_constants();
     void handle_heartbeat(const uint8_t *const data);
-    void handle_sdo_reply(const uint8_t *const data);
+    void handle_sdo_read(const SdoResult &result);
     void handle_tpdo1(const uint8_t *const data);
     void handle_tpdo2(const uint8_t *const data);
     void process_status_word_generic(const uint16_t status_word);
@@ -46,8 +56,8 @@ class CanOpenMotor : public Module, public std::enable_shared_from_this<CanOpenM
 
     uint16_t build_ctrl_word(bool new_set_point);
 
-    void wait_for_sdo_writes(uint32_t timeout_ms);
-    bool send_sdo_with_retry(uint32_t cob_id, const uint8_t *data);
+    void send_in_mode(const std::function<void()> send);
+    void change_mode(const uint8_t op_mode, const char *mode_name, const std::function<void()> on_entered);
     void enter_position_mode(int velocity);
     void enter_velocity_mode(int velocity);
 
@@ -1,9 +1,10 @@
 #include "core.h"
-#include "../global.h"
 #include "../storage.h"
 #include "../utils/bus_backup.h"
 #include "../utils/scheduler.h"
 #include "../utils/string_utils.h"
+#include "../utils/subscriptions.h"
+#include "../utils/telemetry.h"
 #include "../utils/timing.h"
 #include "../utils/uart.h"
 #include "driver/gpio.h"
@@ -13,6 +14,8 @@
 #include "hal/gpio_hal.h"
 #include "soc/io_mux_reg.h"
 #include "soc/soc.h"
+#include <algorithm>
+#include <limits>
 #include <memory>
 #include <stdexcept>
 #include <stdlib.h>
@@ -22,18 +25,27 @@ Core::Core(const std::string name) : Module(name) {
     this->properties["millis"] = std::make_shared<IntegerVariable>();
     this->properties["heap"] = std::make_shared<IntegerVariable>();
     this->properties["last_message_age"] = std::make_shared<IntegerVariable>();
+    this->properties["tx_dropped"] = std::make_shared<IntegerVariable>();
+    this->properties["tx_high_water"] = std::make_shared<IntegerVariable>();
 }
 
 void Core::step() {
     this->properties.at("millis")->integer_value = millis();
     this->properties.at("heap")->integer_value = xPortGetFreeHeapSize();
     this->properties.at("last_message_age")->integer_value = millis_since(this->last_message_millis);
+    this->properties.at("tx_dropped")->integer_value = get_echo_dropped();
+    this->properties.at("tx_high_water")->integer_value = get_echo_high_water();
+    if (this->output_on && this->output_binary) {
+        this->send_output_sample();
+    }
+    subscriptions::step();
     Module::step();
 }
 
 void Core::call(const std::string method_name, const std::vector<ConstExpression_ptr> arguments) {
     if (method_name == "restart") {
         Module::expect(arguments, 0);
+        flush_echo(100);
         esp_restart();
     } else if (method_name == "version") {
         const esp_app_desc_t *app_desc = esp_app_get_description();
@@ -57,25 +69,52 @@ void Core::call(const std::string method_name, const std::vector<ConstExpression
         echo("%s", buffer);
     } else if (method_name == "output") {
         Module::expect(arguments, 1, string);
-        this->output_list.clear();
-        std::string format = arguments[0]->evaluate_string();
-        while (!format.empty()) {
-            std::string element = cut_first_word(format);
-            if (element.find('.') == std::string::npos) {
-                // variable[:precision]
-                std::string variable_name = cut_first_word(element, ':');
-                const unsigned int precision = element.empty() ? 0 : atoi(element.c_str());
-                this->output_list.push_back({nullptr, variable_name, precision});
-            } else {
-                // module.property[:precision]
-                std::string module_name = cut_first_word(element, '.');
-                const ConstModule_ptr module = Global::get_module(module_name);
-                const std::string property_name = cut_first_word(element, ':');
-                const unsigned int precision = element.empty() ? 0 : atoi(element.c_str());
-                this->output_list.push_back({module, property_name, precision});
-            }
-        }
+        this->output_list = parse_output_format(arguments[0]->evaluate_string());
         this->output_on = true;
+        if (this->output_binary) {
+            this->send_output_schema();
+        }
+    } else if (method_name == "output_mode") {
+        if (arguments.empty() || arguments.size() > 2) {
+            throw std::runtime_error("unexpected number of arguments");
+        }
+        Module::expect(arguments, -1, string, boolean);
+        const std::string mode = arguments[0]->evaluate_string();
+        if (mode == "text") {
+            this->output_binary = false;
+        } else if (mode == "binary") {
+            this->output_binary = true;
+            this->output_timestamps = arguments.size() > 1 && arguments[1]->evaluate_boolean();
+            this->send_output_schema();
+        } else {
+            throw std::runtime_error("unknown output mode \"" + mode + "\" (use \"text\" or \"binary\")");
+        }
+    } else if (method_name == "tx_overflow") {
+        Module::expect(arguments, 1, string);
+        const std::string policy = arguments[0]->evaluate_string();
+        if (policy == "drop_newest") {
+            set_echo_overflow(OutputBuffer::drop_newest);
+        } else if (policy == "drop_oldest") {
+            set_echo_overflow(OutputBuffer::drop_oldest);
+        } else {
+            throw std::runtime_error("unknown overflow policy \"" + policy + "\" (use \"drop_newest\" or \"drop_oldest\")");
+        }
+    } else if (method_name == "subscribe") {
+        if (arguments.size() < 3 || arguments.size() > 5) {
+            throw std::runtime_error("unexpected number of arguments");
+        }
+        Module::expect(arguments, -1, string, string, string, numbery, numbery);
+        subscriptions::add(arguments[0]->evaluate_string(),
+                           arguments[1]->evaluate_string(),
+                           arguments[2]->evaluate_string(),
+                           arguments.size() > 3 ? arguments[3]->evaluate_number() : 0.0,
+                           arguments.size() > 4 ? arguments[4]->evaluate_number() : 0.0);
+    } else if (method_name == "unsubscribe") {
+        Module::expect(arguments, 1, string);
+        subscriptions::remove(arguments[0]->evaluate_string());
+    } else if (method_name == "subscriptions") {
+        Module::expect(arguments, 0);
+        subscriptions::list();
     } else if (method_name == "startup_checksum") {
         uint16_t checksum = 0;
         for (char const &c : Storage::startup) {
@@ -221,32 +260,65 @@ void Core::call(const std::string method_name, const std::vector<ConstExpression
 }
 
 std::string Core::get_output() const {
+    if (this->output_binary) {
+        return ""; // sent as a binary sample in step()
+    }
     static char output_buffer[1024];
     int pos = 0;
-    for (auto const &element : this->output_list) {
+    output_buffer[0] = '\0';
+    for (auto const &column : this->output_list) {
         if (pos > 0) {
             pos += csprintf(&output_buffer[pos], sizeof(output_buffer) - pos, " ");
         }
-        const Variable_ptr variable =
-            element.module ? element.module->get_property(element.property_name) : Global::get_variable(element.property_name);
+        pos += print_output_value(&output_buffer[pos], sizeof(output_buffer) - pos, column);
+    }
+    return std::string(output_buffer);
+}
+
+void Core::send_output_schema() {
+    // a new schema ID tells the host to drop the previous layout, also if it missed this packet
+    this->output_schema_id++;
+    this->output_sequence = 0;
+    telemetry::Packet packet(telemetry::PACKET_SCHEMA);
+    packet.put_u8(this->output_schema_id);
+    packet.put_u8(this->output_timestamps ? telemetry::FLAG_TIMESTAMPS : 0);
+    packet.put_u8(this->output_list.size());
+    for (auto const &column : this->output_list) {
+        packet.put_u8(column.variable->type);
+        packet.put_u8(column.precision);
+        packet.put_string(column.name);
+    }
+    packet.send();
+}
+
+void Core::send_output_sample() {
+    telemetry::Packet packet(telemetry::PACKET_SAMPLE);
+    packet.put_u8(this->output_schema_id);
+    packet.put_u8(this->output_sequence++);
+    if (this->output_timestamps) {
+        packet.put_u32(micros());
+    }
+    for (auto const &column : this->output_list) {
+        const Variable_ptr &variable = column.variable;
         switch (variable->type) {
         case boolean:
-            pos += csprintf(&output_buffer[pos], sizeof(output_buffer) - pos, "%s", variable->boolean_value ? "true" : "false");
+            packet.put_u8(variable->boolean_value);
             break;
         case integer:
-            pos += csprintf(&output_buffer[pos], sizeof(output_buffer) - pos, "%lld", variable->integer_value);
+            packet.put_i32(std::max<int64_t>(std::numeric_limits<int32_t>::min(),
+                                             std::min<int64_t>(std::numeric_limits<int32_t>::max(), variable->integer_value)));
             break;
         case number:
-            pos += csprintf(&output_buffer[pos], sizeof(output_buffer) - pos, "%.*f", element.precision, variable->number_value);
+            packet.put_f32(variable->number_value);
             break;
         case string:
-            pos += csprintf(&output_buffer[pos], sizeof(output_buffer) - pos, "\"%s\"", variable->string_value.c_str());
+            packet.put_string(variable->string_value);
             break;
         default:
             throw std::runtime_error("invalid type");
         }
     }
-    return std::string(output_buffer);
+    packet.send();
 }
 
 void Core::keep_alive() {
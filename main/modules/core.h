@@ -1,22 +1,25 @@
 #pragma once
 
+#include "../utils/output_format.h"
 #include "module.h"
 #include <memory>
 #include <utility>
-
-struct output_element_t {
-    const ConstModule_ptr module;
-    const std::string property_name;
-    const unsigned int precision;
-};
+#include <vector>
 
 class Core;
 using Core_ptr = std::shared_ptr<Core>;
 
 class Core : public Module {
 private:
-    std::list<struct output_element_t> output_list;
+    std::vector<OutputColumn> output_list;
     unsigned long int last_message_millis = 0;
+    bool output_binary = false;
+    bool output_timestamps = false;
+    uint8_t output_schema_id = 0;
+    uint8_t output_sequence = 0;
+
+    void send_output_schema();
+    void send_output_sample();
 
 public:
     Core(const std::string name);
@@ -1,8 +1,6 @@
 #include "d1_motor.h"
-#include "canopen.h"
 #include "module_helpers.h"
 #include "uart.h"
-#include "utils/timing.h"
 #include <cinttypes>
 
 static Module_ptr create_d1_motor(const std::string &name, const std::vector<ConstExpression_ptr> &arguments, MessageHandler) {
@@ -32,41 +30,26 @@ const std::map<std::string, Variable_ptr> D1Motor::get_defaults() {
 }
 
 D1Motor::D1Motor(const std::string &name, Can_ptr can, int64_t node_id)
-    : Module(name), can(can), node_id(check_node_id(node_id)) {
+    : Module(name), can(can), node_id(check_node_id(node_id)), sdo(can, this->node_id, 4) {
     this->properties = D1Motor::get_defaults();
 }
 
 void D1Motor::subscribe_to_can() {
-    can->subscribe(0x700 + node_id, this->shared_from_this()); // NMT response
     can->subscribe(0x580 + node_id, this->shared_from_this()); // SDO response
 }
 
 void D1Motor::sdo_read(const uint16_t index, const uint8_t sub) {
-    uint8_t data[8];
-    data[0] = 0x40;
-    data[1] = (index >> 0) & 0xFF;
-    data[2] = (index >> 8) & 0xFF;
-    data[3] = sub;
-    this->can->send(0x600 + this->node_id, data);
+    this->sdo.read(index, sub, [this](const SdoResult &result) {
+        if (result.abort_code) {
+            echo("error: SDO read of 0x%04X.%02X failed: %s", result.index, result.sub, get_sdo_abort_text(result.abort_code));
+            return;
+        }
+        this->handle_sdo_read(result);
+    });
 }
 
-void D1Motor::sdo_write(const uint16_t index, const uint8_t sub, const uint8_t bits, const uint32_t value, const bool wait) {
-    this->waiting_sdo_writes++;
-    uint8_t data[8];
-    data[0] = bits == 8    ? 0x2F
-              : bits == 16 ? 0x2B
-                           : 0x23;
-    data[1] = (index >> 0) & 0xFF;
-    data[2] = (index >> 8) & 0xFF;
-    data[3] = sub;
-    data[4] = (value >> 0) & 0xFF;
-    data[5] = (value >> 8) & 0xFF;
-    data[6] = (value >> 16) & 0xFF;
-    data[7] = (value >> 24) & 0xFF;
-    this->can->send(0x600 + this->node_id, data);
-    if (wait) {
-        this->wait();
-    }
+void D1Motor::sdo_write(const uint16_t index, const uint8_t sub, const uint8_t bits, const uint32_t value) {
+    this->sdo.write(index, sub, bits, value);
 }
 
 void D1Motor::nmt_write(const uint8_t cs) {
@@ -74,23 +57,6 @@ void D1Motor::nmt_write(const uint8_t cs) {
     data[0] = cs;
     data[1] = this->node_id;
     this->can->send(0x000, data);
-    this->wait();
-}
-
-void D1Motor::wait() {
-    const int TIMEOUT = 1000;
-    const int INTERVAL = 10;
-    for (int i = 0; i < TIMEOUT / INTERVAL; ++i) {
-        while (this->can->receive())
-            ;
-        if (this->waiting_nmt_writes || this->waiting_sdo_writes) {
-            return;
-        }
-        delay(INTERVAL);
-    }
-    echo("error: timeout while waiting for response");
-    this->waiting_nmt_writes = 0;
-    this->waiting_sdo_writes = 0;
 }
 
 void D1Motor::call(const std::string method_name, const std::vector<ConstExpression_ptr> arguments) {
@@ -142,10 +108,19 @@ void D1Motor::call(const std::string method_name, const std::vector<ConstExpress
 }
 
 void D1Motor::step() {
-    this->sdo_read(0x6041, 0);
-    this->sdo_read(0x2014, 0);
-    this->sdo_read(0x6064, 0);
-    this->sdo_read(0x606C, 0);
+    this->sdo.step();
+    if (this->pending_status_reads == 0) {
+        // polled again once all answers arrived, so that an unresponsive drive does not fill the queue
+        for (const uint16_t index : {0x6041, 0x2014, 0x6064, 0x606C}) {
+            this->sdo.read(index, 0, [this](const SdoResult &result) {
+                this->pending_status_reads--;
+                if (!result.abort_code) {
+                    this->handle_sdo_read(result);
+                }
+            }, CanTxQueue::DIAGNOSTIC);
+            this->pending_status_reads++; // only counted once queued, read() throws if the queue is full
+        }
+    }
     if (this->properties.at("enabled")->boolean_value != this->enabled) {
         if (this->properties.at("enabled")->boolean_value) {
             this->enable();
@@ -157,22 +132,22 @@ void D1Motor::step() {
 }
 
 void D1Motor::handle_can_msg(const uint32_t id, const int count, const uint8_t *const data) {
-    if (id == 0x700 + this->node_id) {
-        this->waiting_nmt_writes--;
-    } else if (id == 0x580 + this->node_id) {
-        this->waiting_sdo_writes--;
-        if (data[1] == 0x41 && data[2] == 0x60) {
-            this->properties["status_word"]->integer_value = data[5] << 8 | data[4];
-        }
-        if (data[1] == 0x14 && data[2] == 0x20) {
-            this->properties["status_flags"]->integer_value = data[4];
-        }
-        if (data[1] == 0x64 && data[2] == 0x60) {
-            this->properties["position"]->integer_value = data[5] << 8 | data[4];
-        }
-        if (data[1] == 0x6C && data[2] == 0x60) {
-            this->properties["velocity"]->integer_value = (data[7] << 24) | (data[6] << 16) | (data[5] << 8) | data[4];
-        }
+    this->sdo.handle_can_msg(id, count, data);
+}
+
+void D1Motor::handle_sdo_read(const SdoResult &result) {
+    const uint32_t value = result.get_u32();
+    if (result.index == 0x6041) {
+        this->properties["status_word"]->integer_value = value & 0xFFFF;
+    }
+    if (result.index == 0x2014) {
+        this->properties["status_flags"]->integer_value = value & 0xFF;
+    }
+    if (result.index == 0x6064) {
+        this->properties["position"]->integer_value = value & 0xFFFF;
+    }
+    if (result.index == 0x606C) {
+        this->properties["velocity"]->integer_value = static_cast<int32_t>(value);
     }
 }
 
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "can.h"
+#include "canopen.h"
 #include "module.h"
 #include <cstdint>
 #include <memory>
@@ -12,14 +13,14 @@ class D1Motor : public Module, public std::enable_shared_from_this<D1Motor> {
 private:
     Can_ptr can;
     const uint8_t node_id;
-    int waiting_nmt_writes = 0;
-    int waiting_sdo_writes = 0;
+    SdoClient sdo;
+    int pending_status_reads = 0;
     bool enabled = true;
 
     void sdo_read(const uint16_t index, const uint8_t sub);
     void nmt_write(const uint8_t cs);
-    void sdo_write(const uint16_t index, const uint8_t sub, const uint8_t bits, const uint32_t value, const bool wait = true);
-    void wait();
+    void sdo_write(const uint16_t index, const uint8_t sub, const uint8_t bits, const uint32_t value);
+    void handle_sdo_read(const SdoResult &result);
 
 public:
     static inline constexpr const char *TYPE = "D1Motor";
@@ -1,5 +1,4 @@
 #include "dunker_motor.h"
-#include "canopen.h"
 #include "module_helpers.h"
 #include "utils/timing.h"
 #include "utils/uart.h"
@@ -27,7 +26,7 @@ const std::map<std::string, Variable_ptr> DunkerMotor::get_defaults() {
 }
 
 DunkerMotor::DunkerMotor(const std::string &name, Can_ptr can, int64_t node_id)
-    : Module(name), can(can), node_id(check_node_id(node_id)) {
+    : Module(name), can(can), node_id(check_node_id(node_id)), sdo(can, this->node_id, 4) {
     this->properties = DunkerMotor::get_defaults();
 }
 
@@ -36,27 +35,38 @@ void DunkerMotor::subscribe_to_can() {
     can->subscribe(0x580 + node_id, this->shared_from_this()); // SDO response
     can->subscribe(0x180 + node_id, this->shared_from_this()); // TPDO1
 
-    // restart device
+    // restart device, configured when its boot-up message arrives (see handle_can_msg() and step())
     this->nmt_write(0x81);
+    this->is_booting = true;
+    this->boot_time = millis();
+}
+
+void DunkerMotor::configure() {
+    this->is_booting = false;
 
     // setup TPDO1: measured velocity
     this->sdo_write(0x1800, 1, 32, -1);
     this->sdo_write(0x1A00, 0, 8, 0);
     this->sdo_write(0x1A00, 1, 32, (0x4A04 << 16) | (2 << 8) | 32); // 0x4A04.02: measured velocity
     this->sdo_write(0x1A00, 0, 8, 1);
-    this->sdo_write(0x1800, 1, 32, 0x180 + this->node_id);
 
-    // enter operational state
-    this->nmt_write(0x01);
+    // enter operational state once the configuration is written
+    this->sdo.write(0x1800, 1, 32, 0x180 + this->node_id, [this](const SdoResult &result) {
+        if (result.abort_code) {
+            echo("error: could not configure TPDO1: %s", get_sdo_abort_text(result.abort_code));
+        }
+        this->nmt_write(0x01);
+    });
 }
 
 void DunkerMotor::sdo_read(const uint16_t index, const uint8_t sub) {
-    uint8_t data[8];
-    data[0] = 0x40;
-    data[1] = (index >> 0) & 0xFF;
-    data[2] = (index >> 8) & 0xFF;
-    data[3] = sub;
-    this->can->send(0x600 + this->node_id, data);
+    this->sdo.read(index, sub, [this](const SdoResult &result) {
+        if (result.abort_code) {
+            echo("error: SDO read of 0x%04X.%02X failed: %s", result.index, result.sub, get_sdo_abort_text(result.abort_code));
+            return;
+        }
+        this->handle_sdo_read(result);
+    }, CanTxQueue::DIAGNOSTIC);
 }
 
 void DunkerMotor::nmt_write(const uint8_t cs) {
@@ -64,42 +74,10 @@ void DunkerMotor::nmt_write(const uint8_t cs) {
     data[0] = cs;
     data[1] = this->node_id;
     this->can->send(0x000, data);
-    this->wait();
 }
 
-void DunkerMotor::sdo_write(const uint16_t index, const uint8_t sub, const uint8_t bits, const uint32_t value, const bool wait) {
-    this->waiting_sdo_writes++;
-    uint8_t data[8];
-    data[0] = bits == 8    ? 0x2F
-              : bits == 16 ? 0x2B
-                           : 0x23;
-    data[1] = (index >> 0) & 0xFF;
-    data[2] = (index >> 8) & 0xFF;
-    data[3] = sub;
-    data[4] = (value >> 0) & 0xFF;
-    data[5] = (value >> 8) & 0xFF;
-    data[6] = (value >> 16) & 0xFF;
-    data[7] = (value >> 24) & 0xFF;
-    this->can->send(0x600 + this->node_id, data);
-    if (wait) {
-        this->wait();
-    }
-}
-
-void DunkerMotor::wait() {
-    const int TIMEOUT = 1000;
-    const int INTERVAL = 10;
-    for (int i = 0; i < TIMEOUT / INTERVAL; ++i) {
-        while (this->can->receive())
-            ;
-        if (this->waiting_nmt_writes || this->waiting_sdo_writes) {
-            return;
-        }
-        delay(INTERVAL);
-    }
-    echo("error: timeout while waiting for response");
-    this->waiting_nmt_writes = 0;
-    this->waiting_sdo_writes = 0;
+void DunkerMotor::sdo_write(const uint16_t index, const uint8_t sub, const uint8_t bits, const uint32_t value) {
+    this->sdo.write(index, sub, bits, value);
 }
 
 void DunkerMotor::call(const std::string method_name, const std::vector<ConstExpression_ptr> arguments) {
@@ -137,18 +115,10 @@ void DunkerMotor::call(const std::string method_name, const std::vector<ConstExp
 }
 
 void DunkerMotor::handle_can_msg(const uint32_t id, const int count, const uint8_t *const data) {
-    if (id == 0x700 + this->node_id) {
-        this->waiting_nmt_writes--;
-    }
-    if (id == 0x580 + this->node_id) {
-        this->waiting_sdo_writes--;
-        if (data[0] == 0x43 && data[1] == 0x10 && data[2] == 0x41 && data[3] == 0x01) {
-            this->properties["voltage_logic"]->number_value = ((data[5] << 8) | data[4]) / 1000.0;
-        }
-        if (data[0] == 0x43 && data[1] == 0x11 && data[2] == 0x41 && data[3] == 0x01) {
-            this->properties["voltage_power"]->number_value = ((data[5] << 8) | data[4]) / 1000.0;
-        }
+    if (id == 0x700 + this->node_id && count > 0 && data[0] == 0x00 && this->is_booting) {
+        this->configure(); // boot-up message
     }
+    this->sdo.handle_can_msg(id, count, data);
     if (id == 0x180 + this->node_id) {
         const int32_t motor_speed = demarshal_i32(data);
         this->properties["speed"]->number_value = motor_speed *
@@ -165,7 +135,7 @@ void DunkerMotor::speed(const double speed) {
                                 this->properties.at("m_per_turn")->number_value /
                                 (this->properties.at("reversed")->boolean_value ? -1 : 1) *
                                 60;
-    this->sdo_write(0x4300, 1, 32, motor_speed, false);
+    this->sdo.write(0x4300, 1, 32, motor_speed, nullptr, true);
 }
 
 double DunkerMotor::get_speed() {
@@ -184,7 +154,20 @@ void DunkerMotor::disable() {
     this->properties.at("enabled")->boolean_value = false;
 }
 
+void DunkerMotor::handle_sdo_read(const SdoResult &result) {
+    if (result.index == 0x4110 && result.sub == 1) {
+        this->properties["voltage_logic"]->number_value = (result.get_u32() & 0xFFFF) / 1000.0;
+    }
+    if (result.index == 0x4111 && result.sub == 1) {
+        this->properties["voltage_power"]->number_value = (result.get_u32() & 0xFFFF) / 1000.0;
+    }
+}
+
 void DunkerMotor::step() {
+    if (this->is_booting && millis_since(this->boot_time) > 1000) {
+        this->configure(); // no boot-up message
+    }
+    this->sdo.step();
     if (this->properties.at("enabled")->boolean_value != this->enabled) {
         if (this->properties.at("enabled")->boolean_value) {
             this->enable();
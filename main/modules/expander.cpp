@@ -1,16 +1,25 @@
 #include "expander.h"
 
+#include "../global.h"
 #include "module_helpers.h"
 #include "serial.h"
 #include "storage.h"
+#include "utils/proxy_channel.h"
 #include "utils/serial-replicator.h"
 #include "utils/string_utils.h"
+#include "utils/telemetry.h"
 #include "utils/timing.h"
 #include "utils/uart.h"
 #include <algorithm>
 #include <cstring>
 #include <stdexcept>
 
+// the line buffers on the other side hold 1024 bytes, including the checksum
+static constexpr size_t MAX_LINE_LENGTH = 1000;
+static constexpr size_t MAX_DEFERRED_SIZE = 4096; // bytes of lines held back while the expander boots
+
+static std::vector<std::weak_ptr<Expander>> expanders; // for flush_all()
+
 static Module_ptr create_expander(const std::string &name, const std::vector<ConstExpression_ptr> &arguments, MessageHandler message_handler) {
     if (arguments.size() != 1 && arguments.size() != 3) {
         throw std::runtime_error("unexpected number of arguments");
@@ -19,7 +28,9 @@ static Module_ptr create_expander(const std::string &name, const std::vector<Con
     const ConstSerial_ptr serial = get_module_argument<const Serial>(arguments[0]);
     const gpio_num_t boot_pin = arguments.size() > 1 ? (gpio_num_t)arguments[1]->evaluate_integer() : GPIO_NUM_NC;
     const gpio_num_t enable_pin = arguments.size() > 2 ? (gpio_num_t)arguments[2]->evaluate_integer() : GPIO_NUM_NC;
-    return std::make_shared<Expander>(name, serial, boot_pin, enable_pin, message_handler);
+    const Expander_ptr expander = std::make_shared<Expander>(name, serial, boot_pin, enable_pin, message_handler);
+    expanders.push_back(expander);
+    return expander;
 }
 REGISTER_MODULE(Expander, &create_expander)
 
@@ -56,22 +67,39 @@ Expander::Expander(const std::string name,
     }
 
     this->restart();
-    const unsigned long boot_timeout = this->get_property("boot_timeout")->number_value * 1000;
-    while (this->properties.at("is_ready")->boolean_value == false) {
-        if (boot_timeout > 0 && millis_since(this->boot_start_time) > boot_timeout) {
+}
+
+void Expander::step() {
+    switch (this->boot_state) {
+    case BootState::RESETTING:
+        if (millis_since(this->boot_start_time) >= 100) {
+            gpio_set_level(this->enable_pin, 1);
+            this->boot_state = BootState::BOOTING;
+            this->boot_start_time = millis();
+        }
+        break;
+    case BootState::BOOTING: {
+        this->check_boot_progress();
+        const unsigned long boot_timeout = this->get_property("boot_timeout")->number_value * 1000;
+        if (this->boot_state == BootState::BOOTING && boot_timeout > 0 && millis_since(this->boot_start_time) > boot_timeout) {
             echo("warning: expander %s connection timed out.", this->name.c_str());
             // TODO: trigger error code
-            break;
+            if (!this->deferred_lines.empty()) {
+                echo("warning: expander %s dropped %d queued statements", this->name.c_str(), static_cast<int>(this->deferred_lines.size()));
+                this->deferred_lines.clear();
+                this->deferred_size = 0;
+            }
+            this->recreated_proxies = this->proxies.size(); // including those whose creation was dropped
+            this->set_offline();
         }
-        this->check_boot_progress();
-        delay(30);
+        break;
     }
-}
-
-void Expander::step() {
-    if (this->properties.at("is_ready")->boolean_value) {
+    case BootState::READY:
         this->ping();
         this->handle_messages();
+        break;
+    case BootState::OFFLINE:
+        break;
     }
     this->properties.at("last_message_age")->integer_value = millis_since(this->last_message_millis);
     Module::step();
@@ -94,19 +122,49 @@ void Expander::check_boot_progress() {
         this->last_message_millis = millis();
         echo("%s: %s", this->name.c_str(), buffer);
         if (strcmp("Ready.", buffer) == 0) {
-            this->properties.at("is_ready")->boolean_value = true;
             echo("%s: Booting process completed successfully", this->name.c_str());
+            this->set_ready();
             break;
         }
     }
 }
 
+void Expander::set_ready() {
+    this->boot_state = BootState::READY;
+    this->properties.at("is_ready")->boolean_value = true;
+    // a fresh boot has none of the remote modules, so the proxies from before the boot are created again first,
+    // followed by everything written during the boot in script order, which includes the creation of newer proxies
+    static char buffer[512];
+    for (size_t proxy_id = 0; proxy_id < this->recreated_proxies; ++proxy_id) {
+        this->serial->write_checked_line(buffer, this->format_proxy(proxy_id, buffer, sizeof(buffer)));
+    }
+    for (const std::string &line : this->deferred_lines) {
+        this->serial->write_checked_line(line.c_str(), line.size());
+    }
+    this->deferred_lines.clear();
+    this->deferred_size = 0;
+    this->recreated_proxies = this->proxies.size();
+    for (ProxyBinding &proxy : this->proxies) {
+        proxy.is_ready->boolean_value = true;
+    }
+}
+
+void Expander::set_offline() {
+    this->boot_state = BootState::OFFLINE;
+    this->properties.at("is_ready")->boolean_value = false;
+    for (ProxyBinding &proxy : this->proxies) {
+        proxy.is_ready->boolean_value = false;
+        proxy.property_names.clear(); // text until the expander sends a new schema
+    }
+}
+
 void Expander::ping() {
     const double last_message_age = this->get_property("last_message_age")->integer_value / 1000.0;
     const double ping_interval = this->get_property("ping_interval")->number_value;
     const double ping_timeout = this->get_property("ping_timeout")->number_value;
     if (!this->ping_pending) {
         if (last_message_age >= ping_interval) {
+            this->flush();
             this->serial->write_checked_line("core.print('__PONG__')");
             this->ping_pending = true;
         }
@@ -114,22 +172,27 @@ void Expander::ping() {
         if (last_message_age >= ping_interval + ping_timeout) {
             echo("warning: expander %s connection lost", this->name.c_str());
             // TODO: trigger error code
-            this->properties.at("is_ready")->boolean_value = false;
+            this->set_offline();
         }
     }
 }
 
 void Expander::restart() {
+    if (!this->is_booting()) {
+        this->recreated_proxies = this->proxies.size();
+    }
     this->ping_pending = false;
+    this->set_offline();
     if (this->boot_pin != GPIO_NUM_NC && this->enable_pin != GPIO_NUM_NC) {
+        // released again by step(), so that several expanders can boot in parallel
         gpio_set_level(this->enable_pin, 0);
-        delay(100);
-        gpio_set_level(this->enable_pin, 1);
+        this->boot_state = BootState::RESETTING;
     } else {
+        this->flush();
         this->serial->write_checked_line("core.restart()");
+        this->boot_state = BootState::BOOTING;
     }
     this->boot_start_time = millis();
-    this->properties.at("is_ready")->boolean_value = false;
 }
 
 void Expander::handle_messages(bool check_for_strapping_pins) {
@@ -140,6 +203,12 @@ void Expander::handle_messages(bool check_for_strapping_pins) {
             echo("%s: error while handling messages: %s", this->name.c_str(), Serial::read_line_error(len));
             continue;
         }
+        if (len > 0 && (!this->frame.empty() || this->discarding_frame || buffer[0] == '\0')) {
+            this->last_message_millis = millis();
+            this->ping_pending = false;
+            this->receive_frame_piece(buffer, len);
+            continue;
+        }
         bool checksum_ok = true;
         len = check(buffer, len, &checksum_ok);
         if (!checksum_ok) {
@@ -163,11 +232,77 @@ void Expander::handle_messages(bool check_for_strapping_pins) {
     }
 }
 
+void Expander::receive_frame_piece(const char *data, const size_t length) {
+    // A binary frame "0x00 <COBS data> 0x00" is followed by a newline for the line detection.
+    // The COBS data may contain newlines as well, so a frame can arrive in several pieces.
+    const size_t start = this->frame.empty() && !this->discarding_frame ? 1 : 0;
+    const char *const frame_end = static_cast<const char *>(std::memchr(&data[start], '\0', length - start));
+    if (this->discarding_frame || this->frame.size() + length > telemetry::MAX_FRAME_SIZE) {
+        if (!this->discarding_frame) {
+            echo("%s: discarded binary frame, too long", this->name.c_str());
+        }
+        this->discarding_frame = !frame_end;
+        this->frame.clear();
+        return;
+    }
+    this->frame.append(data, frame_end ? frame_end - data : length);
+    if (frame_end) {
+        try {
+            this->handle_frame(reinterpret_cast<const uint8_t *>(&this->frame[1]), this->frame.size() - 1);
+        } catch (const std::runtime_error &e) {
+            echo("%s: error while handling binary frame: %s", this->name.c_str(), e.what());
+        }
+        this->frame.clear();
+    }
+}
+
+void Expander::handle_frame(const uint8_t *data, const size_t length) {
+    static uint8_t payload[telemetry::MAX_FRAME_SIZE];
+    const size_t payload_len = telemetry::cobs_decode(data, length, payload);
+    if (payload_len < 3) {
+        throw std::runtime_error("invalid frame");
+    }
+    const uint16_t crc = payload[payload_len - 2] | payload[payload_len - 1] << 8;
+    if (telemetry::crc16(payload, payload_len - 2) != crc) {
+        throw std::runtime_error("CRC mismatch");
+    }
+    const uint8_t *const end = &payload[payload_len - 2];
+    if (payload[0] == telemetry::PACKET_PROXY_SCHEMA) {
+        if (payload_len < 5 || payload[1] >= this->proxies.size()) {
+            throw std::runtime_error("invalid proxy schema");
+        }
+        std::vector<std::string> property_names;
+        const uint8_t *p = &payload[3];
+        for (int i = 0; i < payload[2]; ++i) {
+            if (p >= end || p + 1 + *p > end) {
+                throw std::runtime_error("truncated proxy schema");
+            }
+            property_names.emplace_back(reinterpret_cast<const char *>(p + 1), *p);
+            p += 1 + *p;
+        }
+        this->proxies[payload[1]].property_names = std::move(property_names);
+    } else if (payload[0] == telemetry::PACKET_PROXY_UPDATE) {
+        proxy_channel::read_updates(&payload[1], end - &payload[1], [this](const uint8_t proxy_id, const uint8_t property_id, const ConstExpression_ptr &value) {
+            if (proxy_id >= this->proxies.size() || property_id >= this->proxies[proxy_id].property_names.size()) {
+                return; // before the schema arrived, it is repeated with the next full refresh
+            }
+            ProxyBinding &proxy = this->proxies[proxy_id];
+            if (!proxy.module) {
+                proxy.module = Global::get_module(proxy.name);
+            }
+            proxy.module->write_property(proxy.property_names[property_id], value, true);
+        });
+    } else {
+        throw std::runtime_error("unexpected packet type " + std::to_string(payload[0]));
+    }
+}
+
 void Expander::call(const std::string method_name, const std::vector<ConstExpression_ptr> arguments) {
+    this->flush(); // keep the order of queued proxy operations and the lines sent below
     if (method_name == "run") {
         Module::expect(arguments, 1, string);
         std::string command = arguments[0]->evaluate_string();
-        this->serial->write_checked_line(command.c_str(), command.length());
+        this->write_line(command.c_str(), command.length());
     } else if (method_name == "restart") {
         Module::expect(arguments, 0);
         restart();
@@ -219,7 +354,7 @@ void Expander::call(const std::string method_name, const std::vector<ConstExpres
         int pos = csprintf(buffer, sizeof(buffer), "core.%s(", method_name.c_str());
         pos += write_arguments_to_buffer(arguments, &buffer[pos], sizeof(buffer) - pos);
         pos += csprintf(&buffer[pos], sizeof(buffer) - pos, ")");
-        this->serial->write_checked_line(buffer, pos);
+        this->write_line(buffer, pos);
     }
 }
 
@@ -247,7 +382,7 @@ void Expander::check_strapping_pins(const char *buffer) {
 
 void Expander::deinstall() {
     this->serial->deinstall();
-    this->properties.at("is_ready")->boolean_value = false;
+    this->set_offline();
     if (this->boot_pin != GPIO_NUM_NC && this->enable_pin != GPIO_NUM_NC) {
         gpio_reset_pin(this->boot_pin);
         gpio_reset_pin(this->enable_pin);
@@ -258,20 +393,47 @@ void Expander::deinstall() {
     }
 }
 
-void Expander::send_proxy(const std::string module_name, const std::string module_type, const std::vector<ConstExpression_ptr> arguments) {
+bool Expander::add_proxy(const std::string module_name, const std::string module_type, const std::vector<ConstExpression_ptr> arguments, const Variable_ptr is_ready) {
+    this->proxies.push_back({module_name, module_type, arguments, is_ready, nullptr, {}});
+    if (this->boot_state == BootState::OFFLINE) {
+        return false; // created by set_ready() after the next restart
+    }
+    // while booting, the creation is queued in order with the other statements
+    this->send_proxy(this->proxies.size() - 1);
+    if (this->boot_state != BootState::READY) {
+        return false;
+    }
+    is_ready->boolean_value = true;
+    return true;
+}
+
+int Expander::format_proxy(const size_t proxy_id, char *buffer, const size_t buffer_size) const {
+    const ProxyBinding &proxy = this->proxies[proxy_id];
+    const char *const module_name = proxy.name.c_str();
+    int pos = csprintf(buffer, buffer_size, "%s = %s(", module_name, proxy.module_type.c_str());
+    pos += write_arguments_to_buffer(proxy.arguments, &buffer[pos], buffer_size - pos);
+    pos += csprintf(&buffer[pos], buffer_size - pos, "); ");
+    pos += csprintf(&buffer[pos], buffer_size - pos, "%s.broadcast()", module_name);
+    if (proxy_id < proxy_channel::MAX_PROXIES) {
+        // expanders without binary proxies answer with an error and keep broadcasting text
+        pos += csprintf(&buffer[pos], buffer_size - pos, "; %s.bind_proxy(%d)", module_name, static_cast<int>(proxy_id));
+    }
+    return pos;
+}
+
+void Expander::send_proxy(const size_t proxy_id) {
     static char buffer[512];
-    int pos = csprintf(buffer, sizeof(buffer), "%s = %s(", module_name.c_str(), module_type.c_str());
-    pos += write_arguments_to_buffer(arguments, &buffer[pos], sizeof(buffer) - pos);
-    pos += csprintf(&buffer[pos], sizeof(buffer) - pos, "); ");
-    pos += csprintf(&buffer[pos], sizeof(buffer) - pos, "%s.broadcast()", module_name.c_str());
-    this->serial->write_checked_line(buffer, pos);
+    this->queue_statement(buffer, this->format_proxy(proxy_id, buffer, sizeof(buffer)));
 }
 
 void Expander::send_property(const std::string proxy_name, const std::string property_name, const ConstExpression_ptr expression) {
+    if (this->send_binary_property(proxy_name, property_name, expression)) {
+        return;
+    }
     static char buffer[512];
     int pos = csprintf(buffer, sizeof(buffer), "%s.%s = ", proxy_name.c_str(), property_name.c_str());
     pos += expression->print_to_buffer(&buffer[pos], sizeof(buffer) - pos);
-    this->serial->write_checked_line(buffer, pos);
+    this->queue_statement(buffer, pos);
 }
 
 void Expander::send_call(const std::string proxy_name, const std::string method_name, const std::vector<ConstExpression_ptr> arguments) {
@@ -279,5 +441,94 @@ void Expander::send_call(const std::string proxy_name, const std::string method_
     int pos = csprintf(buffer, sizeof(buffer), "%s.%s(", proxy_name.c_str(), method_name.c_str());
     pos += write_arguments_to_buffer(arguments, &buffer[pos], sizeof(buffer) - pos);
     pos += csprintf(&buffer[pos], sizeof(buffer) - pos, ")");
-    this->serial->write_checked_line(buffer, pos);
+    this->queue_statement(buffer, pos);
+}
+
+bool Expander::send_binary_property(const std::string &proxy_name, const std::string &property_name, const ConstExpression_ptr expression) {
+    const auto proxy = std::find_if(this->proxies.begin(), this->proxies.end(), [&](const ProxyBinding &p) { return p.name == proxy_name; });
+    if (proxy == this->proxies.end()) {
+        return false;
+    }
+    const auto &property_names = proxy->property_names;
+    const auto property = std::find(property_names.begin(), property_names.end(), property_name);
+    if (property == property_names.end()) {
+        return false;
+    }
+    Variable variable(expression->type);
+    variable.assign(expression);
+    std::string value;
+    if (!proxy_channel::encode_value(variable, value)) {
+        return false;
+    }
+    if (value.size() + 2 > proxy_channel::MAX_BATCH_SIZE) {
+        return false;
+    }
+    this->flush_statements(); // statements queued before this update must arrive first
+    if (this->pending_updates.size() + value.size() + 2 > proxy_channel::MAX_BATCH_SIZE) {
+        this->flush_updates();
+    }
+    this->pending_updates += static_cast<char>(proxy - this->proxies.begin());
+    this->pending_updates += static_cast<char>(property - property_names.begin());
+    this->pending_updates += value;
+    return true;
+}
+
+bool Expander::is_booting() const {
+    return this->boot_state == BootState::RESETTING || this->boot_state == BootState::BOOTING;
+}
+
+void Expander::write_line(const char *line, const size_t length) {
+    if (!this->is_booting()) {
+        this->serial->write_checked_line(line, length);
+        return;
+    }
+    // a booting expander would drop the line
+    if (this->deferred_size + length > MAX_DEFERRED_SIZE) {
+        throw std::runtime_error("expander \"" + this->name + "\" is booting and cannot queue more statements");
+    }
+    this->deferred_lines.emplace_back(line, length);
+    this->deferred_size += length;
+}
+
+void Expander::queue_statement(const char *statement, const int length) {
+    this->flush_updates(); // updates queued before this statement must arrive first
+    if (!this->pending_statements.empty() && this->pending_statements.size() + 1 + length > MAX_LINE_LENGTH) {
+        this->flush_statements();
+    }
+    if (!this->pending_statements.empty()) {
+        this->pending_statements += ';';
+    }
+    this->pending_statements.append(statement, length);
+}
+
+void Expander::flush_statements() {
+    if (!this->pending_statements.empty()) {
+        const std::string line = std::move(this->pending_statements);
+        this->pending_statements.clear();
+        this->write_line(line.c_str(), line.size());
+    }
+}
+
+void Expander::flush_updates() {
+    if (!this->pending_updates.empty()) {
+        telemetry::Packet packet(telemetry::PACKET_PROXY_UPDATE);
+        packet.put_bytes(reinterpret_cast<const uint8_t *>(this->pending_updates.data()), this->pending_updates.size());
+        static uint8_t frame[telemetry::MAX_FRAME_SIZE];
+        this->serial->write(frame, packet.encode(frame, true));
+        this->pending_updates.clear();
+    }
+}
+
+void Expander::flush() {
+    // at most one of both is pending, queueing one kind flushes the other
+    this->flush_statements();
+    this->flush_updates();
+}
+
+void Expander::flush_all() {
+    for (const std::weak_ptr<Expander> &weak_expander : expanders) {
+        if (const Expander_ptr expander = weak_expander.lock()) {
+            expander->flush();
+        }
+    }
 }
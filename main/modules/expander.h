@@ -3,22 +3,63 @@
 #include "module.h"
 #include "serial.h"
 #include <string>
+#include <vector>
 
 class Expander;
 using Expander_ptr = std::shared_ptr<Expander>;
 
 class Expander : public Module {
 private:
+    enum class BootState {
+        RESETTING, // enable pin pulled low
+        BOOTING,   // waiting for "Ready."
+        READY,     // proxies created, pinging
+        OFFLINE,   // boot timed out or connection lost
+    };
+
     unsigned long int last_message_millis = 0;
     bool ping_pending = false;
-    unsigned long boot_start_time;
+    BootState boot_state = BootState::OFFLINE;
+    unsigned long boot_start_time; // start of the current boot state
+
+    struct ProxyBinding {
+        std::string name;
+        std::string module_type;
+        std::vector<ConstExpression_ptr> arguments;
+        Variable_ptr is_ready;                   // the proxy's property
+        Module_ptr module;                       // resolved when the first update arrives
+        std::vector<std::string> property_names; // from the expander's last schema, empty until it arrives
+    };
+    std::vector<ProxyBinding> proxies; // indexed by proxy id, see proxy_channel.h
+    std::string frame;                 // binary frame received so far
+    bool discarding_frame = false;
+
+    // proxy operations of the current cycle, sent by flush() as one line or one update packet
+    std::string pending_statements; // joined with ';'
+    std::string pending_updates;    // binary update entries
+    // lines written while the expander boots, including the creation of new proxies, replayed in order by set_ready()
+    std::vector<std::string> deferred_lines;
+    size_t deferred_size = 0;
+    size_t recreated_proxies = 0; // proxies created before the current boot, created again by set_ready()
 
     void deinstall();
     void check_boot_progress();
+    void set_ready();
+    void set_offline();
+    int format_proxy(const size_t proxy_id, char *buffer, const size_t buffer_size) const;
+    void send_proxy(const size_t proxy_id);
     void ping();
     void restart();
     void handle_messages(bool check_for_strapping_pins = false);
     void check_strapping_pins(const char *buffer);
+    void receive_frame_piece(const char *data, const size_t length);
+    void handle_frame(const uint8_t *data, const size_t length);
+    bool send_binary_property(const std::string &proxy_name, const std::string &property_name, const ConstExpression_ptr expression);
+    bool is_booting() const;
+    void write_line(const char *line, const size_t length);
+    void queue_statement(const char *statement, const int length);
+    void flush_statements();
+    void flush_updates();
 
 public:
     static inline constexpr const char *TYPE = "Expander";
@@ -35,8 +76,11 @@ public:
              MessageHandler message_handler);
     void step() override;
     void call(const std::string method_name, const std::vector<ConstExpression_ptr> arguments) override;
-    void send_proxy(const std::string module_name, const std::string module_type, const std::vector<ConstExpression_ptr> arguments);
+    // creates the remote module now or, if the expander is not ready, once it is; returns whether it was sent
+    bool add_proxy(const std::string module_name, const std::string module_type, const std::vector<ConstExpression_ptr> arguments, const Variable_ptr is_ready);
     void send_property(const std::string proxy_name, const std::string property_name, const ConstExpression_ptr expression);
     void send_call(const std::string proxy_name, const std::string method_name, const std::vector<ConstExpression_ptr> arguments);
+    void flush();
+    static void flush_all(); // called at the end of each main loop cycle
     static const std::map<std::string, Variable_ptr> get_defaults();
 };
@@ -1,6 +1,8 @@
 #include "module.h"
 #include "../global.h"
+#include "../utils/proxy_channel.h"
 #include "../utils/string_utils.h"
+#include "../utils/timing.h"
 #include "../utils/uart.h"
 #include <stdarg.h>
 #include <typeinfo>
@@ -60,14 +62,52 @@ void Module::step() {
         }
     }
     if (!Module::broadcast_paused && this->broadcast && !this->properties.empty()) {
+        // only changed properties are sent; a periodic full refresh resyncs receivers that missed a line
+        const bool full_refresh = this->broadcast_refresh_interval > 0 &&
+                                  millis_since(this->last_full_broadcast_millis) >= this->broadcast_refresh_interval * 1000;
+        if (full_refresh) {
+            this->last_full_broadcast_millis = millis();
+        }
+        if (this->proxy_id >= 0) {
+            this->broadcast_binary(full_refresh);
+            return;
+        }
         static char buffer[1024];
+        static char value[256];
         int pos = csprintf(buffer, sizeof(buffer), "!!");
         for (auto const &[property_name, property] : this->properties) {
-            pos += csprintf(&buffer[pos], sizeof(buffer) - pos, "%s.%s=", this->name.c_str(), property_name.c_str());
-            pos += property->print_to_buffer(&buffer[pos], sizeof(buffer) - pos);
-            pos += csprintf(&buffer[pos], sizeof(buffer) - pos, ";");
+            property->print_to_buffer(value, sizeof(value));
+            std::string &last_value = this->broadcast_values[property_name];
+            if (!full_refresh && last_value == value) {
+                continue;
+            }
+            last_value = value;
+            pos += csprintf(&buffer[pos], sizeof(buffer) - pos, "%s.%s=%s;", this->name.c_str(), property_name.c_str(), value);
+        }
+        if (pos > 2) {
+            echo("%s", buffer);
         }
-        echo("%s", buffer);
+    }
+}
+
+void Module::broadcast_binary(const bool full_refresh) {
+    // the schema is repeated with every full refresh, in case the core missed it
+    if (full_refresh || this->proxy_schema_size != this->properties.size()) {
+        proxy_channel::send_schema(this->proxy_id, this->properties);
+        this->proxy_schema_size = this->properties.size();
+    }
+    static std::string value;
+    uint8_t property_id = 0;
+    for (auto const &[property_name, property] : this->properties) {
+        value.clear();
+        if (proxy_channel::encode_value(*property, value)) {
+            std::string &last_value = this->broadcast_values[property_name];
+            if (full_refresh || last_value != value) {
+                last_value = value;
+                proxy_channel::add_update(this->proxy_id, property_id, value);
+            }
+        }
+        property_id++;
     }
 }
 
@@ -79,8 +119,23 @@ void Module::call(const std::string method_name, const std::vector<ConstExpressi
         Module::expect(arguments, 0);
         this->output_on = true;
     } else if (method_name == "broadcast") {
-        Module::expect(arguments, 0);
+        if (arguments.size() > 1) {
+            throw std::runtime_error("unexpected number of arguments");
+        }
+        Module::expect(arguments, -1, numbery);
+        this->broadcast_refresh_interval = arguments.empty() ? 1.0 : arguments[0]->evaluate_number();
+        this->broadcast_values.clear();
         this->broadcast = true;
+    } else if (method_name == "bind_proxy") {
+        Module::expect(arguments, 1, integer);
+        const int64_t proxy_id = arguments[0]->evaluate_integer();
+        if (proxy_id < 0 || proxy_id > 255) {
+            throw std::runtime_error("proxy id must be between 0 and 255");
+        }
+        proxy_channel::bind(proxy_id, Global::get_module(this->name));
+        this->proxy_id = proxy_id;
+        this->proxy_schema_size = 0;
+        this->broadcast_values.clear();
     } else if (method_name == "shadow") {
         Module::expect(arguments, 1, identifier);
         std::string target_name = arguments[0]->evaluate_identifier();
@@ -122,6 +177,10 @@ void Module::handle_can_msg(const uint32_t id, const int count, const uint8_t *d
     throw std::runtime_error("CAN message handler is not implemented");
 }
 
+bool Module::send_line(const long address, const char *line) {
+    throw std::runtime_error("module \"" + this->name + "\" cannot send lines");
+}
+
 void Module::register_module(const std::string &type_name, ModuleFactory factory, DefaultsFunction defaults) {
     auto &registry = get_registry();
     if (registry.count(type_name)) {
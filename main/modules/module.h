@@ -33,6 +33,13 @@ protected:
     std::map<std::string, Variable_ptr> properties;
     bool output_on = false;
     bool broadcast = false;
+    double broadcast_refresh_interval = 1.0;
+    unsigned long last_full_broadcast_millis = 0;
+    std::map<std::string, std::string> broadcast_values; // last value sent per property
+    int proxy_id = -1;                                   // binary broadcasts to a proxy on the core, see proxy_channel.h
+    size_t proxy_schema_size = 0;                        // number of properties in the last schema sent
+
+    void broadcast_binary(const bool full_refresh);
 
 public:
     static bool broadcast_paused;
@@ -54,4 +61,6 @@ public:
     Variable_ptr get_property(const std::string property_name) const;
     virtual void write_property(const std::string property_name, const ConstExpression_ptr expression, const bool from_expander = false);
     virtual void handle_can_msg(const uint32_t id, const int count, const uint8_t *const data);
+    // hands a line to a remote receiver (e.g. a bus peer) without blocking; returns false if it had to be dropped
+    virtual bool send_line(const long address, const char *line);
 };
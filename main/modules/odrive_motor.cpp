@@ -57,7 +57,10 @@ void ODriveMotor::set_mode(const uint8_t state, const uint8_t control_mode, cons
         return;
     }
     if (this->axis_state != state) {
-        this->can->send(this->can_id + 0x007, state, 0, 0, 0, 0, 0, 0, 0);
+        // leaving closed loop control (e.g. AXIS_STATE_IDLE) stops the motor and must not wait behind other frames;
+        // it also cancels this axis' queued setpoints, which would otherwise arrive after it (node id in bits 5-10)
+        const CanTxQueue::Priority priority = state == 8 ? CanTxQueue::CONFIG : CanTxQueue::SAFETY;
+        this->can->send(this->can_id + 0x007, state, 0, 0, 0, 0, 0, 0, 0, false, priority, 0x7e0);
         this->axis_state = state;
     }
     if (this->axis_control_mode != control_mode ||
@@ -163,7 +166,7 @@ void ODriveMotor::power(const float torque) {
     int sign = this->properties.at("reversed")->boolean_value ? -1 : 1;
     const float motor_torque = sign * torque;
     std::memcpy(data, &motor_torque, 4);
-    this->can->send(this->can_id + 0x00e, data); // "Set Input Torque"
+    this->can->send(this->can_id + 0x00e, data, false, 8, CanTxQueue::SETPOINT); // "Set Input Torque"
 }
 
 void ODriveMotor::speed(const float speed) {
@@ -176,7 +179,7 @@ void ODriveMotor::speed(const float speed) {
                               this->properties.at("m_per_tick")->number_value /
                               (this->properties.at("reversed")->boolean_value ? -1 : 1);
     std::memcpy(data, &motor_speed, 4);
-    this->can->send(this->can_id + 0x00d, data); // "Set Input Vel"
+    this->can->send(this->can_id + 0x00d, data, false, 8, CanTxQueue::SETPOINT); // "Set Input Vel"
 }
 
 void ODriveMotor::position(const float position) {
@@ -190,7 +193,7 @@ void ODriveMotor::position(const float position) {
                                      this->properties.at("m_per_tick")->number_value +
                                  this->properties.at("tick_offset")->number_value;
     std::memcpy(pos_data, &motor_position, 4);
-    this->can->send(this->can_id + 0x00c, pos_data); // "Set Input Pos"
+    this->can->send(this->can_id + 0x00c, pos_data, false, 8, CanTxQueue::SETPOINT); // "Set Input Pos"
 }
 
 void ODriveMotor::limits(const float speed, const float current) {
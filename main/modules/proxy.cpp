@@ -13,11 +13,8 @@ Proxy::Proxy(const std::string name,
     this->properties = Module::get_module_defaults(module_type);
     this->properties["is_ready"] = std::make_shared<BooleanVariable>(false);
 
-    if (this->expander->get_property("is_ready")->boolean_value) {
-        this->expander->send_proxy(name, module_type, arguments);
-        this->properties["is_ready"]->boolean_value = true;
-    } else {
-        echo("%s: Expander not ready", this->name.c_str());
+    if (!this->expander->add_proxy(name, module_type, arguments, this->properties["is_ready"])) {
+        echo("%s: Expander not ready, the module will be created once it is", this->name.c_str());
     }
 }
 
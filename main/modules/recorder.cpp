@@ -0,0 +1,330 @@
+#include "recorder.h"
+#include "../utils/telemetry.h"
+#include "../utils/uart.h"
+#include "esp_heap_caps.h"
+#include "esp_timer.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+
+static constexpr size_t DEFAULT_CAPACITY = 64 * 1024;
+static constexpr size_t RECORD_HEADER_SIZE = 2;     // u16 length of each stored block
+static constexpr size_t BLOCK_HEADER_SIZE = 1 + 4; // u8 sample count, u32 index of the first sample
+static constexpr size_t MAX_VARINT_SIZE = 10;
+static constexpr size_t MAX_BLOCK_SIZE = BLOCK_HEADER_SIZE + (Recorder::MAX_COLUMNS + 1) * Recorder::BLOCK_SAMPLES * MAX_VARINT_SIZE;
+static constexpr size_t DUMP_CHUNK_SIZE = 960;
+static constexpr size_t DUMP_FRAME_SPACE = telemetry::MAX_PAYLOAD_SIZE + 32; // encoded frame plus ring overhead
+static constexpr uint32_t NO_TRIGGER = 0xffffffff;
+
+static Module_ptr create_recorder(const std::string &name, const std::vector<ConstExpression_ptr> &arguments, MessageHandler) {
+    if (arguments.empty()) {
+        return std::make_shared<Recorder>(name, DEFAULT_CAPACITY);
+    }
+    Module::expect(arguments, 1, integer);
+    const long capacity = arguments[0]->evaluate_integer();
+    if (capacity < static_cast<long>(2 * (RECORD_HEADER_SIZE + MAX_BLOCK_SIZE))) {
+        throw std::runtime_error("recorder capacity must be at least " + std::to_string(2 * (RECORD_HEADER_SIZE + MAX_BLOCK_SIZE)) + " bytes");
+    }
+    return std::make_shared<Recorder>(name, capacity);
+}
+REGISTER_MODULE(Recorder, &create_recorder)
+
+const std::map<std::string, Variable_ptr> Recorder::get_defaults() {
+    return {
+        {"recording", std::make_shared<BooleanVariable>(false)},
+        {"triggered", std::make_shared<BooleanVariable>(false)},
+        {"samples", std::make_shared<IntegerVariable>(0)},
+        {"bytes", std::make_shared<IntegerVariable>(0)},
+        {"pre_trigger", std::make_shared<IntegerVariable>(500)},
+        {"post_trigger", std::make_shared<IntegerVariable>(500)},
+    };
+}
+
+static uint8_t *allocate_buffer(const size_t capacity) {
+    // prefer PSRAM, which is far larger and otherwise mostly unused
+    void *buffer = heap_caps_malloc(capacity, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (!buffer) {
+        buffer = heap_caps_malloc(capacity, MALLOC_CAP_8BIT);
+    }
+    if (!buffer) {
+        throw std::runtime_error("could not allocate " + std::to_string(capacity) + " bytes for recorder");
+    }
+    return static_cast<uint8_t *>(buffer);
+}
+
+Recorder::Recorder(const std::string &name, const size_t capacity)
+    : Module(name), buffer(allocate_buffer(capacity)), capacity(capacity) {
+    this->properties = Recorder::get_defaults();
+}
+
+Recorder::~Recorder() {
+    heap_caps_free(this->buffer);
+}
+
+static size_t put_varint(uint8_t *output, const int64_t value) {
+    uint64_t zigzag = (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63);
+    size_t length = 0;
+    while (zigzag >= 0x80) {
+        output[length++] = static_cast<uint8_t>(zigzag) | 0x80;
+        zigzag >>= 7;
+    }
+    output[length++] = static_cast<uint8_t>(zigzag);
+    return length;
+}
+
+static int64_t quantize(const Variable_ptr &variable, const unsigned int precision) {
+    switch (variable->type) {
+    case boolean:
+        return variable->boolean_value;
+    case integer:
+        return variable->integer_value;
+    case number: {
+        // 2^63 itself is not representable as int64_t, so saturate just below it
+        constexpr double limit = 9.2e18;
+        const double scaled = std::round(variable->number_value * std::pow(10.0, precision));
+        if (std::isnan(scaled)) {
+            return 0;
+        }
+        return scaled >= limit    ? std::numeric_limits<int64_t>::max()
+               : scaled <= -limit ? std::numeric_limits<int64_t>::min()
+                                  : static_cast<int64_t>(scaled);
+    }
+    default:
+        throw std::runtime_error("invalid type");
+    }
+}
+
+void Recorder::configure(const std::string &format) {
+    const std::vector<OutputColumn> columns = parse_output_format(format);
+    if (columns.empty() || columns.size() > MAX_COLUMNS) {
+        throw std::runtime_error("recorder expects between 1 and " + std::to_string(MAX_COLUMNS) + " columns");
+    }
+    for (const OutputColumn &column : columns) {
+        if (column.variable->type == string) {
+            throw std::runtime_error("recorder cannot record string \"" + column.name + "\"");
+        }
+        if (column.precision > 9) {
+            throw std::runtime_error("recorder precision must be between 0 and 9");
+        }
+    }
+    this->columns = columns;
+    this->clear();
+}
+
+void Recorder::clear() {
+    this->head = this->tail = this->used = 0;
+    this->block_count = 0;
+    this->sample_count = 0;
+    this->oldest_sample = 0;
+    this->triggered = false;
+    this->dumping = false;
+    this->update_properties();
+}
+
+void Recorder::sample() {
+    const size_t i = this->block_count;
+    this->block_values[0][i] = esp_timer_get_time();
+    for (size_t c = 0; c < this->columns.size(); ++c) {
+        this->block_values[c + 1][i] = quantize(this->columns[c].variable, this->columns[c].precision);
+    }
+    this->block_count++;
+    this->sample_count++;
+    if (this->block_count == BLOCK_SAMPLES) {
+        this->flush_block();
+    }
+}
+
+void Recorder::flush_block() {
+    if (this->block_count == 0) {
+        return;
+    }
+    static uint8_t block[MAX_BLOCK_SIZE];
+    const uint32_t first_sample = this->sample_count - this->block_count;
+    size_t length = 0;
+    block[length++] = this->block_count;
+    for (int i = 0; i < 4; ++i) {
+        block[length++] = (first_sample >> (8 * i)) & 0xff;
+    }
+    for (size_t c = 0; c <= this->columns.size(); ++c) {
+        const int64_t *values = this->block_values[c];
+        length += put_varint(&block[length], values[0]);
+        for (size_t i = 1; i < this->block_count; ++i) {
+            // wrapping difference, the decoder adds modulo 2^64
+            length += put_varint(&block[length], static_cast<int64_t>(static_cast<uint64_t>(values[i]) - static_cast<uint64_t>(values[i - 1])));
+        }
+    }
+    this->append_block(block, length);
+    this->block_count = 0;
+}
+
+uint8_t Recorder::at(const size_t offset) const {
+    return this->buffer[(this->tail + offset) % this->capacity];
+}
+
+size_t Recorder::block_length(const size_t offset) const {
+    return this->at(offset) | this->at(offset + 1) << 8;
+}
+
+uint32_t Recorder::block_first_sample(const size_t offset) const {
+    uint32_t index = 0;
+    for (int i = 0; i < 4; ++i) {
+        index |= static_cast<uint32_t>(this->at(offset + RECORD_HEADER_SIZE + 1 + i)) << (8 * i);
+    }
+    return index;
+}
+
+void Recorder::drop_oldest_block() {
+    const size_t record_length = RECORD_HEADER_SIZE + this->block_length(0);
+    this->tail = (this->tail + record_length) % this->capacity;
+    this->used -= record_length;
+    this->oldest_sample = this->used > 0 ? this->block_first_sample(0) : this->sample_count - this->block_count;
+}
+
+void Recorder::append_block(const uint8_t *data, const size_t length) {
+    while (this->capacity - this->used < RECORD_HEADER_SIZE + length) {
+        this->drop_oldest_block();
+    }
+    const uint8_t header[RECORD_HEADER_SIZE] = {static_cast<uint8_t>(length & 0xff), static_cast<uint8_t>(length >> 8)};
+    this->write_bytes(header, RECORD_HEADER_SIZE);
+    this->write_bytes(data, length);
+}
+
+void Recorder::write_bytes(const uint8_t *data, const size_t length) {
+    const size_t first = std::min(length, this->capacity - this->head);
+    std::memcpy(&this->buffer[this->head], data, first);
+    std::memcpy(this->buffer, data + first, length - first);
+    this->head = (this->head + length) % this->capacity;
+    this->used += length;
+}
+
+void Recorder::trigger() {
+    if (this->triggered) {
+        return;
+    }
+    this->triggered = true;
+    this->trigger_sample = this->sample_count;
+    echo("%s triggered at sample %lu", this->name.c_str(), static_cast<unsigned long>(this->trigger_sample));
+}
+
+void Recorder::stop() {
+    this->properties.at("recording")->boolean_value = false;
+    this->flush_block();
+}
+
+void Recorder::start_dump() {
+    this->stop();
+
+    // start with the block that contains the first sample of the pre-trigger window
+    uint32_t first_sample = this->oldest_sample;
+    if (this->triggered) {
+        const uint32_t pre_trigger = std::max<int64_t>(this->properties.at("pre_trigger")->integer_value, 0);
+        first_sample = std::max(first_sample, this->trigger_sample - std::min(pre_trigger, this->trigger_sample));
+    }
+    this->dump_start = 0;
+    while (this->dump_start < this->used) {
+        const size_t next = this->dump_start + RECORD_HEADER_SIZE + this->block_length(this->dump_start);
+        if (next >= this->used || this->block_first_sample(next) > first_sample) {
+            break;
+        }
+        this->dump_start = next;
+    }
+    this->dump_length = this->used - this->dump_start;
+    this->dump_offset = 0;
+    this->dumping = true;
+
+    telemetry::Packet packet(telemetry::PACKET_RECORDING_HEADER);
+    packet.put_string(this->name);
+    packet.put_u32(first_sample);
+    packet.put_u32(this->sample_count);
+    packet.put_u32(this->triggered ? this->trigger_sample : NO_TRIGGER);
+    packet.put_u32(this->dump_length);
+    packet.put_u8(this->columns.size());
+    for (const OutputColumn &column : this->columns) {
+        packet.put_u8(column.variable->type);
+        packet.put_u8(column.precision);
+        packet.put_string(column.name);
+    }
+    packet.send();
+}
+
+void Recorder::continue_dump() {
+    // only send what fits into the TX buffer, so that a dump never drops output or blocks the main loop
+    static uint8_t chunk[DUMP_CHUNK_SIZE];
+    while (this->dump_offset < this->dump_length && get_echo_available() > DUMP_FRAME_SPACE) {
+        const size_t length = std::min(DUMP_CHUNK_SIZE, this->dump_length - this->dump_offset);
+        for (size_t i = 0; i < length; ++i) {
+            chunk[i] = this->at(this->dump_start + this->dump_offset + i);
+        }
+        telemetry::Packet packet(telemetry::PACKET_RECORDING_DATA);
+        packet.put_u32(this->dump_offset);
+        packet.put_bytes(chunk, length);
+        packet.send();
+        this->dump_offset += length;
+    }
+    if (this->dump_offset >= this->dump_length) {
+        this->dumping = false;
+    }
+}
+
+void Recorder::update_properties() {
+    this->properties.at("triggered")->boolean_value = this->triggered;
+    this->properties.at("samples")->integer_value = this->sample_count - this->oldest_sample;
+    this->properties.at("bytes")->integer_value = this->used;
+}
+
+void Recorder::step() {
+    if (this->dumping) {
+        this->continue_dump();
+    } else if (this->properties.at("recording")->boolean_value) {
+        this->sample();
+        if (!this->triggered && this->trigger_condition && this->trigger_condition->evaluate_boolean()) {
+            this->trigger();
+        }
+        if (this->triggered && this->sample_count - this->trigger_sample >= this->properties.at("post_trigger")->integer_value) {
+            this->stop();
+            echo("%s stopped after trigger", this->name.c_str());
+        }
+    }
+    this->update_properties();
+    Module::step();
+}
+
+void Recorder::call(const std::string method_name, const std::vector<ConstExpression_ptr> arguments) {
+    if (method_name == "record") {
+        Module::expect(arguments, 1, string);
+        this->configure(arguments[0]->evaluate_string());
+        this->properties.at("recording")->boolean_value = true;
+    } else if (method_name == "start") {
+        Module::expect(arguments, 0);
+        if (this->columns.empty()) {
+            throw std::runtime_error("recorder has no columns, call record(format) first");
+        }
+        this->dumping = false;
+        this->triggered = false;
+        this->properties.at("recording")->boolean_value = true;
+    } else if (method_name == "stop") {
+        Module::expect(arguments, 0);
+        this->stop();
+    } else if (method_name == "clear") {
+        Module::expect(arguments, 0);
+        this->clear();
+    } else if (method_name == "arm") {
+        Module::expect(arguments, 1, boolean);
+        this->trigger_condition = arguments[0];
+        this->triggered = false;
+    } else if (method_name == "disarm") {
+        Module::expect(arguments, 0);
+        this->trigger_condition = nullptr;
+    } else if (method_name == "trigger") {
+        Module::expect(arguments, 0);
+        this->trigger();
+    } else if (method_name == "dump") {
+        Module::expect(arguments, 0);
+        this->start_dump();
+    } else {
+        Module::call(method_name, arguments);
+    }
+    this->update_properties();
+}
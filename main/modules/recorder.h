@@ -0,0 +1,67 @@
+#pragma once
+
+#include "../utils/output_format.h"
+#include "module.h"
+#include <cstdint>
+#include <vector>
+
+class Recorder;
+using Recorder_ptr = std::shared_ptr<Recorder>;
+
+// Records module properties and variables every cycle into a preallocated ring buffer (PSRAM if available).
+//
+// Samples are collected in blocks of up to BLOCK_SAMPLES. A full block is stored column by column:
+// the first value of each column followed by the differences between consecutive values, all as zigzag varints.
+// Numbers are stored as fixed-point integers with the column's precision, so slowly changing signals need
+// only one or two bytes per value. When the ring is full, the oldest block is discarded.
+class Recorder : public Module {
+public:
+    static inline constexpr const char *TYPE = "Recorder";
+    static constexpr size_t MAX_COLUMNS = 16;
+    static constexpr size_t BLOCK_SAMPLES = 32;
+
+    Recorder(const std::string &name, const size_t capacity);
+    ~Recorder() override;
+
+    void step() override;
+    void call(const std::string method_name, const std::vector<ConstExpression_ptr> arguments) override;
+    static const std::map<std::string, Variable_ptr> get_defaults();
+
+private:
+    uint8_t *const buffer;
+    const size_t capacity;
+    size_t head = 0;
+    size_t tail = 0;
+    size_t used = 0;
+
+    std::vector<OutputColumn> columns;
+    int64_t block_values[MAX_COLUMNS + 1][BLOCK_SAMPLES]; // column 0 holds the timestamps
+    size_t block_count = 0;
+    uint32_t sample_count = 0;
+    uint32_t oldest_sample = 0;
+
+    ConstExpression_ptr trigger_condition;
+    bool triggered = false;
+    uint32_t trigger_sample = 0;
+
+    bool dumping = false;
+    size_t dump_offset = 0; // bytes sent, relative to dump_start
+    size_t dump_start = 0;  // ring offset relative to tail
+    size_t dump_length = 0;
+
+    void configure(const std::string &format);
+    void clear();
+    void sample();
+    void trigger();
+    void stop();
+    void flush_block();
+    void append_block(const uint8_t *data, const size_t length);
+    void write_bytes(const uint8_t *data, const size_t length);
+    void drop_oldest_block();
+    uint8_t at(const size_t offset) const;
+    uint32_t block_first_sample(const size_t offset) const;
+    size_t block_length(const size_t offset) const;
+    void start_dump();
+    void continue_dump();
+    void update_properties();
+};
@@ -85,6 +85,11 @@ size_t Serial::write(const uint8_t byte) const {
     return 1;
 }
 
+size_t Serial::write(const uint8_t *data, const size_t length) const {
+    uart_write_bytes(this->uart_num, data, length);
+    return length;
+}
+
 void Serial::write_checked_line(const char *message) const {
     this->write_checked_line(message, std::strlen(message));
 }
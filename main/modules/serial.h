@@ -34,6 +34,7 @@ public:
     int read_line(char *buffer, size_t buffer_len) const;
     static const char *read_line_error(const int result);
     size_t write(const uint8_t byte) const;
+    size_t write(const uint8_t *data, const size_t length) const;
     void write_checked_line(const char *message) const;
     void write_checked_line(const char *message, const int length) const;
     void flush() const;
@@ -9,22 +9,34 @@
 #include "serial.h"
 #include <algorithm>
 #include <cctype>
+#include <cmath>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
 #include <stdexcept>
 
 extern void process_line(const char *line, const int len);
 
 static constexpr size_t FRAME_BUFFER_SIZE = 512;
-static constexpr unsigned long POLL_TIMEOUT_MS = 250;
-static constexpr size_t OUTGOING_QUEUE_LENGTH = 32;
-static constexpr size_t INCOMING_QUEUE_LENGTH = 32;
-static_assert(OUTGOING_QUEUE_LENGTH > otb::BUS_OTB_WINDOW); // a stalled poll must not abort an OTB update
-static_assert(INCOMING_QUEUE_LENGTH > otb::BUS_OTB_WINDOW); // a stalled step() must not drop an OTB chunk
+static constexpr unsigned long POLL_TIMEOUT_MS = 250; // used until a peer's round-trip time is known, and as upper limit
+static constexpr unsigned long MIN_POLL_TIMEOUT_US = 10000; // margin on top of the airtime of the longest frame
+// longest frame on the wire: "$$<sender>:<receiver>$$<payload>@<checksum>\n"
+static constexpr size_t MAX_FRAME_SIZE = sizeof("$$255:255$$") - 1 + SerialBus::PAYLOAD_CAPACITY - 1 + sizeof("@00\n") - 1;
+static constexpr unsigned long BACKOFF_BASE_MS = 100;
+static constexpr unsigned long MAX_BACKOFF_MS = 2000;
+// a stalled poll must not abort an OTB update, a stalled step() must not drop an OTB chunk
+static constexpr size_t OTB_WINDOW_SIZE = (otb::BUS_OTB_WINDOW + 1) * MessageRing::record_size(2 + otb::BUS_OTB_CHUNK_LINE_SIZE + 1);
+static_assert(SerialBus::OUTGOING_RING_SIZE > OTB_WINDOW_SIZE);
+static_assert(SerialBus::INCOMING_RING_SIZE > OTB_WINDOW_SIZE);
 static constexpr const char ECHO_CMD[] = "__ECHO__";
 static constexpr const char POLL_CMD[] = "__POLL__";
 static_assert(otb::BUS_OTB_CHUNK_LINE_SIZE < SerialBus::PAYLOAD_CAPACITY, "OTB chunk lines must fit the bus payload");
 static constexpr const char DONE_CMD[] = "__DONE__";
+static constexpr const char DONE_MORE_CMD[] = "__DONE__+";
+static constexpr const char BATCH_CMD[] = "__BATCH__"; // followed by records "<length>:<payload>"
+static constexpr const char ACK_REQUEST_CMD[] = "__ACKREQ__"; // followed by "<seq> <command>", only in broadcasts
+static constexpr const char ACK_CMD[] = "__ACK__";           // followed by "<seq> ok" or "<seq> error <message>"
+static constexpr unsigned long ACK_TIMEOUT_MS = 2000;
 
 static Module_ptr create_serial_bus(const std::string &name, const std::vector<ConstExpression_ptr> &arguments, MessageHandler) {
     Module::expect(arguments, 2, identifier, integer);
@@ -38,26 +50,54 @@ static Module_ptr create_serial_bus(const std::string &name, const std::vector<C
 REGISTER_MODULE(SerialBus, &create_serial_bus)
 
 const std::map<std::string, Variable_ptr> SerialBus::get_defaults() {
-    return {};
+    return {
+        {"poll_budget", std::make_shared<IntegerVariable>(0)},
+        {"batch_responses", std::make_shared<BooleanVariable>(false)},
+        {"acks_pending", std::make_shared<IntegerVariable>(0)},
+        {"ack_errors", std::make_shared<IntegerVariable>(0)},
+    };
 }
 
-SerialBus::SerialBus(const std::string &name, const ConstSerial_ptr serial, const uint8_t node_id)
-    : Module(name), serial(serial), node_id(node_id) {
-    this->properties = SerialBus::get_defaults();
-    this->serial->enable_line_detection();
+unsigned long SerialBus::PeerState::timeout_us(const unsigned long min_timeout_us) const {
+    const unsigned long max_timeout_us = std::max(POLL_TIMEOUT_MS * 1000, min_timeout_us);
+    if (!this->rtt_valid) {
+        return max_timeout_us;
+    }
+    // like TCP's retransmission timeout (RFC 6298), but never shorter than a frame takes on the wire,
+    // because the coordinator must not poll the next peer while a response is still being sent
+    const unsigned long timeout = this->srtt_us + 4 * this->rttvar_us;
+    return std::min(std::max(timeout, min_timeout_us), max_timeout_us);
+}
 
-    if (!(this->outbound_queue = xQueueCreate(OUTGOING_QUEUE_LENGTH, sizeof(OutgoingMessage)))) {
-        throw std::runtime_error("failed to create serial bus outbound queue");
+bool SerialBus::PeerState::is_backing_off() const {
+    if (this->failures == 0) {
+        return false;
     }
-    if (!(this->inbound_queue = xQueueCreate(INCOMING_QUEUE_LENGTH, sizeof(IncomingMessage)))) {
-        vQueueDelete(this->outbound_queue);
-        throw std::runtime_error("failed to create serial bus inbound queue");
+    const unsigned long backoff_ms = std::min(BACKOFF_BASE_MS << std::min(this->failures - 1, 5u), MAX_BACKOFF_MS);
+    return millis_since(this->backoff_start_millis) < backoff_ms;
+}
+
+void SerialBus::PeerState::update_rtt(const unsigned long rtt_us) {
+    if (!this->rtt_valid) {
+        this->srtt_us = rtt_us;
+        this->rttvar_us = rtt_us / 2.0f;
+        this->rtt_valid = true;
+    } else {
+        this->rttvar_us = 0.75f * this->rttvar_us + 0.25f * std::abs(this->srtt_us - rtt_us);
+        this->srtt_us = 0.875f * this->srtt_us + 0.125f * rtt_us;
     }
+}
+
+SerialBus::SerialBus(const std::string &name, const ConstSerial_ptr serial, const uint8_t node_id)
+    : Module(name), serial(serial), node_id(node_id),
+      min_poll_timeout_us(MAX_FRAME_SIZE * 10 * 1000000ULL / serial->baud_rate + MIN_POLL_TIMEOUT_US),
+      peers_mutex(xSemaphoreCreateMutex()),
+      outbound(OUTGOING_RING_SIZE), inbound(INCOMING_RING_SIZE) {
+    this->properties = SerialBus::get_defaults();
+    this->serial->enable_line_detection();
 
     if (xTaskCreatePinnedToCore(
             SerialBus::communication_loop, "serial_bus_comm", 4096, this, 5, &this->communication_task, 1) != pdPASS) {
-        vQueueDelete(this->outbound_queue);
-        vQueueDelete(this->inbound_queue);
         throw std::runtime_error("failed to create serial bus communication task");
     }
 
@@ -70,22 +110,39 @@ SerialBus::SerialBus(const std::string &name, const ConstSerial_ptr serial, cons
 }
 
 void SerialBus::step() {
-    IncomingMessage message;
-    while (xQueueReceive(this->inbound_queue, &message, 0) == pdTRUE) {
-        this->handle_incoming_message(message);
+    size_t length;
+    while (const uint8_t *record = this->inbound.front(length)) {
+        // handled in place: record = sender, receiver, payload, null terminator
+        const IncomingMessage message{record[0], record[1], length - 3, reinterpret_cast<const char *>(record + 2)};
+        try {
+            this->handle_incoming_message(message);
+        } catch (...) {
+            this->inbound.release();
+            throw;
+        }
+        this->inbound.release();
     }
 
     // the communication task must not echo() itself, so drops are counted there and reported here, at most once per second
     if (this->dropped_inbound > 0 && millis_since(this->last_drop_report_millis) > 1000) {
         const unsigned dropped = this->dropped_inbound.exchange(0);
         this->last_drop_report_millis = millis();
-        echo("warning: serial bus %s dropped %u inbound messages (queue full)", this->name.c_str(), dropped);
+        echo("warning: serial bus %s dropped %u inbound messages (buffer full)", this->name.c_str(), dropped);
     }
 
     if (this->otb_session.handle != 0) {
         otb::bus_tick(this->otb_session);
     }
 
+    this->check_pending_acks();
+
+    for (const PeerState &peer : this->peers) {
+        const std::string suffix = "_" + std::to_string(peer.id);
+        this->properties.at("rtt" + suffix)->number_value = peer.rtt_valid ? peer.srtt_us / 1000.0 : 0.0;
+        this->properties.at("polls" + suffix)->integer_value = peer.polls;
+        this->properties.at("timeouts" + suffix)->integer_value = peer.timeouts;
+    }
+
     Module::step();
 }
 
@@ -108,11 +165,40 @@ void SerialBus::call(const std::string method_name, const std::vector<ConstExpre
         }
         const std::string payload = format_args(arguments[1]->evaluate_string(), arguments, 2);
         this->enqueue_outgoing_message(static_cast<uint8_t>(receiver), payload.c_str(), payload.size());
+    } else if (method_name == "send_all") {
+        // bus.send_all(fmt[, args...]) — a single frame that is processed by all nodes
+        if (arguments.empty() || (arguments[0]->type & string) == 0) {
+            throw std::runtime_error("send_all expects a format string and optional arguments");
+        }
+        const std::string payload = format_args(arguments[0]->evaluate_string(), arguments, 1);
+        this->enqueue_outgoing_message(BROADCAST_ID, payload.c_str(), payload.size());
+    } else if (method_name == "send_all_acked") {
+        if (arguments.empty() || (arguments[0]->type & string) == 0) {
+            throw std::runtime_error("send_all_acked expects a format string and optional arguments");
+        }
+        if (!this->is_coordinator()) {
+            throw std::runtime_error("acknowledged broadcasts require a coordinator");
+        }
+        const uint16_t sequence = this->broadcast_sequence + 1;
+        const std::string payload = ACK_REQUEST_CMD + std::to_string(sequence) + " " +
+                                    format_args(arguments[0]->evaluate_string(), arguments, 1);
+        this->enqueue_outgoing_message(BROADCAST_ID, payload.c_str(), payload.size());
+        if (!this->pending_acks.empty()) {
+            echo("warning: serial bus %s broadcast %u superseded before all peers acknowledged", this->name.c_str(), this->broadcast_sequence);
+        }
+        this->broadcast_sequence = sequence;
+        this->pending_acks.clear();
+        for (const PeerState &peer : this->peers) {
+            this->pending_acks.push_back(peer.id);
+        }
+        this->broadcast_millis = millis();
+        this->properties.at("acks_pending")->integer_value = this->pending_acks.size();
+        this->properties.at("ack_errors")->integer_value = 0;
     } else if (method_name == "make_coordinator") {
         if (arguments.empty()) {
             throw std::runtime_error("make_coordinator expects at least one peer ID");
         }
-        std::vector<uint8_t> peers;
+        std::vector<PeerState> peers;
         peers.reserve(arguments.size());
         for (const auto &argument : arguments) {
             if ((argument->type & integer) == 0) {
@@ -122,32 +208,83 @@ void SerialBus::call(const std::string method_name, const std::vector<ConstExpre
             if (peer_value <= 0 || peer_value >= 255) {
                 throw std::runtime_error("peer IDs must be between 0 and 255");
             }
-            peers.push_back(static_cast<uint8_t>(peer_value));
+            peers.push_back({static_cast<uint8_t>(peer_value)});
+        }
+        for (const PeerState &peer : peers) {
+            const std::string suffix = "_" + std::to_string(peer.id);
+            this->properties["rtt" + suffix] = std::make_shared<NumberVariable>();
+            this->properties["polls" + suffix] = std::make_shared<IntegerVariable>();
+            this->properties["timeouts" + suffix] = std::make_shared<IntegerVariable>();
         }
-        this->peer_ids = peers;
+        // the communication task may be polling one of the previous peers
+        xSemaphoreTake(this->peers_mutex, portMAX_DELAY);
+        std::swap(this->peers, peers);
+        this->poll_index = 0;
+        this->round_robin_index = 0;
+        this->is_polling = false;
+        this->awaiting_first_response = false;
+        xSemaphoreGive(this->peers_mutex);
     } else {
         Module::call(method_name, arguments);
     }
 }
 
+bool SerialBus::send_line(const long address, const char *line) {
+    if (address <= 0 || address >= 255) {
+        throw std::runtime_error("receiver ID must be between 0 and 255");
+    }
+    char payload[PAYLOAD_CAPACITY];
+    const int len = std::snprintf(payload, sizeof(payload), "%s%s", ECHO_CMD, line);
+    if (len < 0 || len >= sizeof(payload)) {
+        throw std::runtime_error("serial bus: line is too long");
+    }
+    try {
+        this->enqueue_outgoing_message(static_cast<uint8_t>(address), payload, len, 0);
+    } catch (const std::runtime_error &) {
+        return false; // queue full
+    }
+    return true;
+}
+
 [[noreturn]] void SerialBus::communication_loop(void *param) {
     SerialBus *bus = static_cast<SerialBus *>(param);
     while (true) {
         bus->process_uart();
-        if (bus->is_coordinator()) {
+        xSemaphoreTake(bus->peers_mutex, portMAX_DELAY);
+        const bool is_coordinator = bus->is_coordinator();
+        if (is_coordinator) {
             // poll next peer
             if (!bus->is_polling && !bus->send_outgoing_queue()) {
-                bus->poll_index = (bus->poll_index + 1) % bus->peer_ids.size();
-                bus->send_message(bus->peer_ids[bus->poll_index], POLL_CMD, sizeof(POLL_CMD) - 1);
-                bus->poll_start_millis = millis();
-                bus->is_polling = true;
+                const int index = bus->select_peer();
+                if (index >= 0) {
+                    PeerState &peer = bus->peers[index];
+                    bus->poll_index = index;
+                    bus->send_message(peer.id, POLL_CMD, sizeof(POLL_CMD) - 1);
+                    bus->poll_activity_micros = micros();
+                    bus->poll_timeout_micros = peer.timeout_us(bus->min_poll_timeout_us);
+                    bus->awaiting_first_response = true;
+                    bus->is_polling = true;
+                    peer.polls++;
+                }
+            }
+            // the poll may still wait behind queued frames in the UART, so the timeout starts once it is sent
+            if (bus->awaiting_first_response && uart_wait_tx_done(bus->serial->uart_num, 0) != ESP_OK) {
+                bus->poll_activity_micros = micros();
             }
             // handle poll timeout
-            if (bus->is_polling && millis_since(bus->poll_start_millis) > POLL_TIMEOUT_MS) {
-                bus->print_to_incoming_queue("warning: serial bus %s poll to %u timed out", bus->name.c_str(), bus->peer_ids[bus->poll_index]);
+            if (bus->is_polling && micros_since(bus->poll_activity_micros) > bus->poll_timeout_micros) {
+                PeerState &peer = bus->peers[bus->poll_index];
+                peer.timeouts++;
+                peer.more_pending = false;
+                if (peer.failures++ == 0) {
+                    bus->print_to_incoming_queue("warning: serial bus %s poll to %u timed out, backing off", bus->name.c_str(), peer.id);
+                }
+                peer.backoff_start_millis = millis();
                 bus->is_polling = false;
             }
-        } else {
+        }
+        xSemaphoreGive(bus->peers_mutex);
+        if (!is_coordinator) {
             // respond to poll
             if (bus->requesting_node) {
                 try {
@@ -158,8 +295,7 @@ void SerialBus::call(const std::string method_name, const std::vector<ConstExpre
                         bus->send_message(bus->requesting_node, payload, len);
                         bus->ready_pending = false;
                     }
-                    bus->send_outgoing_queue();
-                    bus->send_message(bus->requesting_node, DONE_CMD, sizeof(DONE_CMD) - 1);
+                    bus->send_poll_response();
                 } catch (const std::exception &e) {
                     bus->print_to_incoming_queue("warning: serial bus %s error while responding to poll: %s", bus->name.c_str(), e.what());
                 }
@@ -190,69 +326,163 @@ void SerialBus::process_uart() {
             continue;
         }
 
-        // ignore messages not for this node
-        if (message.receiver != this->node_id) {
-            continue;
+        if (std::strncmp(message.payload, BATCH_CMD, sizeof(BATCH_CMD) - 1) == 0) {
+            this->unpack_batch(message);
+        } else {
+            this->dispatch_message(message);
         }
+    }
+}
 
-        // handle poll command
-        if (std::strcmp(message.payload, POLL_CMD) == 0) {
-            this->requesting_node = message.sender;
-            continue;
+void SerialBus::unpack_batch(const IncomingMessage &message) {
+    if (message.receiver != this->node_id && message.receiver != BROADCAST_ID) {
+        return;
+    }
+    IncomingMessage record{message.sender, message.receiver, 0, nullptr};
+    const char *pos = message.payload + sizeof(BATCH_CMD) - 1;
+    const char *const end = message.payload + message.length;
+    while (pos < end) {
+        char *colon;
+        const unsigned long length = std::strtoul(pos, &colon, 10);
+        if (colon == pos || *colon != ':' || length > static_cast<size_t>(end - colon - 1)) {
+            this->print_to_incoming_queue("warning: serial bus %s received malformed batch from %u", this->name.c_str(), message.sender);
+            return;
         }
+        record.length = length;
+        record.payload = colon + 1;
+        this->dispatch_message(record);
+        pos = colon + 1 + length;
+    }
+}
 
-        // handle done command
-        if (std::strcmp(message.payload, DONE_CMD) == 0) {
-            if (this->is_coordinator() && message.sender == this->peer_ids[this->poll_index]) {
-                this->is_polling = false;
-            }
-            continue;
+template <size_t N>
+static bool payload_equals(const char *payload, const size_t length, const char (&command)[N]) {
+    return length == N - 1 && std::memcmp(payload, command, N - 1) == 0;
+}
+
+void SerialBus::dispatch_message(const IncomingMessage &message) {
+    // ignore messages not for this node, including own broadcasts echoed by the transceiver
+    if (message.receiver == BROADCAST_ID) {
+        if (message.sender != this->node_id) {
+            this->push_incoming(message.sender, message.receiver, message.payload, message.length);
         }
+        return;
+    }
+    if (message.receiver != this->node_id) {
+        return;
+    }
+
+    // handle poll command
+    if (payload_equals(message.payload, message.length, POLL_CMD)) {
+        this->requesting_node = message.sender;
+        return;
+    }
+
+    // any frame from the polled peer counts as response, "__DONE__" ends it
+    const bool done = payload_equals(message.payload, message.length, DONE_CMD);
+    const bool done_more = payload_equals(message.payload, message.length, DONE_MORE_CMD);
+    xSemaphoreTake(this->peers_mutex, portMAX_DELAY);
+    this->handle_poll_response(message.sender, done || done_more, done_more);
+    xSemaphoreGive(this->peers_mutex);
+    if (done || done_more) {
+        return;
+    }
+
+    this->push_incoming(message.sender, message.receiver, message.payload, message.length);
+}
+
+void SerialBus::handle_poll_response(const uint8_t sender, const bool done, const bool more) {
+    if (!this->is_coordinator() || !this->is_polling || sender != this->peers[this->poll_index].id) {
+        return;
+    }
+    PeerState &peer = this->peers[this->poll_index];
+    if (this->awaiting_first_response) {
+        peer.update_rtt(micros_since(this->poll_activity_micros));
+        this->awaiting_first_response = false;
+    }
+    if (peer.failures > 0) {
+        this->print_to_incoming_queue("serial bus %s peer %u is responding again", this->name.c_str(), peer.id);
+        peer.failures = 0;
+    }
+    // the timeout applies to the gaps within a long response, not to the response as a whole
+    this->poll_activity_micros = micros();
+    if (done) {
+        peer.more_pending = more;
+        this->is_polling = false;
+    }
+}
 
-        this->push_incoming(message);
+int SerialBus::select_peer() {
+    const size_t count = this->peers.size();
+    // a peer with pending data gets every other poll, so the others are still polled regularly
+    if (!this->last_poll_was_priority) {
+        for (size_t k = 0; k < count; ++k) {
+            const size_t index = (this->poll_index + 1 + k) % count;
+            if (this->peers[index].more_pending && !this->peers[index].is_backing_off()) {
+                this->last_poll_was_priority = true;
+                return index;
+            }
+        }
     }
+    this->last_poll_was_priority = false;
+    for (size_t k = 1; k <= count; ++k) {
+        const size_t index = (this->round_robin_index + k) % count;
+        if (!this->peers[index].is_backing_off()) {
+            this->round_robin_index = index;
+            return index;
+        }
+    }
+    return -1;
 }
 
-void SerialBus::push_incoming(const IncomingMessage &message) {
-    // a warning could not pass the full queue either, so count the drop and let step() report it
-    if (xQueueSend(this->inbound_queue, &message, 0) != pdTRUE) {
+void SerialBus::push_incoming(const uint8_t sender, const uint8_t receiver, const char *payload, const size_t length) {
+    uint8_t *record = this->inbound.reserve(2 + length + 1);
+    if (!record) {
+        // a warning could not pass the full ring either, so count the drop and let step() report it
         this->dropped_inbound++;
+        return;
     }
+    record[0] = sender;
+    record[1] = receiver;
+    memcpy(record + 2, payload, length);
+    record[2 + length] = '\0';
+    this->inbound.commit();
 }
 
 bool SerialBus::parse_message(const char *message_line, IncomingMessage &message) const {
-    // format: $$sender:receiver$$payload
-    const std::string line(message_line);
-    const size_t header_start = line.find("$$");
-    if (header_start == std::string::npos || header_start != 0) {
+    // format: $$sender:receiver$$payload, parsed in place
+    if (std::strncmp(message_line, "$$", 2) != 0) {
         return false;
     }
-    const size_t header_end = line.find("$$", 2);
-    if (header_end == std::string::npos) {
+    const char *const header = message_line + 2;
+    const char *const header_end = std::strstr(header, "$$");
+    if (header_end == nullptr) {
         return false;
     }
-    const size_t colon_pos = line.find(':', 2);
-    if (colon_pos == std::string::npos || colon_pos >= header_end) {
+    const char *const colon = static_cast<const char *>(std::memchr(header, ':', header_end - header));
+    if (colon == nullptr) {
         return false;
     }
-    try {
-        const int sender = std::stoi(line.substr(2, colon_pos - 2));
-        const int receiver = std::stoi(line.substr(colon_pos + 1, header_end - (colon_pos + 1)));
-        if (sender < 0 || sender > 255 || receiver < 0 || receiver > 255) {
-            return false;
-        }
-        message.sender = static_cast<uint8_t>(sender);
-        message.receiver = static_cast<uint8_t>(receiver);
-    } catch (...) {
+    char *end;
+    const long sender = std::strtol(header, &end, 10);
+    if (end == header || end != colon) {
+        return false;
+    }
+    const long receiver = std::strtol(colon + 1, &end, 10);
+    if (end == colon + 1 || end != header_end) {
+        return false;
+    }
+    if (sender < 0 || sender > 255 || receiver < 0 || receiver > 255) {
         return false;
     }
-    const size_t payload_len = line.size() - (header_end + 2);
+    const size_t payload_len = std::strlen(header_end + 2);
     if (payload_len >= PAYLOAD_CAPACITY) {
         return false;
     }
+    message.sender = static_cast<uint8_t>(sender);
+    message.receiver = static_cast<uint8_t>(receiver);
     message.length = payload_len;
-    memcpy(message.payload, line.c_str() + header_end + 2, payload_len);
-    message.payload[payload_len] = '\0';
+    message.payload = header_end + 2;
     return true;
 }
 
@@ -263,6 +493,21 @@ void SerialBus::handle_incoming_message(const IncomingMessage &message) {
         return;
     }
 
+    if (message.receiver == BROADCAST_ID) {
+        if (std::strncmp(message.payload, otb::OTB_MSG_PREFIX, sizeof(otb::OTB_MSG_PREFIX) - 1) == 0) {
+            otb::bus_handle_broadcast(this->otb_session, message.sender, std::string_view(message.payload, message.length));
+        } else {
+            this->handle_broadcast(message);
+        }
+        return;
+    }
+
+    const size_t ack_len = sizeof(ACK_CMD) - 1;
+    if (std::strncmp(message.payload, ACK_CMD, ack_len) == 0) {
+        this->handle_ack(message);
+        return;
+    }
+
     // Handle OTB frames (check prefix first to avoid function call overhead for regular messages)
     std::string_view payload_view(message.payload, message.length);
     constexpr size_t otb_prefix_len = sizeof(otb::OTB_MSG_PREFIX) - 1;
@@ -290,6 +535,7 @@ void SerialBus::handle_incoming_message(const IncomingMessage &message) {
 
     // process regular commands and relay any echo() output back to sender
     this->echo_target_id = message.sender;
+    this->echo_task = xTaskGetCurrentTaskHandle();
     try {
         process_line(message.payload, message.length);
     } catch (const std::exception &e) {
@@ -298,29 +544,180 @@ void SerialBus::handle_incoming_message(const IncomingMessage &message) {
     this->echo_target_id = 0;
 }
 
-void SerialBus::enqueue_outgoing_message(const uint8_t receiver, const char *payload, const size_t length) {
+void SerialBus::handle_broadcast(const IncomingMessage &message) {
+    // output is not relayed: all nodes would answer at once, so results are reported with an acknowledgement instead
+    const char *command = message.payload;
+    long sequence = -1;
+    const size_t request_len = sizeof(ACK_REQUEST_CMD) - 1;
+    if (std::strncmp(message.payload, ACK_REQUEST_CMD, request_len) == 0) {
+        char *end;
+        sequence = std::strtol(message.payload + request_len, &end, 10);
+        if (end == message.payload + request_len || *end != ' ') {
+            echo("warning: serial bus %s received malformed broadcast: %s", this->name.c_str(), message.payload);
+            return;
+        }
+        command = end + 1;
+    }
+    const int length = message.length - (command - message.payload);
+
+    char ack[PAYLOAD_CAPACITY];
+    int ack_len;
+    try {
+        process_line(command, length);
+        ack_len = std::snprintf(ack, sizeof(ack), "%s%ld ok", ACK_CMD, sequence);
+    } catch (const std::exception &e) {
+        echo("error processing broadcast: %s", e.what());
+        ack_len = std::snprintf(ack, sizeof(ack), "%s%ld error %s", ACK_CMD, sequence, e.what());
+    }
+    if (sequence < 0) {
+        return;
+    }
+    try {
+        this->enqueue_outgoing_message(message.sender, ack, std::min(ack_len, static_cast<int>(sizeof(ack) - 1)));
+    } catch (const std::runtime_error &e) {
+        echo("warning: serial bus %s could not acknowledge broadcast: %s", this->name.c_str(), e.what());
+    }
+}
+
+void SerialBus::handle_ack(const IncomingMessage &message) {
+    char *end;
+    const long sequence = std::strtol(message.payload + sizeof(ACK_CMD) - 1, &end, 10);
+    const auto it = std::find(this->pending_acks.begin(), this->pending_acks.end(), message.sender);
+    if (sequence != this->broadcast_sequence || it == this->pending_acks.end()) {
+        return; // late or duplicate acknowledgement
+    }
+    this->pending_acks.erase(it);
+    this->properties.at("acks_pending")->integer_value = this->pending_acks.size();
+    if (std::strncmp(end, " error", 6) == 0) {
+        this->properties.at("ack_errors")->integer_value++;
+        echo("bus[%u]: broadcast %ld failed:%s", message.sender, sequence, end + 6);
+    }
+}
+
+void SerialBus::check_pending_acks() {
+    if (this->pending_acks.empty() || millis_since(this->broadcast_millis) < ACK_TIMEOUT_MS) {
+        return;
+    }
+    std::string missing;
+    for (const uint8_t id : this->pending_acks) {
+        missing += " " + std::to_string(id);
+    }
+    echo("warning: serial bus %s broadcast %u not acknowledged by peers%s", this->name.c_str(), this->broadcast_sequence, missing.c_str());
+    this->pending_acks.clear();
+}
+
+void SerialBus::enqueue_outgoing_message(const uint8_t receiver, const char *payload, const size_t length, const TickType_t timeout) {
     if (length >= PAYLOAD_CAPACITY) {
         throw std::runtime_error("serial bus: payload is too large for serial bus");
     }
-    if (std::strchr(payload, '\n') != nullptr) {
+    if (std::memchr(payload, '\n', length) != nullptr) {
         throw std::runtime_error("serial bus: payload must not contain newline characters");
     }
-    OutgoingMessage message{receiver, length, {}};
-    memcpy(message.payload, payload, length);
-    message.payload[length] = '\0';
-    if (xQueueSend(this->outbound_queue, &message, pdMS_TO_TICKS(50)) != pdTRUE) {
-        throw std::runtime_error("serial bus: could not enqueue outgoing message");
+    // record = receiver, payload; the communication task frees space only when it is polled (or polls)
+    const TickType_t start = xTaskGetTickCount();
+    uint8_t *record;
+    while (!(record = this->outbound.reserve(1 + length))) {
+        if (xTaskGetTickCount() - start >= timeout) {
+            throw std::runtime_error("serial bus: could not enqueue outgoing message");
+        }
+        vTaskDelay(1);
     }
+    record[0] = receiver;
+    memcpy(record + 1, payload, length);
+    this->outbound.commit();
 }
 
-bool SerialBus::send_outgoing_queue() {
-    bool sent_any = false;
-    OutgoingMessage message;
-    while (xQueueReceive(this->outbound_queue, &message, 0) == pdTRUE) {
-        this->send_message(message.receiver, message.payload, message.length);
-        sent_any = true;
+bool SerialBus::send_outgoing_queue(const size_t max_messages) {
+    size_t sent = 0;
+    size_t length;
+    while (sent < max_messages) {
+        const uint8_t *record = this->outbound.front(length);
+        if (!record) {
+            break;
+        }
+        try {
+            this->send_message(record[0], reinterpret_cast<const char *>(record + 1), length - 1);
+        } catch (...) {
+            this->outbound.release();
+            throw;
+        }
+        this->outbound.release();
+        sent++;
     }
-    return sent_any;
+    return sent > 0;
+}
+
+void SerialBus::send_poll_response() {
+    // with a budget, the rest is announced with "__DONE__+" so that the coordinator polls again soon
+    const long budget = this->properties.at("poll_budget")->integer_value;
+    const size_t max_messages = budget > 0 ? budget : SIZE_MAX;
+    const auto done_marker = [&]() {
+        return !this->outbound.empty() && budget > 0 ? DONE_MORE_CMD : DONE_CMD;
+    };
+    if (!this->properties.at("batch_responses")->boolean_value) {
+        this->send_outgoing_queue(max_messages);
+        const char *done = done_marker();
+        this->send_message(this->requesting_node, done, std::strlen(done));
+        return;
+    }
+
+    // consecutive messages to the same receiver are packed into one frame, ending with the done marker if it fits;
+    // a batch is never longer than a single full message, which the coordinator's minimum poll timeout covers
+    char batch[PAYLOAD_CAPACITY];
+    const size_t header_len = sizeof(BATCH_CMD) - 1;
+    memcpy(batch, BATCH_CMD, header_len);
+    size_t batch_len = header_len;
+    size_t first_record = 0; // a single record is sent without batch framing
+    size_t first_length = 0;
+    int records = 0;
+    uint8_t batch_receiver = 0;
+    const auto flush = [&]() {
+        if (records == 1) {
+            this->send_message(batch_receiver, batch + first_record, first_length);
+        } else if (records > 1) {
+            this->send_message(batch_receiver, batch, batch_len);
+        }
+        batch_len = header_len;
+        records = 0;
+    };
+    const auto append = [&](const uint8_t receiver, const char *payload, const size_t length) {
+        char prefix[8];
+        const int prefix_len = std::snprintf(prefix, sizeof(prefix), "%u:", static_cast<unsigned>(length));
+        if (records > 0 && (receiver != batch_receiver || batch_len + prefix_len + length >= PAYLOAD_CAPACITY)) {
+            flush();
+        }
+        if (header_len + prefix_len + length >= PAYLOAD_CAPACITY) {
+            this->send_message(receiver, payload, length); // too long to be wrapped
+            return;
+        }
+        memcpy(batch + batch_len, prefix, prefix_len);
+        memcpy(batch + batch_len + prefix_len, payload, length);
+        if (records == 0) {
+            first_record = batch_len + prefix_len;
+            first_length = length;
+        }
+        batch_len += prefix_len + length;
+        batch_receiver = receiver;
+        records++;
+    };
+
+    size_t length;
+    for (size_t sent = 0; sent < max_messages; ++sent) {
+        const uint8_t *record = this->outbound.front(length);
+        if (!record) {
+            break;
+        }
+        try {
+            append(record[0], reinterpret_cast<const char *>(record + 1), length - 1);
+        } catch (...) {
+            this->outbound.release();
+            throw;
+        }
+        this->outbound.release();
+    }
+    const char *done = done_marker();
+    append(this->requesting_node, done, std::strlen(done));
+    flush();
 }
 
 void SerialBus::send_message(const uint8_t receiver, const char *payload, const size_t length) const {
@@ -337,16 +734,16 @@ void SerialBus::send_message(const uint8_t receiver, const char *payload, const
 }
 
 void SerialBus::print_to_incoming_queue(const char *format, ...) {
-    IncomingMessage message{this->node_id, this->node_id, 0, {}};
+    char payload[PAYLOAD_CAPACITY];
     va_list args;
     va_start(args, format);
-    message.length = std::vsnprintf(message.payload, PAYLOAD_CAPACITY, format, args);
+    const int length = std::vsnprintf(payload, sizeof(payload), format, args);
     va_end(args);
-    this->push_incoming(message);
+    this->push_incoming(this->node_id, this->node_id, payload, std::min(std::max(length, 0), static_cast<int>(sizeof(payload) - 1)));
 }
 
 void SerialBus::handle_echo(const char *line) {
-    if (!this->echo_target_id) {
+    if (!this->echo_target_id || xTaskGetCurrentTaskHandle() != this->echo_task) {
         return;
     }
     char payload[PAYLOAD_CAPACITY];
@@ -356,7 +753,8 @@ void SerialBus::handle_echo(const char *line) {
         return;
     }
     try {
-        this->enqueue_outgoing_message(this->echo_target_id, payload, len);
+        // relaying must not stall the command that is being processed, so a full queue fails immediately
+        this->enqueue_outgoing_message(this->echo_target_id, payload, len, 0);
     } catch (const std::runtime_error &e) {
         // echo() calls back into handle_echo(); stop relaying so the warning is not relayed (and fails) recursively
         this->echo_target_id = 0;
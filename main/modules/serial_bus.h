@@ -1,8 +1,9 @@
 #pragma once
 
+#include "../utils/message_ring.h"
 #include "../utils/otb.h"
 #include "freertos/FreeRTOS.h"
-#include "freertos/queue.h"
+#include "freertos/semphr.h"
 #include "freertos/task.h"
 #include "module.h"
 #include "serial.h"
@@ -18,6 +19,9 @@ public:
     static inline constexpr const char *TYPE = "SerialBus";
 
     static constexpr size_t PAYLOAD_CAPACITY = 256;
+    static constexpr uint8_t BROADCAST_ID = 255;
+    static constexpr size_t INCOMING_RING_SIZE = 4096;
+    static constexpr size_t OUTGOING_RING_SIZE = 4096;
 
     const ConstSerial_ptr serial;
     const uint8_t node_id;
@@ -26,47 +30,81 @@ public:
 
     void step() override;
     void call(const std::string method_name, const std::vector<ConstExpression_ptr> arguments) override;
+    bool send_line(const long address, const char *line) override;
     static const std::map<std::string, Variable_ptr> get_defaults();
 
 private:
+    // points into the line buffer, a batch or the inbound ring; payload is null-terminated except for batch records
     struct IncomingMessage {
         uint8_t sender;
         uint8_t receiver;
         size_t length;
-        char payload[PAYLOAD_CAPACITY];
+        const char *payload;
     };
-    struct OutgoingMessage {
-        uint8_t receiver;
-        size_t length;
-        char payload[PAYLOAD_CAPACITY];
+    // written by the communication task, published as properties by step()
+    struct PeerState {
+        uint8_t id;
+        bool rtt_valid = false;
+        float srtt_us = 0;   // smoothed time from a poll to the first response frame
+        float rttvar_us = 0; // its mean deviation
+        unsigned int failures = 0; // consecutive timeouts
+        unsigned long backoff_start_millis = 0;
+        bool more_pending = false; // the last response ended with "__DONE__+"
+        uint32_t polls = 0;
+        uint32_t timeouts = 0;
+
+        unsigned long timeout_us(const unsigned long min_timeout_us) const;
+        bool is_backing_off() const;
+        void update_rtt(const unsigned long rtt_us);
     };
 
-    std::vector<uint8_t> peer_ids;
+    const unsigned long min_poll_timeout_us; // airtime of the longest frame at the bus's baud rate plus a margin
+    std::vector<PeerState> peers;
+    // held by the communication task while it uses the peer list and by make_coordinator() while replacing it
+    const SemaphoreHandle_t peers_mutex;
 
-    QueueHandle_t outbound_queue = nullptr;
-    QueueHandle_t inbound_queue = nullptr;
+    // single-producer, single-consumer: the main task writes outbound and reads inbound messages,
+    // the communication task the other way round
+    MessageRing outbound;
+    MessageRing inbound;
     // written by the communication task, drained and reported by step() on the main task
     std::atomic<unsigned> dropped_inbound{0};
     unsigned long last_drop_report_millis = 0;
     TaskHandle_t communication_task = nullptr;
     bool is_polling = false;
-    unsigned long poll_start_millis = 0;
-    size_t poll_index = 0;
+    bool awaiting_first_response = false;
+    unsigned long poll_activity_micros = 0; // time of the poll or the last frame of its response
+    unsigned long poll_timeout_micros = 0;
+    size_t poll_index = 0;         // peer that is polled currently
+    size_t round_robin_index = 0;  // last peer polled in turn
+    bool last_poll_was_priority = false;
     uint8_t requesting_node = 0;
     bool ready_pending = true;
     uint8_t echo_target_id = 0; // node ID that should receive relayed echo output (0 = no relay)
+    TaskHandle_t echo_task = nullptr; // output of other tasks is not relayed, it must not write to the outbound ring
+    uint16_t broadcast_sequence = 0;
+    std::vector<uint8_t> pending_acks; // peers that did not yet acknowledge the last acknowledged broadcast
+    unsigned long broadcast_millis = 0;
     otb::BusOtbSession otb_session;
 
     [[noreturn]] static void communication_loop(void *param);
     void process_uart();
-    void push_incoming(const IncomingMessage &message);
+    void push_incoming(const uint8_t sender, const uint8_t receiver, const char *payload, const size_t length);
     bool parse_message(const char *message_line, IncomingMessage &message) const;
+    void dispatch_message(const IncomingMessage &message);
+    void unpack_batch(const IncomingMessage &message);
     void handle_incoming_message(const IncomingMessage &message);
-    void enqueue_outgoing_message(const uint8_t receiver, const char *payload, const size_t length);
-    bool send_outgoing_queue();
+    void handle_broadcast(const IncomingMessage &message);
+    void handle_ack(const IncomingMessage &message);
+    void check_pending_acks();
+    void enqueue_outgoing_message(const uint8_t receiver, const char *payload, const size_t length, const TickType_t timeout = pdMS_TO_TICKS(50));
+    bool send_outgoing_queue(const size_t max_messages = SIZE_MAX);
+    void send_poll_response();
+    int select_peer();
+    void handle_poll_response(const uint8_t sender, const bool done, const bool more);
     void send_message(const uint8_t receiver, const char *payload, const size_t length) const;
 
     void print_to_incoming_queue(const char *format, ...);
     void handle_echo(const char *line);
-    bool is_coordinator() const { return !this->peer_ids.empty(); }
+    bool is_coordinator() const { return !this->peers.empty(); }
 };
@@ -0,0 +1,66 @@
+#include "can_dispatch.h"
+#include <stdexcept>
+
+void CanDispatchTable::add(const uint32_t id, const Module_ptr module) {
+    uint16_t index = id < STANDARD_ID_COUNT ? this->standard[id] : this->find_extended(id);
+    if (!index) {
+        if (this->subscribers.size() >= UINT16_MAX) {
+            throw std::runtime_error("too many CAN IDs subscribed");
+        }
+        this->subscribers.emplace_back();
+        this->ids.push_back(id);
+        index = this->subscribers.size();
+        if (id < STANDARD_ID_COUNT) {
+            this->standard[id] = index;
+        } else {
+            this->insert_extended(id).index = index;
+        }
+    }
+    Subscribers &list = this->subscribers[index - 1];
+    for (const Module_ptr &subscriber : list) {
+        if (subscriber == module) {
+            return;
+        }
+    }
+    list.push_back(module);
+}
+
+std::vector<uint32_t> CanDispatchTable::get_ids() const {
+    return this->ids;
+}
+
+uint16_t CanDispatchTable::find_extended(const uint32_t id) const {
+    if (this->extended.empty()) {
+        return 0;
+    }
+    const size_t mask = this->extended.size() - 1;
+    for (size_t i = hash(id) & mask;; i = (i + 1) & mask) {
+        if (this->extended[i].id == id) {
+            return this->extended[i].index;
+        }
+        if (this->extended[i].id == EMPTY) {
+            return 0;
+        }
+    }
+}
+
+CanDispatchTable::Slot &CanDispatchTable::insert_extended(const uint32_t id) {
+    if (2 * (this->extended_count + 1) > this->extended.size()) {
+        std::vector<Slot> previous(this->extended.empty() ? 16 : 2 * this->extended.size());
+        previous.swap(this->extended);
+        this->extended_count = 0;
+        for (const Slot &slot : previous) {
+            if (slot.id != EMPTY) {
+                this->insert_extended(slot.id).index = slot.index;
+            }
+        }
+    }
+    const size_t mask = this->extended.size() - 1;
+    size_t i = hash(id) & mask;
+    while (this->extended[i].id != EMPTY) {
+        i = (i + 1) & mask;
+    }
+    this->extended[i].id = id;
+    this->extended_count++;
+    return this->extended[i];
+}
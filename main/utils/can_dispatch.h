@@ -0,0 +1,53 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+class Module; // only stored, so the table builds without the interpreter (see tests/host)
+using Module_ptr = std::shared_ptr<Module>;
+
+// Subscribers of received CAN frames, looked up in constant time.
+//
+// Standard (11-bit) ids index a table directly. Larger (29-bit) ids are kept in an open-addressing hash table with
+// linear probing, which is grown to keep it at most half full. Both map an id to a list of subscribers, so that
+// several modules can listen to the same id (e.g. a heartbeat). Subscribing is rare and may allocate, lookups never do.
+class CanDispatchTable {
+public:
+    static constexpr uint32_t STANDARD_ID_COUNT = 0x800;
+
+    using Subscribers = std::vector<Module_ptr>;
+
+    void add(const uint32_t id, const Module_ptr module);
+
+    // nullptr if nobody subscribed to the id
+    const Subscribers *find(const uint32_t id) const {
+        const uint16_t index = id < STANDARD_ID_COUNT ? this->standard[id] : this->find_extended(id);
+        return index ? &this->subscribers[index - 1] : nullptr;
+    }
+
+    std::vector<uint32_t> get_ids() const;
+
+private:
+    static constexpr uint32_t EMPTY = UINT32_MAX; // not a valid 29-bit id
+
+    struct Slot {
+        uint32_t id = EMPTY;
+        uint16_t index = 0;
+    };
+
+    std::array<uint16_t, STANDARD_ID_COUNT> standard{}; // 1-based index into subscribers, 0 = no subscribers
+    std::vector<Slot> extended;                         // capacity is zero or a power of two
+    size_t extended_count = 0;
+    std::vector<Subscribers> subscribers;
+    std::vector<uint32_t> ids; // in the order of subscribers
+
+    static uint32_t hash(uint32_t id) {
+        id = (id ^ (id >> 16)) * 0x45d9f3bu;
+        return id ^ (id >> 16);
+    }
+    uint16_t find_extended(const uint32_t id) const;
+    Slot &insert_extended(const uint32_t id);
+};
@@ -0,0 +1,63 @@
+#include "can_filter.h"
+#include <algorithm>
+
+namespace can_filter {
+
+// id bits that differ within a group, i.e. the "don't care" bits of a filter accepting all of them
+static uint32_t get_mask(const std::vector<uint32_t> &ids, const size_t begin, const size_t end) {
+    uint32_t all_ones = STANDARD_ID_COUNT - 1;
+    uint32_t any_ones = 0;
+    for (size_t i = begin; i < end; ++i) {
+        all_ones &= ids[i];
+        any_ones |= ids[i];
+    }
+    return any_ones & ~all_ones;
+}
+
+static uint32_t get_count(const uint32_t mask) {
+    return 1u << __builtin_popcount(mask);
+}
+
+Filter compute(const std::vector<uint32_t> &ids) {
+    if (ids.empty() || std::any_of(ids.begin(), ids.end(), [](const uint32_t id) { return id >= STANDARD_ID_COUNT; })) {
+        return ACCEPT_ALL;
+    }
+
+    // single filter: bits 31..21 id, bit 20 RTR, bits 19..0 first two data bytes
+    const uint32_t mask = get_mask(ids, 0, ids.size());
+    Filter best;
+    best.acceptance_code = ids[0] << 21;
+    best.acceptance_mask = mask << 21 | 0x1FFFFF;
+    best.single_filter = true;
+    best.accepted_ids = get_count(mask);
+    if (best.accepted_ids == 1) {
+        return best;
+    }
+
+    // dual filter: bits 31..21 and 15..5 id, bits 20 and 4 RTR, bits 19..16 and 3..0 first data nibble
+    auto try_dual = [&best](const uint32_t id1, const uint32_t mask1, const uint32_t id2, const uint32_t mask2) {
+        const uint32_t count = get_count(mask1) + get_count(mask2);
+        if (count < best.accepted_ids) {
+            best.acceptance_code = id1 << 21 | id2 << 5;
+            best.acceptance_mask = mask1 << 21 | 0x1F << 16 | mask2 << 5 | 0x1F;
+            best.single_filter = false;
+            best.accepted_ids = count;
+        }
+    };
+    std::vector<uint32_t> sorted = ids;
+    std::sort(sorted.begin(), sorted.end());
+    for (size_t split = 1; split < sorted.size(); ++split) {
+        try_dual(sorted[0], get_mask(sorted, 0, split), sorted[split], get_mask(sorted, split, sorted.size()));
+    }
+    for (uint32_t bit = 1; bit < STANDARD_ID_COUNT; bit <<= 1) {
+        std::vector<uint32_t> groups = ids;
+        const auto middle = std::stable_partition(groups.begin(), groups.end(), [bit](const uint32_t id) { return !(id & bit); });
+        const size_t split = middle - groups.begin();
+        if (split > 0 && split < groups.size()) {
+            try_dual(groups[0], get_mask(groups, 0, split), groups[split], get_mask(groups, split, groups.size()));
+        }
+    }
+    return best;
+}
+
+} // namespace can_filter
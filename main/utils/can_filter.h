@@ -0,0 +1,28 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+// Acceptance filters of the TWAI controller (SJA1000 layout) for a set of standard CAN ids.
+//
+// A single filter compares the 11-bit id with one code and mask. A dual filter compares it with two, and a frame
+// passes if either matches. A mask bit of 1 means "don't care", so a filter lets through 2^(number of mask bits)
+// ids. The ids are split into the two groups of a dual filter by every possible threshold of the sorted ids and by
+// every id bit, and the filter letting the fewest ids through is used.
+namespace can_filter {
+
+constexpr uint32_t STANDARD_ID_COUNT = 0x800;
+
+struct Filter {
+    uint32_t acceptance_code = 0;
+    uint32_t acceptance_mask = 0xFFFFFFFF;
+    bool single_filter = true;
+    uint32_t accepted_ids = STANDARD_ID_COUNT; // number of standard ids let through (at most, if the two overlap)
+};
+
+constexpr Filter ACCEPT_ALL{};
+
+// Accepts all given ids, or everything if there are none or if one of them is an extended id.
+Filter compute(const std::vector<uint32_t> &ids);
+
+} // namespace can_filter
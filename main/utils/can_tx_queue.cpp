@@ -0,0 +1,94 @@
+#include "can_tx_queue.h"
+#include <algorithm>
+#include <cstring>
+
+static constexpr size_t CAPACITIES[CanTxQueue::PRIORITY_COUNT] = {8, 32, 64, 16};
+
+CanTxQueue::CanTxQueue(const size_t driver_queue_len)
+    : reserved_slots(std::min(RESERVED_SLOTS, driver_queue_len / 2)) {
+    for (size_t p = 0; p < PRIORITY_COUNT; ++p) {
+        this->queues[p].frames.resize(CAPACITIES[p]);
+    }
+}
+
+void CanTxQueue::Queue::pop() {
+    this->head = (this->head + 1) % this->frames.size();
+    this->metrics.queued--;
+}
+
+bool CanTxQueue::push(const Priority priority, const Frame &frame, const uint32_t node_mask) {
+    Queue &queue = this->queues[priority];
+    if (priority == SETPOINT) {
+        for (size_t i = 0; i < queue.metrics.queued; ++i) {
+            Frame &queued_frame = queue.at(i);
+            if (queued_frame.id == frame.id && queued_frame.rtr == frame.rtr) {
+                queued_frame = frame;
+                queue.metrics.coalesced++;
+                return true;
+            }
+        }
+    }
+    if (queue.metrics.queued == queue.frames.size()) {
+        queue.metrics.dropped++;
+        return false;
+    }
+    queue.at(queue.metrics.queued) = frame;
+    queue.metrics.queued++;
+    if (queue.metrics.queued > queue.metrics.high_water) {
+        queue.metrics.high_water = queue.metrics.queued;
+    }
+    if (priority == SAFETY && node_mask) {
+        this->cancel_setpoints(frame.id & node_mask, node_mask);
+    }
+    return true;
+}
+
+void CanTxQueue::cancel_setpoints(const uint32_t node_id, const uint32_t node_mask) {
+    Queue &queue = this->queues[SETPOINT];
+    size_t kept = 0;
+    for (size_t i = 0; i < queue.metrics.queued; ++i) {
+        if ((queue.at(i).id & node_mask) != node_id) {
+            queue.at(kept++) = queue.at(i);
+        }
+    }
+    queue.metrics.coalesced += queue.metrics.queued - kept;
+    queue.metrics.queued = kept;
+}
+
+void CanTxQueue::transmit(size_t free_slots, const unsigned long now, const bool include_setpoints, const TransmitFn &transmit) {
+    for (size_t p = 0; p < PRIORITY_COUNT; ++p) {
+        if (p == SETPOINT && !include_setpoints) {
+            continue;
+        }
+        Queue &queue = this->queues[p];
+        const size_t reserve = p <= SETPOINT ? 0 : this->reserved_slots;
+        while (queue.metrics.queued > 0) {
+            if (p == SETPOINT && static_cast<long>(now - queue.at(0).deadline) > 0) {
+                queue.pop();
+                queue.metrics.stale++;
+                continue;
+            }
+            if (free_slots <= reserve || !transmit(queue.at(0))) {
+                return; // lower classes must not overtake the remaining frames
+            }
+            queue.pop();
+            queue.metrics.sent++;
+            free_slots--;
+        }
+    }
+}
+
+const char *CanTxQueue::get_name(const Priority priority) {
+    switch (priority) {
+    case SAFETY:
+        return "safety";
+    case SETPOINT:
+        return "setpoint";
+    case CONFIG:
+        return "config";
+    case DIAGNOSTIC:
+        return "diagnostic";
+    default:
+        return "unknown";
+    }
+}
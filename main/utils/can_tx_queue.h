@@ -0,0 +1,66 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+// Software transmit queue of the CAN module with one bounded FIFO per priority class.
+//
+// Frames are handed to the driver in priority order while its TX queue has room, so that a flood of configuration
+// frames cannot delay a stop command. Setpoints are held until the end of the main loop cycle: a newer setpoint for the
+// same id replaces the queued one, and setpoints that could not be sent before their deadline are dropped.
+// A safety frame cancels the queued setpoints for the same node, which would otherwise follow it.
+class CanTxQueue {
+public:
+    enum Priority : uint8_t {
+        SAFETY,     // e.g. stop commands
+        SETPOINT,   // e.g. target speeds and positions
+        CONFIG,     // e.g. SDO transfers and mode changes, the default
+        DIAGNOSTIC, // e.g. status requests
+        PRIORITY_COUNT,
+    };
+
+    // driver slots that only safety frames and setpoints may use (at most half of the driver's queue)
+    static constexpr size_t RESERVED_SLOTS = 4;
+
+    struct Frame {
+        uint32_t id;
+        uint8_t data[8];
+        uint8_t dlc;
+        bool rtr;
+        unsigned long deadline; // millis(), only used for setpoints
+    };
+
+    struct Metrics {
+        uint32_t queued = 0;
+        uint32_t high_water = 0;
+        uint32_t sent = 0;
+        uint32_t dropped = 0;   // queue full
+        uint32_t stale = 0;     // deadline passed
+        uint32_t coalesced = 0; // replaced by a newer setpoint or cancelled by a safety frame
+    };
+
+    using TransmitFn = std::function<bool(const Frame &frame)>; // false if the driver's queue is full
+
+    CanTxQueue(const size_t driver_queue_len);
+
+    // false if the frame was dropped; node_mask selects the id bits of the node whose setpoints a safety frame cancels
+    bool push(const Priority priority, const Frame &frame, const uint32_t node_mask = 0);
+    void transmit(const size_t free_slots, const unsigned long now, const bool include_setpoints, const TransmitFn &transmit);
+    const Metrics &get_metrics(const Priority priority) const { return this->queues[priority].metrics; }
+    static const char *get_name(const Priority priority);
+
+private:
+    struct Queue {
+        std::vector<Frame> frames; // ring buffer
+        size_t head = 0;
+        Metrics metrics;
+
+        Frame &at(const size_t i) { return this->frames[(this->head + i) % this->frames.size()]; }
+        void pop();
+    };
+    void cancel_setpoints(const uint32_t node_id, const uint32_t node_mask);
+    Queue queues[PRIORITY_COUNT];
+    const size_t reserved_slots;
+};
@@ -1,10 +1,31 @@
 #include "format.h"
 
 #include "../compilation/type.h"
+#include "number_format.h"
+#include <cctype>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
 #include <stdexcept>
 
+// "%f" or "%.<digit>f", the specifiers format_number() reproduces exactly on its fast path
+static bool is_plain_precision(const std::string &sub) {
+    return sub.size() == 2 || (sub.size() == 4 && sub[1] == '.' && std::isdigit(static_cast<unsigned char>(sub[2])));
+}
+
+// false if snprintf has to format the value, which truncates huge values instead of failing
+static bool format_plain_number(char *buffer, const size_t buffer_len, const std::string &sub, const double value) {
+    if (!is_plain_precision(sub)) {
+        return false;
+    }
+    try {
+        format_number(buffer, buffer_len, value, sub.size() == 2 ? 6 : sub[2] - '0');
+        return true;
+    } catch (const std::runtime_error &) {
+        return false;
+    }
+}
+
 std::string format_args(const std::string &fmt,
                         const std::vector<ConstExpression_ptr> &arguments,
                         size_t args_start) {
@@ -33,10 +54,15 @@ std::string format_args(const std::string &fmt,
             throw std::runtime_error("format: '" + sub + "' has no matching argument");
         }
         const auto &arg = arguments[arg_idx++];
-        if (spec == 'd') {
+        if (spec == 'd' && sub.size() == 2) {
+            format_integer(buf, sizeof(buf), static_cast<int>(arg->evaluate_integer()));
+        } else if (spec == 'd') {
             std::snprintf(buf, sizeof(buf), sub.c_str(), static_cast<int>(arg->evaluate_integer()));
         } else if (spec == 'f') {
-            std::snprintf(buf, sizeof(buf), sub.c_str(), arg->evaluate_number());
+            const double value = arg->evaluate_number();
+            if (!format_plain_number(buf, sizeof(buf), sub, value)) {
+                std::snprintf(buf, sizeof(buf), sub.c_str(), value);
+            }
         } else if (spec == 's') {
             if (arg->type & boolean) {
                 std::snprintf(buf, sizeof(buf), sub.c_str(), arg->evaluate_boolean() ? "true" : "false");
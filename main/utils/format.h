@@ -9,6 +9,7 @@
 // Walks `fmt` and replaces each specifier with the corresponding argument, starting at `arguments[args_start]`.
 // Flags, width, and precision between '%' and the specifier letter are passed straight to snprintf,
 // so the full printf syntax works (e.g. "%.3f", "%-10s", "%5d").
+// Plain "%d", "%f" and "%.<n>f" take the faster, output-identical path of number_format.h instead.
 // Recognized specifiers:
 //   %d  — integer
 //   %f  — number (integer is promoted)
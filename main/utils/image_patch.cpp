@@ -0,0 +1,161 @@
+#include "image_patch.h"
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+namespace image_patch {
+
+static uint32_t read_u32(const uint8_t *data) {
+    return data[0] | data[1] << 8 | data[2] << 16 | static_cast<uint32_t>(data[3]) << 24;
+}
+
+bool is_patch(const uint8_t *data, const size_t length) {
+    return length >= sizeof(MAGIC) && std::memcmp(data, MAGIC, sizeof(MAGIC)) == 0;
+}
+
+Decoder::Decoder(ReadFn read_base, WriteFn write_output)
+    : read_base(read_base), write_output(write_output) {
+}
+
+void Decoder::feed(const uint8_t *data, const size_t length) {
+    size_t i = 0;
+    while (i < length) {
+        switch (this->state) {
+        case State::HEADER: {
+            const size_t n = std::min(length - i, HEADER_SIZE - this->header_length);
+            std::memcpy(&this->header[this->header_length], &data[i], n);
+            this->header_length += n;
+            i += n;
+            if (this->header_length == HEADER_SIZE) {
+                this->parse_header();
+            }
+            break;
+        }
+        case State::TAG: {
+            const uint8_t tag = data[i++];
+            this->op = tag >> 6;
+            this->length = tag & 0x3f;
+            if (this->op > OUTPUT_COPY) {
+                throw std::runtime_error("invalid patch op");
+            }
+            this->state = this->length ? this->begin_op() : State::LENGTH;
+            break;
+        }
+        case State::LENGTH:
+            if (this->read_varint(data[i++])) {
+                this->length = this->varint;
+                this->state = this->begin_op();
+            }
+            break;
+        case State::ARGUMENT:
+            if (this->read_varint(data[i++])) {
+                this->copy();
+                this->state = this->end_op();
+            }
+            break;
+        case State::LITERAL: {
+            const size_t n = std::min(length - i, static_cast<size_t>(this->length));
+            for (size_t k = 0; k < n; ++k) {
+                this->emit(data[i + k]);
+            }
+            i += n;
+            this->length -= n;
+            if (this->length == 0) {
+                this->state = this->end_op();
+            }
+            break;
+        }
+        case State::DONE:
+            throw std::runtime_error("data after end of patch");
+        }
+    }
+}
+
+void Decoder::parse_header() {
+    if (!is_patch(this->header, HEADER_SIZE) || this->header[4] != VERSION) {
+        throw std::runtime_error("unsupported patch version");
+    }
+    if (this->header[5] > WINDOW_BITS) {
+        throw std::runtime_error("patch window too large");
+    }
+    this->output_size = read_u32(&this->header[8]);
+    this->base_size = read_u32(&this->header[12]);
+    this->state = this->end_op();
+}
+
+bool Decoder::read_varint(const uint8_t byte) {
+    if (this->varint_shift > 28 || (this->varint_shift == 28 && (byte & 0x70))) {
+        throw std::runtime_error("invalid patch varint");
+    }
+    this->varint |= static_cast<uint32_t>(byte & 0x7f) << this->varint_shift;
+    this->varint_shift += 7;
+    return (byte & 0x80) == 0;
+}
+
+Decoder::State Decoder::begin_op() {
+    if (this->length == 0 || this->length > this->output_size - this->position) {
+        throw std::runtime_error("patch op exceeds image size");
+    }
+    this->varint = 0;
+    this->varint_shift = 0;
+    return this->op == LITERAL ? State::LITERAL : State::ARGUMENT;
+}
+
+Decoder::State Decoder::end_op() {
+    this->varint = 0;
+    this->varint_shift = 0;
+    if (this->position < this->output_size) {
+        return State::TAG;
+    }
+    this->flush();
+    return State::DONE;
+}
+
+void Decoder::copy() {
+    if (this->op == BASE_COPY) {
+        const int64_t relative = static_cast<int64_t>(this->varint >> 1) ^ -static_cast<int64_t>(this->varint & 1);
+        const int64_t offset = static_cast<int64_t>(this->base_end) + relative;
+        if (offset < 0 || offset + this->length > this->base_size) {
+            throw std::runtime_error("base copy out of range");
+        }
+        uint8_t buffer[256];
+        for (uint32_t done = 0; done < this->length;) {
+            const size_t n = std::min(sizeof(buffer), static_cast<size_t>(this->length - done));
+            if (!this->read_base(offset + done, buffer, n)) {
+                throw std::runtime_error("could not read base image");
+            }
+            for (size_t k = 0; k < n; ++k) {
+                this->emit(buffer[k]);
+            }
+            done += n;
+        }
+        this->base_end = offset + this->length;
+    } else {
+        const uint32_t distance = this->varint + 1;
+        if (distance > this->position || distance > WINDOW_SIZE) {
+            throw std::runtime_error("output copy out of range");
+        }
+        // byte by byte, because the source may overlap the bytes being produced (runs)
+        for (uint32_t k = 0; k < this->length; ++k) {
+            this->emit(this->window[(this->position - distance) % WINDOW_SIZE]);
+        }
+    }
+}
+
+void Decoder::emit(const uint8_t byte) {
+    this->window[this->position % WINDOW_SIZE] = byte;
+    this->position++;
+    this->pending[this->pending_length++] = byte;
+    if (this->pending_length == sizeof(this->pending)) {
+        this->flush();
+    }
+}
+
+void Decoder::flush() {
+    if (this->pending_length > 0 && !this->write_output(this->pending, this->pending_length)) {
+        throw std::runtime_error("could not write image");
+    }
+    this->pending_length = 0;
+}
+
+} // namespace image_patch
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+
+// Streaming decoder for OTB patch images, which describe a firmware image as literal bytes,
+// copies from a base image (the firmware the target is running) and copies from the recent output.
+// Without a base this is plain LZ compression, with a base it is a binary delta.
+// The decoder only depends on the standard library, so it builds and runs on a host as well.
+// Patches are created by `otb_patch.py`.
+//
+// Format (little-endian):
+//   header: "OTBP", version, window bits, 2 reserved bytes, output size (u32), base size (u32), SHA-256 of the output
+//   ops:    tag byte with the op in bits 7-6 and the length in bits 5-0 (0 = the length follows as varint)
+//           0 literal:     <length bytes>
+//           1 base copy:   <zigzag varint: offset relative to the end of the previous base copy>
+//           2 output copy: <varint: distance - 1>, the distance is at most WINDOW_SIZE
+namespace image_patch {
+
+constexpr uint8_t MAGIC[] = {'O', 'T', 'B', 'P'};
+constexpr uint8_t VERSION = 1;
+constexpr size_t HEADER_SIZE = 48;
+constexpr size_t SHA256_SIZE = 32;
+constexpr unsigned WINDOW_BITS = 12;
+constexpr size_t WINDOW_SIZE = size_t{1} << WINDOW_BITS;
+
+using ReadFn = std::function<bool(uint32_t offset, uint8_t *data, size_t length)>;
+using WriteFn = std::function<bool(const uint8_t *data, size_t length)>;
+
+bool is_patch(const uint8_t *data, size_t length);
+
+class Decoder {
+public:
+    Decoder(ReadFn read_base, WriteFn write_output);
+
+    // Consumes the next piece of the patch; pieces may be split anywhere.
+    // Throws std::runtime_error on malformed patches and failing reads or writes.
+    void feed(const uint8_t *data, size_t length);
+
+    bool is_finished() const { return this->state == State::DONE; } // all output written
+    uint32_t get_output_size() const { return this->output_size; }
+    uint32_t get_base_size() const { return this->base_size; }
+    const uint8_t *get_sha256() const { return &this->header[16]; }
+
+private:
+    enum class State { HEADER, TAG, LENGTH, ARGUMENT, LITERAL, DONE };
+    enum Op : uint8_t { LITERAL = 0, BASE_COPY = 1, OUTPUT_COPY = 2 };
+
+    void parse_header();
+    bool read_varint(uint8_t byte);
+    State begin_op();
+    State end_op();
+    void copy();
+    void emit(uint8_t byte);
+    void flush();
+
+    const ReadFn read_base;
+    const WriteFn write_output;
+    State state = State::HEADER;
+    uint8_t header[HEADER_SIZE];
+    size_t header_length = 0;
+    uint32_t output_size = 0;
+    uint32_t base_size = 0;
+
+    uint8_t op = LITERAL;
+    uint32_t length = 0; // remaining length of the current op
+    uint32_t varint = 0;
+    unsigned varint_shift = 0;
+    uint32_t base_end = 0; // end of the previous base copy
+    uint32_t position = 0; // number of output bytes
+
+    uint8_t window[WINDOW_SIZE]; // the last WINDOW_SIZE output bytes, indexed by position % WINDOW_SIZE
+    uint8_t pending[256];        // output not yet passed to write_output
+    size_t pending_length = 0;
+};
+
+} // namespace image_patch
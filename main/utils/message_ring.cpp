@@ -0,0 +1,70 @@
+#include "message_ring.h"
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+
+MessageRing::MessageRing(const size_t capacity)
+    : data(static_cast<uint8_t *>(std::malloc(capacity))), capacity(capacity) {
+    if (capacity < 2 * HEADER_SIZE || (capacity & (capacity - 1)) != 0) {
+        std::free(this->data);
+        throw std::runtime_error("message ring capacity must be a power of two");
+    }
+    if (!this->data) {
+        throw std::runtime_error("could not allocate message ring");
+    }
+}
+
+MessageRing::~MessageRing() {
+    std::free(this->data);
+}
+
+uint8_t *MessageRing::reserve(const size_t length) {
+    const size_t size = record_size(length);
+    const size_t head = this->head.load(std::memory_order_relaxed);
+    const size_t used = head - this->tail.load(std::memory_order_acquire);
+    const size_t position = head % this->capacity;
+    // records do not wrap, so the rest of the buffer is skipped if the record does not fit there
+    const size_t skip = position + size > this->capacity ? this->capacity - position : 0;
+    if (used + skip + size > this->capacity) {
+        return nullptr;
+    }
+    if (skip > 0) {
+        const uint32_t marker = WRAP_MARKER;
+        std::memcpy(&this->data[position], &marker, HEADER_SIZE);
+    }
+    const size_t start = (position + skip) % this->capacity;
+    const uint32_t header = length;
+    std::memcpy(&this->data[start], &header, HEADER_SIZE);
+    this->reserved_end = head + skip + size;
+    return &this->data[start + HEADER_SIZE];
+}
+
+void MessageRing::commit() {
+    const size_t used = this->reserved_end - this->tail.load(std::memory_order_relaxed);
+    if (used > this->high_water) {
+        this->high_water = used;
+    }
+    // publishes the wrap marker and the record at once
+    this->head.store(this->reserved_end, std::memory_order_release);
+}
+
+const uint8_t *MessageRing::front(size_t &length) {
+    size_t tail = this->tail.load(std::memory_order_relaxed);
+    const size_t head = this->head.load(std::memory_order_acquire);
+    if (tail == head) {
+        return nullptr;
+    }
+    uint32_t header;
+    std::memcpy(&header, &this->data[tail % this->capacity], HEADER_SIZE);
+    if (header == WRAP_MARKER) {
+        tail += this->capacity - tail % this->capacity;
+        std::memcpy(&header, &this->data[tail % this->capacity], HEADER_SIZE);
+    }
+    length = header;
+    this->front_end = tail + record_size(length);
+    return &this->data[tail % this->capacity + HEADER_SIZE];
+}
+
+void MessageRing::release() {
+    this->tail.store(this->front_end, std::memory_order_release);
+}
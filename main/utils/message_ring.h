@@ -0,0 +1,46 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// Lock-free single-producer, single-consumer ring of variable-length records.
+//
+// The producer reserves space for a record, writes it in place and commits it;
+// the consumer reads the oldest record in place and releases it when done.
+// Each record is stored contiguously, so a record that does not fit before the end of the buffer
+// is preceded by a wrap marker and starts again at offset 0.
+// Exactly one task may produce and exactly one task may consume.
+class MessageRing {
+public:
+    MessageRing(const size_t capacity);
+    ~MessageRing();
+    MessageRing(const MessageRing &) = delete;
+    MessageRing &operator=(const MessageRing &) = delete;
+
+    // space a record takes in the ring; skipping to the start wastes less than one record
+    static constexpr size_t record_size(const size_t length) { return HEADER_SIZE + ((length + 3) & ~size_t{3}); }
+
+    // producer
+    uint8_t *reserve(const size_t length);
+    void commit();
+
+    // consumer
+    const uint8_t *front(size_t &length);
+    void release();
+
+    bool empty() const { return this->head.load(std::memory_order_acquire) == this->tail.load(std::memory_order_acquire); }
+    size_t get_high_water() const { return this->high_water; }
+
+private:
+    static constexpr size_t HEADER_SIZE = 4;
+    static constexpr uint32_t WRAP_MARKER = UINT32_MAX;
+
+    uint8_t *const data;
+    const size_t capacity;       // power of two, so the counters stay consistent when they overflow
+    std::atomic<size_t> head{0}; // free-running write counter, only advanced by the producer
+    std::atomic<size_t> tail{0}; // free-running read counter, only advanced by the consumer
+    size_t reserved_end = 0;     // producer: counter value after the reserved record
+    size_t front_end = 0;        // consumer: counter value after the record returned by front()
+    size_t high_water = 0;
+};
@@ -0,0 +1,150 @@
+#include "number_format.h"
+#include "string_utils.h"
+#include <cstring>
+#include <stdexcept>
+
+static constexpr unsigned int MAX_FAST_PRECISION = 9;
+static constexpr uint32_t POWERS_OF_TEN[MAX_FAST_PRECISION + 1] = {
+    1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000};
+
+// writes the decimal digits of `value` right-aligned into `end`, returns a pointer to the first digit
+static char *write_digits(char *end, uint64_t value, const unsigned int min_digits = 1) {
+    char *p = end;
+    unsigned int count = 0;
+    while (value >= 100000000) {
+        // split off eight digits so that the inner loop works on 32-bit values, which is much faster on the ESP32
+        uint32_t low = value % 100000000;
+        value /= 100000000;
+        for (int i = 0; i < 8; ++i) {
+            *--p = '0' + low % 10;
+            low /= 10;
+        }
+        count += 8;
+    }
+    uint32_t rest = value;
+    do {
+        *--p = '0' + rest % 10;
+        rest /= 10;
+        count++;
+    } while (rest > 0);
+    while (count < min_digits) {
+        *--p = '0';
+        count++;
+    }
+    return p;
+}
+
+static int copy_to_buffer(char *buffer, const size_t buffer_len, const char *text, const size_t length) {
+    if (length + 1 > buffer_len) {
+        throw std::runtime_error("buffer too small");
+    }
+    std::memcpy(buffer, text, length);
+    buffer[length] = '\0';
+    return length;
+}
+
+int format_integer(char *buffer, const size_t buffer_len, const int64_t value) {
+    char digits[24];
+    char *const end = &digits[sizeof(digits)];
+    const uint64_t magnitude = value < 0 ? 0 - static_cast<uint64_t>(value) : value;
+    char *p = write_digits(end, magnitude);
+    if (value < 0) {
+        *--p = '-';
+    }
+    return copy_to_buffer(buffer, buffer_len, p, end - p);
+}
+
+struct Uint128 {
+    uint64_t high;
+    uint64_t low;
+};
+
+static bool is_bit_set(const Uint128 &value, const unsigned int bit) {
+    return bit < 64 ? (value.low >> bit) & 1 : (value.high >> (bit - 64)) & 1;
+}
+
+static bool has_bits_below(const Uint128 &value, const unsigned int bit) {
+    if (bit <= 64) {
+        return bit > 0 && (value.low & (bit == 64 ? UINT64_MAX : (uint64_t{1} << bit) - 1)) != 0;
+    }
+    return value.low != 0 || (value.high & ((uint64_t{1} << (bit - 64)) - 1)) != 0;
+}
+
+// Computes round(mantissa * 10^precision / 2^shift) with ties to even, i.e. exactly what printf does.
+// The ESP32 has no 128-bit integers, so the (at most 53 + 30 bit) product is assembled from 32-bit halves.
+static bool scale_and_round(const uint64_t mantissa, const unsigned int precision, const unsigned int shift, uint64_t &result) {
+    const uint64_t factor = POWERS_OF_TEN[precision];
+    const uint64_t low = (mantissa & 0xffffffff) * factor;
+    const uint64_t high = (mantissa >> 32) * factor + (low >> 32);
+    const Uint128 product = {high >> 32, (high << 32) | (low & 0xffffffff)};
+
+    if (shift >= 128) {
+        result = 0; // the product is below 2^83, far less than half the divisor
+        return true;
+    }
+    Uint128 quotient = product;
+    if (shift >= 64) {
+        quotient = {0, product.high >> (shift - 64)};
+    } else if (shift > 0) {
+        quotient = {product.high >> shift, (product.low >> shift) | (product.high << (64 - shift))};
+    }
+    if (quotient.high != 0) {
+        return false;
+    }
+    result = quotient.low;
+    if (shift > 0 && is_bit_set(product, shift - 1)) {
+        // the remainder is at least half the divisor: round up if it is more, or to even if it is exactly half
+        if (has_bits_below(product, shift - 1) || (result & 1)) {
+            if (result == UINT64_MAX) {
+                return false;
+            }
+            result++;
+        }
+    }
+    return true;
+}
+
+int format_number(char *buffer, const size_t buffer_len, const double value, const unsigned int precision) {
+    uint64_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    const bool negative = bits >> 63;
+    const int biased_exponent = (bits >> 52) & 0x7ff;
+    uint64_t mantissa = bits & ((uint64_t{1} << 52) - 1);
+    int exponent = biased_exponent - 1075;
+    if (biased_exponent == 0) {
+        exponent = -1074; // subnormal
+    } else {
+        mantissa |= uint64_t{1} << 52;
+    }
+
+    uint64_t scaled;
+    if (biased_exponent == 0x7ff || precision > MAX_FAST_PRECISION) {
+        return csprintf(buffer, buffer_len, "%.*f", precision, value);
+    } else if (mantissa == 0) {
+        scaled = 0;
+    } else if (exponent >= 0) {
+        // an integer: it has to fit 64 bits after scaling
+        if (exponent > 11 || (mantissa << exponent) > UINT64_MAX / POWERS_OF_TEN[precision]) {
+            return csprintf(buffer, buffer_len, "%.*f", precision, value);
+        }
+        scaled = (mantissa << exponent) * POWERS_OF_TEN[precision];
+    } else if (!scale_and_round(mantissa, precision, -exponent, scaled)) {
+        return csprintf(buffer, buffer_len, "%.*f", precision, value);
+    }
+
+    char digits[32];
+    char *const end = &digits[sizeof(digits)];
+    char *p;
+    if (precision == 0) {
+        p = write_digits(end, scaled);
+    } else {
+        const uint64_t factor = POWERS_OF_TEN[precision];
+        p = write_digits(end, scaled % factor, precision);
+        *--p = '.';
+        p = write_digits(p, scaled / factor);
+    }
+    if (negative) {
+        *--p = '-';
+    }
+    return copy_to_buffer(buffer, buffer_len, p, end - p);
+}
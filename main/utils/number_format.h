@@ -0,0 +1,15 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Fast replacements for the printf conversions on the text protocol's hot path.
+//
+// `format_integer` matches "%lld" and `format_number` matches "%.*f" character for character, including the
+// round-half-even rounding of exact binary values and "-0.000". They avoid newlib's vsnprintf, which is slow
+// for floating point and needs a lot of stack. Values that do not fit the integer-only fast path (precision above 9,
+// magnitudes above 2^64 / 10^precision, NaN and infinity) fall back to snprintf.
+// Like csprintf both return the number of characters written (excluding the terminating '\0')
+// and throw if the buffer is too small.
+int format_integer(char *buffer, const size_t buffer_len, const int64_t value);
+int format_number(char *buffer, const size_t buffer_len, const double value, const unsigned int precision = 6);
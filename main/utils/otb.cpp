@@ -3,9 +3,13 @@
 #include "mbedtls/base64.h"
 #include "timing.h"
 #include "uart.h"
+#include <algorithm>
 #include <cstdio>
 #include <cstring>
+#include <iterator>
+#include <new>
 #include <optional>
+#include <stdexcept>
 
 namespace otb {
 
@@ -26,7 +30,21 @@ static void bus_reset_session(BusOtbSession &session) {
     session.partition = nullptr;
     session.next_seq = 0;
     session.uses_crc = false;
+    delete[] session.window;
+    session.window = nullptr;
+    if (session.patch) {
+        delete session.patch;
+        session.patch = nullptr;
+        mbedtls_sha256_free(&session.patch_sha256);
+    }
+    delete[] session.received;
+    session.received = nullptr;
+    session.number_of_chunks = 0;
+    session.missing_chunks = 0;
+    session.chunk_size = 0;
+    session.image_size = 0;
     session.bytes_written = 0;
+    session.committed = false;
     session.last_activity = 0;
 }
 
@@ -37,47 +55,299 @@ static bool fail(BusOtbSession &session, uint8_t receiver, const char *reason) {
     return true;
 }
 
+static void acknowledge_begin(BusOtbSession &session, uint8_t sender) {
+    respond(session, sender, "%s,sack=%u,chunk=%u,patch=%u", OTB_ACK_BEGIN,
+            static_cast<unsigned>(BUS_OTB_WINDOW), static_cast<unsigned>(BUS_OTB_MAX_CHUNK_SIZE),
+            static_cast<unsigned>(image_patch::VERSION));
+}
+
 // Frames get lost or corrupted under load (flash-write stalls, and the frame checksum is only 8 bits),
-// so a bad chunk must not kill the session: re-acking the last written chunk makes the sender rewind
-// and resend from there. Deliberately no activity bump: the session times out without progress.
-static bool resend_from_last_written(BusOtbSession &session, uint8_t sender) {
-    if (session.next_seq > 0) {
+// so a bad chunk must not kill the session. Every chunk is answered with a cumulative acknowledgement of the
+// last written chunk, followed by a hex bitmap of the chunks buffered after the gap (bit i = chunk next_seq + 1 + i).
+// Selective-repeat hosts resend only the missing chunks; older hosts ignore the bitmap and rewind on a repeated
+// acknowledgement. A bad chunk deliberately does not bump the activity: the session times out without progress.
+static bool acknowledge(BusOtbSession &session, uint8_t sender) {
+    unsigned long bitmap = 0;
+    for (size_t i = 1; i < BUS_OTB_WINDOW; ++i) {
+        if (session.window_lengths[(session.next_seq + i) % BUS_OTB_WINDOW]) {
+            bitmap |= 1ul << (i - 1);
+        }
+    }
+    if (session.next_seq == 0) {
+        acknowledge_begin(session, sender); // nothing written yet: resend from chunk 0
+    } else if (bitmap) {
+        respond(session, sender, "%s%lu__:%lx", OTB_ACK_CHUNK_PREFIX, static_cast<unsigned long>(session.next_seq - 1), bitmap);
+    } else {
         respond(session, sender, "%s%lu__", OTB_ACK_CHUNK_PREFIX, static_cast<unsigned long>(session.next_seq - 1));
+    }
+    return true;
+}
+
+// Patch images are decoded into the update partition as they arrive, reading unchanged parts from the running
+// partition. Raw images are written as they are.
+static bool start_patch(BusOtbSession &session) {
+    const esp_partition_t *base = esp_ota_get_running_partition();
+    session.patch = new (std::nothrow) image_patch::Decoder(
+        [base](uint32_t offset, uint8_t *data, size_t length) {
+            return esp_partition_read(base, offset, data, length) == ESP_OK;
+        },
+        [&session](const uint8_t *data, size_t length) {
+            mbedtls_sha256_update(&session.patch_sha256, data, length);
+            session.bytes_written += length;
+            return esp_ota_write(session.handle, data, length) == ESP_OK;
+        });
+    if (!session.patch) {
+        return false;
+    }
+    mbedtls_sha256_init(&session.patch_sha256);
+    mbedtls_sha256_starts(&session.patch_sha256, 0);
+    return true;
+}
+
+// writes the next chunk in order; on failure the session is aborted and false returned
+static bool write_chunk(BusOtbSession &session, uint8_t sender, const uint8_t *data, const size_t len) {
+    if (session.next_seq == 0 && image_patch::is_patch(data, len) && !start_patch(session)) {
+        fail(session, sender, "out of memory");
+        return false;
+    }
+    if (session.patch) {
+        try {
+            session.patch->feed(data, len);
+        } catch (const std::runtime_error &e) {
+            fail(session, sender, e.what());
+            return false;
+        }
+    } else if (esp_ota_write(session.handle, data, len) == ESP_OK) {
+        session.bytes_written += len;
     } else {
-        respond(session, sender, OTB_ACK_BEGIN); // nothing written yet: resend from chunk 0
+        fail(session, sender, "flash write failed");
+        return false;
+    }
+    session.next_seq++;
+    session.last_activity = millis();
+    return true;
+}
+
+// Parses "<seq>__:<crc32>:<base64>" (the part after the chunk prefix) into buf (BUS_OTB_BUFFER_SIZE bytes).
+// The CRC field is optional for senders that predate it. Returns false for chunks that got corrupted in flight.
+static bool decode_chunk(BusOtbSession &session, const std::string_view rest, unsigned long &seq, uint8_t *buf, size_t &len) {
+    const size_t sep = rest.find("__:");
+    if (sep == std::string_view::npos) {
+        return false;
+    }
+    char *end;
+    seq = std::strtoul(rest.data(), &end, 10);
+    if (end != rest.data() + sep) {
+        return false;
+    }
+
+    // The CRC field is detected by its trailing ':' (base64 never contains one). Once a sender has used it,
+    // a chunk without it can only be corruption, because the per-chunk CRC is the only end-to-end check.
+    std::string_view b64 = rest.substr(sep + 3);
+    std::optional<uint32_t> expected_crc;
+    if (b64.size() > 9 && b64[8] == ':') {
+        char *crc_end;
+        const unsigned long crc = std::strtoul(b64.data(), &crc_end, 16);
+        if (crc_end == b64.data() + 8) {
+            expected_crc = crc;
+            b64 = b64.substr(9);
+        }
+    }
+    if (expected_crc) {
+        session.uses_crc = true;
+    } else if (session.uses_crc) {
+        return false;
+    }
+
+    const int err = mbedtls_base64_decode(buf, BUS_OTB_BUFFER_SIZE, &len, reinterpret_cast<const unsigned char *>(b64.data()), b64.size());
+    if (err != 0 || len == 0 || len > BUS_OTB_MAX_CHUNK_SIZE) {
+        return false;
+    }
+    if (expected_crc) {
+        // zlib-compatible CRC32 over the decimal sequence number and the payload, so that neither a
+        // corrupted chunk nor a chunk landing at the wrong offset passes the 8-bit frame checksum unnoticed
+        uint32_t crc = esp_rom_crc32_le(0, reinterpret_cast<const uint8_t *>(rest.data()), sep);
+        crc = esp_rom_crc32_le(crc, buf, len);
+        if (crc != *expected_crc) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Multicast sessions: the host begins the session with every peer, broadcasts each chunk once and then asks each
+// peer for its missing chunks, broadcasting the union of the gaps until every peer is complete.
+// Each peer commits on its own once the whole image hash matches.
+static bool has_chunk(const BusOtbSession &session, const uint32_t seq) {
+    return session.received[seq / 8] & (1 << seq % 8);
+}
+
+static bool begin_multicast(BusOtbSession &session, uint8_t sender, std::string_view msg) {
+    unsigned long image_size;
+    unsigned long chunk_size;
+    char hex[2 * image_patch::SHA256_SIZE + 1];
+    int consumed = 0;
+    if (std::sscanf(msg.data() + strlen(OTB_MBEGIN_PREFIX), ":%lu:%lu:%64[0-9a-f]%n", &image_size, &chunk_size, hex, &consumed) != 3 ||
+        strlen(OTB_MBEGIN_PREFIX) + consumed != msg.size() || strlen(hex) != sizeof(hex) - 1) {
+        respond(session, sender, "%s:malformed multicast begin", OTB_ERROR_PREFIX);
+        return true;
+    }
+    uint8_t sha256[image_patch::SHA256_SIZE];
+    for (size_t i = 0; i < sizeof(sha256); ++i) {
+        const char byte[] = {hex[2 * i], hex[2 * i + 1], '\0'};
+        sha256[i] = std::strtoul(byte, nullptr, 16);
+    }
+
+    if (session.handle) {
+        // a retry after a lost ack
+        if (session.received && session.sender == sender && session.image_size == image_size &&
+            session.chunk_size == chunk_size && std::memcmp(session.image_sha256, sha256, sizeof(sha256)) == 0) {
+            session.last_activity = millis();
+            acknowledge_begin(session, sender);
+            return true;
+        }
+        respond(session, sender, "%s:session already active", OTB_ERROR_PREFIX);
+        return true;
+    }
+    if (chunk_size == 0 || chunk_size > BUS_OTB_MAX_MULTICAST_CHUNK_SIZE || chunk_size % 16 != 0) {
+        respond(session, sender, "%s:invalid chunk size", OTB_ERROR_PREFIX);
+        return true;
+    }
+    const esp_partition_t *part = esp_ota_get_next_update_partition(nullptr);
+    if (!part || image_size == 0 || image_size > part->size) {
+        respond(session, sender, "%s:image does not fit the update partition", OTB_ERROR_PREFIX);
+        return true;
+    }
+    const uint32_t number_of_chunks = (image_size + chunk_size - 1) / chunk_size;
+    uint8_t *received = new (std::nothrow) uint8_t[(number_of_chunks + 7) / 8]();
+    if (!received) {
+        respond(session, sender, "%s:out of memory", OTB_ERROR_PREFIX);
+        return true;
+    }
+    // OTA_SIZE_UNKNOWN erases the whole partition, so chunks can be written at their offset in any order
+    if (esp_ota_begin(part, OTA_SIZE_UNKNOWN, &session.handle) != ESP_OK) {
+        delete[] received;
+        session.handle = 0;
+        respond(session, sender, "%s:failed to begin update", OTB_ERROR_PREFIX);
+        return true;
     }
+    session.sender = sender;
+    session.committed = false;
+    session.partition = part;
+    session.next_seq = 0;
+    session.uses_crc = true;
+    session.received = received;
+    session.number_of_chunks = number_of_chunks;
+    session.missing_chunks = number_of_chunks;
+    session.chunk_size = chunk_size;
+    session.image_size = image_size;
+    std::memcpy(session.image_sha256, sha256, sizeof(sha256));
+    session.bytes_written = 0;
+    session.last_activity = millis();
+    echo("serial bus %s otb multicast start from %u", session.bus_name, sender);
+    acknowledge_begin(session, sender);
     return true;
 }
 
+// replies with the number of missing chunks and as many ranges of them ("<first>[-<last>],...") as fit
+static bool report_status(BusOtbSession &session, uint8_t sender) {
+    char ranges[OTB_RESPONSE_SIZE - sizeof(OTB_ACK_STATUS) - 12];
+    size_t pos = 0;
+    ranges[0] = '\0';
+    for (uint32_t seq = 0; seq < session.number_of_chunks; ++seq) {
+        if (has_chunk(session, seq)) {
+            continue;
+        }
+        uint32_t last = seq;
+        while (last + 1 < session.number_of_chunks && !has_chunk(session, last + 1)) {
+            last++;
+        }
+        const int len = last == seq
+                            ? std::snprintf(&ranges[pos], sizeof(ranges) - pos, "%s%lu", pos ? "," : "", static_cast<unsigned long>(seq))
+                            : std::snprintf(&ranges[pos], sizeof(ranges) - pos, "%s%lu-%lu", pos ? "," : "", static_cast<unsigned long>(seq), static_cast<unsigned long>(last));
+        if (len < 0 || pos + len >= sizeof(ranges)) {
+            ranges[pos] = '\0'; // the remaining gaps follow in the next status
+            break;
+        }
+        pos += len;
+        seq = last;
+    }
+    session.last_activity = millis();
+    respond(session, sender, "%s:%lu:%s", OTB_ACK_STATUS, static_cast<unsigned long>(session.missing_chunks), ranges);
+    return true;
+}
+
+static bool image_hash_matches(const BusOtbSession &session) {
+    mbedtls_sha256_context sha256_context;
+    mbedtls_sha256_init(&sha256_context);
+    mbedtls_sha256_starts(&sha256_context, 0);
+    uint8_t buffer[256];
+    bool ok = true;
+    for (size_t offset = 0; ok && offset < session.image_size; offset += sizeof(buffer)) {
+        const size_t len = std::min(sizeof(buffer), session.image_size - offset);
+        ok = esp_partition_read(session.partition, offset, buffer, len) == ESP_OK &&
+             mbedtls_sha256_update(&sha256_context, buffer, len) == 0;
+    }
+    uint8_t sha256[image_patch::SHA256_SIZE];
+    ok = ok && mbedtls_sha256_finish(&sha256_context, sha256) == 0 &&
+         std::memcmp(sha256, session.image_sha256, sizeof(sha256)) == 0;
+    mbedtls_sha256_free(&sha256_context);
+    return ok;
+}
+
 bool bus_handle_frame(BusOtbSession &session, uint8_t sender, std::string_view msg) {
     // __OTB_BEGIN__
     if (msg == OTB_BEGIN_PREFIX) {
         if (session.handle) {
             // A begin retry after a lost ack is idempotent while nothing has been written yet.
-            if (session.sender == sender && session.next_seq == 0) {
+            if (session.sender == sender && session.next_seq == 0 && !session.received) {
                 session.last_activity = millis();
-                respond(session, sender, OTB_ACK_BEGIN);
+                acknowledge_begin(session, sender);
                 return true;
             }
             respond(session, sender, "%s:session already active", OTB_ERROR_PREFIX);
             return true;
         }
+        uint8_t *window = new (std::nothrow) uint8_t[BUS_OTB_WINDOW * BUS_OTB_MAX_CHUNK_SIZE];
+        if (!window) {
+            respond(session, sender, "%s:out of memory", OTB_ERROR_PREFIX);
+            return true;
+        }
         const esp_partition_t *part = esp_ota_get_next_update_partition(nullptr);
         if (!part || esp_ota_begin(part, OTA_SIZE_UNKNOWN, &session.handle) != ESP_OK) {
+            delete[] window;
+            session.handle = 0;
             respond(session, sender, "%s:failed to begin update", OTB_ERROR_PREFIX);
             return true;
         }
         session.sender = sender;
+        session.committed = false;
         session.partition = part;
         session.next_seq = 0;
         session.uses_crc = false;
+        session.window = window;
+        std::fill(std::begin(session.window_lengths), std::end(session.window_lengths), 0);
         session.bytes_written = 0;
         session.last_activity = millis();
         echo("serial bus %s otb start from %u", session.bus_name, sender);
-        respond(session, sender, OTB_ACK_BEGIN);
+        acknowledge_begin(session, sender);
         return true;
     }
 
+    // __OTB_MBEGIN__:{image size}:{chunk size}:{sha256}
+    if (std::strncmp(msg.data(), OTB_MBEGIN_PREFIX, strlen(OTB_MBEGIN_PREFIX)) == 0) {
+        return begin_multicast(session, sender, msg);
+    }
+
+    // __OTB_STATUS__
+    if (msg == OTB_STATUS_PREFIX) {
+        if (!session.handle || session.sender != sender || !session.received) {
+            respond(session, sender, "%s:invalid session", OTB_ERROR_PREFIX);
+            return true;
+        }
+        return report_status(session, sender);
+    }
+
     // __OTB_ABORT__
     if (msg == OTB_ABORT_PREFIX) {
         if (!session.handle || session.sender != sender) {
@@ -89,79 +359,77 @@ bool bus_handle_frame(BusOtbSession &session, uint8_t sender, std::string_view m
 
     // __OTB_COMMIT__
     if (msg == OTB_COMMIT_PREFIX) {
+        if (!session.handle && session.committed && session.sender == sender) {
+            respond(session, sender, OTB_ACK_COMMIT); // a retry after a lost acknowledgement
+            return true;
+        }
         if (!session.handle || session.sender != sender) {
             respond(session, sender, "%s:invalid session", OTB_ERROR_PREFIX);
             return true;
         }
+        if (session.received && session.missing_chunks > 0) {
+            respond(session, sender, "%s:%lu chunks missing", OTB_ERROR_PREFIX, static_cast<unsigned long>(session.missing_chunks));
+            return true;
+        }
+        if (session.received && !image_hash_matches(session)) {
+            return fail(session, sender, "image hash mismatch");
+        }
+        if (session.patch) {
+            uint8_t sha256[image_patch::SHA256_SIZE];
+            if (!session.patch->is_finished()) {
+                return fail(session, sender, "patch incomplete");
+            }
+            if (mbedtls_sha256_finish(&session.patch_sha256, sha256) != 0 ||
+                std::memcmp(sha256, session.patch->get_sha256(), sizeof(sha256)) != 0) {
+                return fail(session, sender, "image hash mismatch");
+            }
+        }
         if (esp_ota_end(session.handle) != ESP_OK || esp_ota_set_boot_partition(session.partition) != ESP_OK) {
             return fail(session, sender, "failed to finalize update");
         }
         echo("serial bus %s otb finished (%lu bytes)", session.bus_name, static_cast<unsigned long>(session.bytes_written));
         respond(session, sender, OTB_ACK_COMMIT);
         bus_reset_session(session);
+        session.sender = sender;
+        session.committed = true;
         return true;
     }
 
     // __OTB_CHUNK_{seq}__:{crc32}:{base64} (the CRC field is optional for senders that predate it)
     if (std::strncmp(msg.data(), OTB_CHUNK_PREFIX, strlen(OTB_CHUNK_PREFIX)) == 0) {
-        if (!session.handle || session.sender != sender) {
+        if (!session.handle || session.sender != sender || session.received) {
             respond(session, sender, "%s:invalid session", OTB_ERROR_PREFIX);
             return true;
         }
 
-        const std::string_view rest = msg.substr(strlen(OTB_CHUNK_PREFIX));
-        const size_t sep = rest.find("__:");
-        if (sep == std::string_view::npos) {
-            return resend_from_last_written(session, sender); // header corrupted in flight
-        }
-        char *end;
-        const unsigned long seq = std::strtoul(rest.data(), &end, 10);
-        if (end != rest.data() + sep || seq != session.next_seq) {
-            return resend_from_last_written(session, sender); // gap, duplicate, or corrupted sequence number
+        unsigned long seq;
+        uint8_t buf[BUS_OTB_BUFFER_SIZE];
+        size_t len;
+        if (!decode_chunk(session, msg.substr(strlen(OTB_CHUNK_PREFIX)), seq, buf, len) ||
+            seq < session.next_seq || seq >= session.next_seq + BUS_OTB_WINDOW) {
+            return acknowledge(session, sender); // corrupted in flight, duplicate or beyond the window
         }
 
-        // The CRC field is detected by its trailing ':' (base64 never contains one). Once a sender has used it,
-        // a chunk without it can only be corruption, because the per-chunk CRC is the only end-to-end check.
-        std::string_view b64 = rest.substr(sep + 3);
-        std::optional<uint32_t> expected_crc;
-        if (b64.size() > 9 && b64[8] == ':') {
-            char *crc_end;
-            const unsigned long crc = std::strtoul(b64.data(), &crc_end, 16);
-            if (crc_end == b64.data() + 8) {
-                expected_crc = crc;
-                b64 = b64.substr(9);
-            }
+        if (seq > session.next_seq) {
+            // ahead of a missing chunk: keep it until the gap is filled (a duplicate just overwrites the slot)
+            const size_t slot = seq % BUS_OTB_WINDOW;
+            std::memcpy(&session.window[slot * BUS_OTB_MAX_CHUNK_SIZE], buf, len);
+            session.window_lengths[slot] = len;
+            return acknowledge(session, sender);
         }
-        if (expected_crc) {
-            session.uses_crc = true;
-        } else if (session.uses_crc) {
-            return resend_from_last_written(session, sender);
+        if (!write_chunk(session, sender, buf, len)) {
+            return true;
         }
-
-        uint8_t buf[BUS_OTB_BUFFER_SIZE];
-        size_t len;
-        const int err = mbedtls_base64_decode(buf, sizeof(buf), &len, reinterpret_cast<const unsigned char *>(b64.data()), b64.size());
-        if (err != 0 || len == 0 || len > BUS_OTB_CHUNK_SIZE) {
-            return resend_from_last_written(session, sender);
-        }
-        if (expected_crc) {
-            // zlib-compatible CRC32 over the decimal sequence number and the payload, so that neither a
-            // corrupted chunk nor a chunk landing at the wrong offset passes the 8-bit frame checksum unnoticed
-            uint32_t crc = esp_rom_crc32_le(0, reinterpret_cast<const uint8_t *>(rest.data()), sep);
-            crc = esp_rom_crc32_le(crc, buf, len);
-            if (crc != *expected_crc) {
-                return resend_from_last_written(session, sender);
+        // chunks are written strictly in order, so the buffered ones follow as soon as they are contiguous
+        for (size_t slot = session.next_seq % BUS_OTB_WINDOW; session.window_lengths[slot];
+             slot = session.next_seq % BUS_OTB_WINDOW) {
+            const size_t slot_len = session.window_lengths[slot];
+            session.window_lengths[slot] = 0;
+            if (!write_chunk(session, sender, &session.window[slot * BUS_OTB_MAX_CHUNK_SIZE], slot_len)) {
+                return true;
             }
         }
-        if (esp_ota_write(session.handle, buf, len) != ESP_OK) {
-            return fail(session, sender, "flash write failed");
-        }
-
-        session.bytes_written += len;
-        session.next_seq++;
-        session.last_activity = millis();
-        respond(session, sender, "%s%lu__", OTB_ACK_CHUNK_PREFIX, seq);
-        return true;
+        return acknowledge(session, sender);
     }
 
     // __OTB_ACK_*__
@@ -176,13 +444,40 @@ bool bus_handle_frame(BusOtbSession &session, uint8_t sender, std::string_view m
         return true;
     }
 
-    if (session.handle && session.sender == sender) {
-        return resend_from_last_written(session, sender); // a chunk whose prefix got corrupted in flight
+    if (session.handle && session.sender == sender && !session.received) {
+        return acknowledge(session, sender); // a chunk whose prefix got corrupted in flight
     }
     respond(session, sender, "%s:unknown command", OTB_ERROR_PREFIX);
     return true;
 }
 
+void bus_handle_broadcast(BusOtbSession &session, uint8_t sender, std::string_view msg) {
+    // __OTB_MCHUNK_{seq}__:{crc32}:{base64}, ignored by nodes that are not part of the multicast
+    if (!session.received || session.sender != sender ||
+        std::strncmp(msg.data(), OTB_MCHUNK_PREFIX, strlen(OTB_MCHUNK_PREFIX)) != 0) {
+        return;
+    }
+    unsigned long seq;
+    uint8_t buf[BUS_OTB_BUFFER_SIZE];
+    size_t len;
+    if (!decode_chunk(session, msg.substr(strlen(OTB_MCHUNK_PREFIX)), seq, buf, len) ||
+        seq >= session.number_of_chunks || has_chunk(session, seq)) {
+        return; // lost chunks are reported with the next status, repairs for other peers are duplicates here
+    }
+    const size_t offset = seq * session.chunk_size;
+    if (len != std::min(session.chunk_size, session.image_size - offset)) {
+        return;
+    }
+    if (esp_ota_write_with_offset(session.handle, buf, len, offset) != ESP_OK) {
+        fail(session, sender, "flash write failed");
+        return;
+    }
+    session.received[seq / 8] |= 1 << seq % 8;
+    session.missing_chunks--;
+    session.bytes_written += len;
+    session.last_activity = millis();
+}
+
 void bus_tick(BusOtbSession &session) {
     if (session.handle && millis() - session.last_activity > BUS_OTB_SESSION_TIMEOUT_MS) {
         echo("warning: serial bus %s otb timed out", session.bus_name);
@@ -1,6 +1,8 @@
 #pragma once
 
 #include "esp_ota_ops.h"
+#include "image_patch.h"
+#include "mbedtls/sha256.h"
 #include <cstddef>
 #include <cstdint>
 #include <functional>
@@ -14,23 +16,36 @@ constexpr const char OTB_BEGIN_PREFIX[] = "__OTB_BEGIN__";
 constexpr const char OTB_CHUNK_PREFIX[] = "__OTB_CHUNK_";
 constexpr const char OTB_COMMIT_PREFIX[] = "__OTB_COMMIT__";
 constexpr const char OTB_ABORT_PREFIX[] = "__OTB_ABORT__";
+constexpr const char OTB_MBEGIN_PREFIX[] = "__OTB_MBEGIN__"; // :<image size>:<chunk size>:<sha256>, unicast to every peer
+constexpr const char OTB_MCHUNK_PREFIX[] = "__OTB_MCHUNK_";  // like a chunk, but broadcast to all peers of a multicast
+constexpr const char OTB_STATUS_PREFIX[] = "__OTB_STATUS__";
 constexpr const char OTB_ACK_PREFIX[] = "__OTB_ACK_";
-constexpr const char OTB_ACK_BEGIN[] = "__OTB_ACK_BEGIN__:crc32"; // the suffix advertises per-chunk CRC support
+// the suffix advertises per-chunk CRCs, selective acknowledgements with the receive window, the maximum chunk size
+// and the supported patch image version; older hosts only look for ":crc32"
+constexpr const char OTB_ACK_BEGIN[] = "__OTB_ACK_BEGIN__:crc32";
 constexpr const char OTB_ACK_CHUNK_PREFIX[] = "__OTB_ACK_CHUNK_";
 constexpr const char OTB_ACK_COMMIT[] = "__OTB_ACK_COMMIT__";
+constexpr const char OTB_ACK_STATUS[] = "__OTB_ACK_STATUS__"; // :<missing chunks>:<ranges of missing chunks, as many as fit>
 constexpr const char OTB_ERROR_PREFIX[] = "__OTB_ERROR__";
 
 // A chunk line "__OTB_CHUNK_<seq>__:<8-hex-crc32>:<base64>" must fit the bus payload
-// (checked by a static_assert in serial_bus.cpp; keep CHUNK_SIZE in otb_update.py in sync)
-constexpr size_t BUS_OTB_CHUNK_SIZE = 165;
+// (checked by a static_assert in serial_bus.cpp). The host picks the chunk size up to the advertised maximum.
+constexpr size_t BUS_OTB_MAX_CHUNK_SIZE = 168;
 constexpr size_t BUS_OTB_MAX_SEQ_DIGITS = 5;
 constexpr size_t BUS_OTB_CHUNK_LINE_SIZE =
-    sizeof(OTB_CHUNK_PREFIX) - 1 + BUS_OTB_MAX_SEQ_DIGITS + 3 + 9 + (BUS_OTB_CHUNK_SIZE + 2) / 3 * 4;
-constexpr size_t BUS_OTB_WINDOW = 8; // unacked chunks in flight, must match WINDOW in otb_update.py
+    sizeof(OTB_CHUNK_PREFIX) - 1 + BUS_OTB_MAX_SEQ_DIGITS + 3 + 9 + (BUS_OTB_MAX_CHUNK_SIZE + 2) / 3 * 4;
+// Chunks that arrive ahead of a missing one are kept for selective repeat; the host never has more in flight.
+// Without selective acknowledgements (older targets) the host uses a window of 8.
+constexpr size_t BUS_OTB_WINDOW = 12;
 constexpr size_t BUS_OTB_BUFFER_SIZE = 256;
 constexpr unsigned long BUS_OTB_SESSION_TIMEOUT_MS = 10000;
+// Multicast chunks are written at their offset, which needs 16-byte alignment when flash encryption is enabled.
+constexpr size_t BUS_OTB_MAX_MULTICAST_CHUNK_SIZE = BUS_OTB_MAX_CHUNK_SIZE / 16 * 16;
+static_assert(sizeof(OTB_MCHUNK_PREFIX) - 1 + BUS_OTB_MAX_SEQ_DIGITS + 3 + 9 + (BUS_OTB_MAX_MULTICAST_CHUNK_SIZE + 2) / 3 * 4 <=
+                  BUS_OTB_CHUNK_LINE_SIZE,
+              "multicast chunk lines must not be longer than unicast ones");
 
-constexpr size_t OTB_RESPONSE_SIZE = 64;
+constexpr size_t OTB_RESPONSE_SIZE = 192;
 
 using SendFn = std::function<void(uint8_t receiver, const char *data, size_t len)>;
 
@@ -40,13 +55,26 @@ struct BusOtbSession {
     const esp_partition_t *partition = nullptr;
     uint32_t next_seq = 0;
     bool uses_crc = false;
-    size_t bytes_written = 0;
+    uint8_t *window = nullptr;               // BUS_OTB_WINDOW slots of BUS_OTB_MAX_CHUNK_SIZE, indexed by seq % BUS_OTB_WINDOW
+    uint16_t window_lengths[BUS_OTB_WINDOW]; // 0 = slot empty
+    image_patch::Decoder *patch = nullptr;   // set when the image starts with the patch magic
+    mbedtls_sha256_context patch_sha256;     // of the decoded image, checked against the patch header on commit
+    size_t bytes_written = 0;                // to the update partition
+    // multicast sessions: chunks arrive as broadcasts in any order and are written at their offset
+    uint8_t *received = nullptr; // one bit per chunk, set for multicast sessions only
+    uint32_t number_of_chunks = 0;
+    uint32_t missing_chunks = 0;
+    size_t chunk_size = 0;
+    size_t image_size = 0;
+    uint8_t image_sha256[image_patch::SHA256_SIZE];
+    bool committed = false; // the last session of this sender was committed (a lost acknowledgement is repeated)
     unsigned long last_activity = 0;
     const char *bus_name = nullptr;
     SendFn send_fn;
 };
 
 bool bus_handle_frame(BusOtbSession &session, uint8_t sender, std::string_view payload);
+void bus_handle_broadcast(BusOtbSession &session, uint8_t sender, std::string_view payload);
 void bus_tick(BusOtbSession &session);
 
 } // namespace otb
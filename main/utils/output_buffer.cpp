@@ -0,0 +1,101 @@
+#include "output_buffer.h"
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+
+OutputBuffer::OutputBuffer(const size_t capacity)
+    : data(static_cast<char *>(std::malloc(capacity))), capacity(capacity) {
+    if (!this->data) {
+        throw std::runtime_error("could not allocate output buffer");
+    }
+}
+
+OutputBuffer::~OutputBuffer() {
+    std::free(this->data);
+}
+
+void OutputBuffer::write_bytes(const char *source, const size_t length) {
+    if (length == 0) {
+        return;
+    }
+    const size_t first = std::min(length, this->capacity - this->head);
+    std::memcpy(&this->data[this->head], source, first);
+    std::memcpy(this->data, source + first, length - first);
+    this->head = (this->head + length) % this->capacity;
+    this->used += length;
+}
+
+void OutputBuffer::read_bytes(char *target, const size_t length) {
+    const size_t first = std::min(length, this->capacity - this->tail);
+    if (target) {
+        std::memcpy(target, &this->data[this->tail], first);
+        std::memcpy(target + first, this->data, length - first);
+    }
+    this->tail = (this->tail + length) % this->capacity;
+    this->used -= length;
+}
+
+size_t OutputBuffer::peek_length() const {
+    return static_cast<uint8_t>(this->data[this->tail]) |
+           static_cast<uint8_t>(this->data[(this->tail + 1) % this->capacity]) << 8;
+}
+
+bool OutputBuffer::push(const char *data, const size_t length, const char *suffix, const size_t suffix_length) {
+    const size_t record_length = length + suffix_length;
+    if (record_length > UINT16_MAX || HEADER_SIZE + record_length > this->capacity) {
+        this->dropped++;
+        return false;
+    }
+    const char header[HEADER_SIZE] = {static_cast<char>(record_length & 0xff), static_cast<char>(record_length >> 8)};
+
+    bool pushed = true;
+    portENTER_CRITICAL(&this->mux);
+    if (this->overflow == drop_oldest) {
+        while (this->capacity - this->used < HEADER_SIZE + record_length) {
+            const size_t oldest_length = this->peek_length();
+            this->read_bytes(nullptr, HEADER_SIZE + oldest_length);
+            this->dropped++;
+        }
+    }
+    if (this->capacity - this->used < HEADER_SIZE + record_length) {
+        this->dropped++;
+        pushed = false;
+    } else {
+        this->write_bytes(header, HEADER_SIZE);
+        this->write_bytes(data, length);
+        this->write_bytes(suffix, suffix_length);
+        this->high_water = std::max(this->high_water, this->used);
+    }
+    portEXIT_CRITICAL(&this->mux);
+    return pushed;
+}
+
+size_t OutputBuffer::pop(char *buffer, const size_t buffer_len) {
+    size_t length = 0;
+    portENTER_CRITICAL(&this->mux);
+    while (this->used > 0) {
+        const size_t record_length = this->peek_length();
+        if (length + record_length > buffer_len) {
+            if (length == 0) {
+                // cannot happen as long as the consumer's buffer is at least as large as the ring, but never get stuck
+                this->read_bytes(nullptr, HEADER_SIZE + record_length);
+                this->dropped++;
+                continue;
+            }
+            break;
+        }
+        this->read_bytes(nullptr, HEADER_SIZE);
+        this->read_bytes(&buffer[length], record_length);
+        length += record_length;
+    }
+    portEXIT_CRITICAL(&this->mux);
+    return length;
+}
+
+size_t OutputBuffer::size() const {
+    portENTER_CRITICAL(&this->mux);
+    const size_t used = this->used;
+    portEXIT_CRITICAL(&this->mux);
+    return used;
+}
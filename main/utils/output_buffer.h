@@ -0,0 +1,49 @@
+#pragma once
+
+#include "freertos/FreeRTOS.h"
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// Multi-producer, single-consumer ring of variable-length records (e.g. output lines).
+//
+// Producers on any task never block: a record that does not fit is either dropped (drop_newest)
+// or makes room by discarding the oldest records (drop_oldest); both are counted in `dropped`.
+// Records are copied in and out within a short spinlock critical section, so they never interleave
+// and the consumer can drain many of them into one large write.
+class OutputBuffer {
+public:
+    enum Overflow {
+        drop_newest,
+        drop_oldest,
+    };
+
+    OutputBuffer(const size_t capacity);
+    ~OutputBuffer();
+    OutputBuffer(const OutputBuffer &) = delete;
+    OutputBuffer &operator=(const OutputBuffer &) = delete;
+
+    bool push(const char *data, const size_t length, const char *suffix = nullptr, const size_t suffix_length = 0);
+    size_t pop(char *buffer, const size_t buffer_len);
+    size_t size() const;
+    size_t available() const { return this->capacity - this->size(); }
+    size_t get_high_water() const { return this->high_water; }
+
+    std::atomic<Overflow> overflow{drop_newest};
+    std::atomic<uint32_t> dropped{0};
+
+private:
+    static constexpr size_t HEADER_SIZE = 2;
+
+    char *const data;
+    const size_t capacity;
+    size_t head = 0; // write position, modulo capacity
+    size_t tail = 0; // read position of the oldest record, modulo capacity
+    size_t used = 0;
+    size_t high_water = 0;
+    mutable portMUX_TYPE mux = portMUX_INITIALIZER_UNLOCKED;
+
+    void write_bytes(const char *source, const size_t length);
+    void read_bytes(char *target, const size_t length);
+    size_t peek_length() const;
+};
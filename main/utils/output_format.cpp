@@ -0,0 +1,48 @@
+#include "output_format.h"
+#include "../global.h"
+#include "number_format.h"
+#include "string_utils.h"
+#include <cstdlib>
+#include <stdexcept>
+
+std::vector<OutputColumn> parse_output_format(const std::string &format) {
+    std::vector<OutputColumn> columns;
+    std::string remaining = format;
+    while (!remaining.empty()) {
+        std::string element = cut_first_word(remaining);
+        if (element.empty()) {
+            continue;
+        }
+        OutputColumn column;
+        if (element.find('.') == std::string::npos) {
+            // variable[:precision]
+            column.name = cut_first_word(element, ':');
+            column.variable = Global::get_variable(column.name);
+        } else {
+            // module.property[:precision]
+            const std::string module_name = cut_first_word(element, '.');
+            const std::string property_name = cut_first_word(element, ':');
+            column.variable = Global::get_module(module_name)->get_property(property_name);
+            column.name = module_name + "." + property_name;
+        }
+        column.precision = element.empty() ? 0 : atoi(element.c_str());
+        columns.push_back(column);
+    }
+    return columns;
+}
+
+int print_output_value(char *buffer, const size_t buffer_len, const OutputColumn &column) {
+    const Variable_ptr &variable = column.variable;
+    switch (variable->type) {
+    case boolean:
+        return csprintf(buffer, buffer_len, "%s", variable->boolean_value ? "true" : "false");
+    case integer:
+        return format_integer(buffer, buffer_len, variable->integer_value);
+    case number:
+        return format_number(buffer, buffer_len, variable->number_value, column.precision);
+    case string:
+        return csprintf(buffer, buffer_len, "\"%s\"", variable->string_value.c_str());
+    default:
+        throw std::runtime_error("invalid type");
+    }
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+#include "../compilation/variable.h"
+#include <string>
+#include <vector>
+
+// An element of an output format like "core.millis motor.position:3 my_variable:2"
+// as used by core.output, recorders and subscriptions.
+struct OutputColumn {
+    std::string name;
+    Variable_ptr variable;
+    unsigned int precision;
+};
+
+std::vector<OutputColumn> parse_output_format(const std::string &format);
+int print_output_value(char *buffer, const size_t buffer_len, const OutputColumn &column);
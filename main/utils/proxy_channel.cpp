@@ -0,0 +1,175 @@
+#include "proxy_channel.h"
+#include "../compilation/expressions.h"
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+namespace proxy_channel {
+
+struct Binding {
+    Module_ptr module;
+    std::vector<std::string> property_names; // indexed by property id, as announced in the last schema
+};
+
+static std::map<uint8_t, Binding> bindings;
+static std::string batch; // update entries not yet sent
+
+static void put_varint(std::string &buffer, uint64_t value) {
+    while (value >= 0x80) {
+        buffer += static_cast<char>((value & 0x7f) | 0x80);
+        value >>= 7;
+    }
+    buffer += static_cast<char>(value);
+}
+
+static uint64_t read_varint(const uint8_t *&data, const uint8_t *const end) {
+    uint64_t value = 0;
+    for (unsigned shift = 0; shift < 64; shift += 7) {
+        if (data >= end) {
+            throw std::runtime_error("truncated proxy update");
+        }
+        const uint8_t byte = *data++;
+        value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0) {
+            return value;
+        }
+    }
+    throw std::runtime_error("invalid varint in proxy update");
+}
+
+static void read_bytes(const uint8_t *&data, const uint8_t *const end, void *output, const size_t length) {
+    if (static_cast<size_t>(end - data) < length) {
+        throw std::runtime_error("truncated proxy update");
+    }
+    std::memcpy(output, data, length);
+    data += length;
+}
+
+bool encode_value(const Variable &variable, std::string &value) {
+    switch (variable.type) {
+    case boolean:
+        value += static_cast<char>(variable.boolean_value ? VALUE_TRUE : VALUE_FALSE);
+        return true;
+    case integer:
+        value += static_cast<char>(VALUE_INTEGER);
+        put_varint(value, (static_cast<uint64_t>(variable.integer_value) << 1) ^ static_cast<uint64_t>(variable.integer_value >> 63));
+        return true;
+    case number: {
+        // ESP32s are little-endian like the wire format, so the bytes can be copied as they are
+        const float single = static_cast<float>(variable.number_value);
+        if (static_cast<double>(single) == variable.number_value) {
+            value += static_cast<char>(VALUE_FLOAT);
+            value.append(reinterpret_cast<const char *>(&single), sizeof(single));
+        } else {
+            value += static_cast<char>(VALUE_DOUBLE);
+            value.append(reinterpret_cast<const char *>(&variable.number_value), sizeof(variable.number_value));
+        }
+        return true;
+    }
+    case string:
+        value += static_cast<char>(VALUE_STRING);
+        put_varint(value, variable.string_value.size());
+        value += variable.string_value;
+        return true;
+    default:
+        return false;
+    }
+}
+
+static ConstExpression_ptr read_value(const uint8_t *&data, const uint8_t *const end) {
+    uint8_t type;
+    read_bytes(data, end, &type, 1);
+    switch (type) {
+    case VALUE_FALSE:
+    case VALUE_TRUE:
+        return std::make_shared<BooleanExpression>(type == VALUE_TRUE);
+    case VALUE_INTEGER: {
+        const uint64_t zigzag = read_varint(data, end);
+        return std::make_shared<IntegerExpression>(static_cast<int64_t>(zigzag >> 1) ^ -static_cast<int64_t>(zigzag & 1));
+    }
+    case VALUE_FLOAT: {
+        float value;
+        read_bytes(data, end, &value, sizeof(value));
+        return std::make_shared<NumberExpression>(value);
+    }
+    case VALUE_DOUBLE: {
+        double value;
+        read_bytes(data, end, &value, sizeof(value));
+        return std::make_shared<NumberExpression>(value);
+    }
+    case VALUE_STRING: {
+        const uint64_t length = read_varint(data, end);
+        if (length > static_cast<uint64_t>(end - data)) {
+            throw std::runtime_error("truncated proxy update");
+        }
+        const std::string value(reinterpret_cast<const char *>(data), length);
+        data += length;
+        return std::make_shared<StringExpression>(value);
+    }
+    default:
+        throw std::runtime_error("unknown value type " + std::to_string(type) + " in proxy update");
+    }
+}
+
+void read_updates(const uint8_t *data, const size_t length, const UpdateHandler &handler) {
+    const uint8_t *const end = data + length;
+    while (data < end) {
+        uint8_t ids[2];
+        read_bytes(data, end, ids, sizeof(ids));
+        handler(ids[0], ids[1], read_value(data, end));
+    }
+}
+
+void bind(const uint8_t proxy_id, const Module_ptr module) {
+    bindings[proxy_id] = {module, {}};
+}
+
+void send_schema(const uint8_t proxy_id, const std::map<std::string, Variable_ptr> &properties) {
+    if (properties.size() > MAX_PROPERTIES) {
+        throw std::runtime_error("too many properties for a binary proxy");
+    }
+    std::vector<std::string> &property_names = bindings.at(proxy_id).property_names;
+    property_names.clear();
+    telemetry::Packet packet(telemetry::PACKET_PROXY_SCHEMA);
+    packet.put_u8(proxy_id);
+    packet.put_u8(properties.size());
+    for (auto const &[property_name, property] : properties) {
+        packet.put_string(property_name);
+        property_names.push_back(property_name);
+    }
+    packet.send(true);
+}
+
+void add_update(const uint8_t proxy_id, const uint8_t property_id, const std::string &value) {
+    if (value.size() + 2 > MAX_BATCH_SIZE) {
+        throw std::runtime_error("property value is too large for a proxy update");
+    }
+    if (batch.size() + value.size() + 2 > MAX_BATCH_SIZE) {
+        flush();
+    }
+    batch += static_cast<char>(proxy_id);
+    batch += static_cast<char>(property_id);
+    batch += value;
+}
+
+void flush() {
+    if (batch.empty()) {
+        return;
+    }
+    telemetry::Packet packet(telemetry::PACKET_PROXY_UPDATE);
+    packet.put_bytes(reinterpret_cast<const uint8_t *>(batch.data()), batch.size());
+    packet.send(true);
+    batch.clear();
+}
+
+void handle_update(const uint8_t *data, const size_t length) {
+    read_updates(data, length, [](const uint8_t proxy_id, const uint8_t property_id, const ConstExpression_ptr &value) {
+        const auto it = bindings.find(proxy_id);
+        if (it == bindings.end() || property_id >= it->second.property_names.size()) {
+            throw std::runtime_error("proxy update for unknown property " + std::to_string(proxy_id) + ":" + std::to_string(property_id));
+        }
+        it->second.module->write_property(it->second.property_names[property_id], value);
+    });
+}
+
+} // namespace proxy_channel
@@ -0,0 +1,58 @@
+#pragma once
+
+#include "../compilation/expression.h"
+#include "../compilation/variable.h"
+#include "../modules/module.h"
+#include "telemetry.h"
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <string>
+
+// Binary property synchronization between proxies on the core and their modules on an expander.
+//
+// The core numbers the proxies of each expander when they are created and binds the remote module with
+// `<module>.bind_proxy(<id>)` right after its `broadcast()`. From then on the module sends a schema packet, which
+// numbers its properties, and broadcasts changed properties as typed binary values instead of `!!` lines.
+// The updates of all modules are batched into one packet per main loop cycle. Once the core knows a schema,
+// it writes the proxy's properties with the same update packets. Module creation, method calls and everything else
+// stay text lines. The packets use the telemetry framing (see telemetry.h), followed by a newline for line detection,
+// so that they can be interleaved with the text protocol on the same serial connection.
+//
+// PACKET_PROXY_SCHEMA: u8 proxy id, u8 property count, property names (u8 length + characters) in property id order
+// PACKET_PROXY_UPDATE: entries of u8 proxy id, u8 property id, u8 value type and the value:
+//   VALUE_FALSE/VALUE_TRUE: nothing, VALUE_INTEGER: zigzag varint, VALUE_FLOAT: f32, VALUE_DOUBLE: f64,
+//   VALUE_STRING: varint length + characters
+// Numbers are sent as f32 if that is lossless. Identifiers have no binary representation, writes of them are sent as text.
+namespace proxy_channel {
+
+enum ValueType : uint8_t {
+    VALUE_FALSE = 0,
+    VALUE_TRUE = 1,
+    VALUE_INTEGER = 2,
+    VALUE_FLOAT = 3,
+    VALUE_DOUBLE = 4,
+    VALUE_STRING = 5,
+};
+
+constexpr size_t MAX_PROXIES = 256;                                // per expander, further proxies only use text
+constexpr size_t MAX_PROPERTIES = 255;                             // per proxy
+constexpr size_t MAX_BATCH_SIZE = telemetry::MAX_PAYLOAD_SIZE - 3; // update entries per packet, without type and CRC
+
+// Appends the type and value of a variable to `value` and returns false if it has no binary representation.
+bool encode_value(const Variable &variable, std::string &value);
+
+using UpdateHandler = std::function<void(uint8_t proxy_id, uint8_t property_id, const ConstExpression_ptr &value)>;
+
+// Calls the handler for each entry of an update packet (without type byte and CRC), throws on malformed data.
+void read_updates(const uint8_t *data, const size_t length, const UpdateHandler &handler);
+
+// Expander side
+void bind(const uint8_t proxy_id, const Module_ptr module);
+void send_schema(const uint8_t proxy_id, const std::map<std::string, Variable_ptr> &properties);
+void add_update(const uint8_t proxy_id, const uint8_t property_id, const std::string &value);
+void flush(); // sends the batched updates, called once per main loop cycle
+void handle_update(const uint8_t *data, const size_t length);
+
+} // namespace proxy_channel
@@ -1,5 +1,6 @@
 #include "serial-replicator.h"
 
+#include <algorithm>
 #include <cstddef>
 #include <numeric>
 #include <vector>
@@ -13,11 +14,15 @@
 #include <esp32_port.h>
 #include <esp_loader.h>
 #include <esp_partition.h>
+#include <esp_rom_md5.h>
 
 namespace ZZ::Replicator {
 
 static constexpr char TAG[]{"replicator"};
 
+/* Granularity of the comparison with the target's flash; a multiple of the 4 KB erase sector size */
+static constexpr uint32_t REGION_SIZE{0x4000};
+
 static constexpr char const *errorStrings[]{
     "SUCCESS",          /*!< Success */
     "FAIL",             /*!< Unspecified error */
@@ -117,11 +122,44 @@ static auto neededBlocks(const uint32_t value, const uint32_t blockSize) -> uint
     return blockCount;
 }
 
+static auto regionMatches(const std::byte *data, const uint32_t address, const uint32_t size) -> bool {
+    md5_context_t context;
+    uint8_t digest[ESP_ROM_MD5_DIGEST_LEN];
+    esp_rom_md5_init(&context);
+    esp_rom_md5_update(&context, data, size);
+    esp_rom_md5_final(digest, &context);
+
+    /* Any other error than a mismatch (e.g. a timeout) also causes the region to be written */
+    const esp_loader_error_t status{esp_loader_flash_verify_known_md5(address, size, digest)};
+    ESP_LOGD(TAG, "esp_loader_flash_verify_known_md5(0x%08lX) -> %u", address, status);
+    return status == ESP_LOADER_SUCCESS;
+}
+
+static auto writeRange(const std::byte *data, const uint32_t address, const uint32_t size, const uint32_t transferBlockSize) -> bool {
+    esp_loader_error_t status;
+
+    status = esp_loader_flash_start(address, size, transferBlockSize);
+    HANDLE_ERROR(status, "erasing target flash");
+
+    for (uint32_t offset = 0; offset < size; offset += transferBlockSize) {
+        const uint32_t length{std::min(transferBlockSize, size - offset)};
+        status = esp_loader_flash_write(const_cast<std::byte *>(data + offset), length);
+        ESP_LOGD(TAG, "esp_loader_flash_write(0x%08lX)", address + offset);
+
+        HANDLE_ERROR(status, "writing target flash");
+    }
+
+    status = esp_loader_flash_verify();
+    HANDLE_ERROR(status, "verifying md5 checksum");
+
+    return true;
+}
+
 static auto flash(uint32_t usedSize, uint32_t transferBlockSize) -> bool {
     const uint32_t pageCount{neededBlocks(usedSize, SPI_FLASH_MMU_PAGE_SIZE)};
-    const uint32_t blockCount{neededBlocks(usedSize, transferBlockSize)};
+    const uint32_t regionCount{neededBlocks(usedSize, REGION_SIZE)};
 
-    ESP_LOGI(TAG, "Replicating [%lu] bytes, from [%lu] pages, in [%lu] blocks", usedSize, pageCount, blockCount);
+    ESP_LOGI(TAG, "Replicating [%lu] bytes, from [%lu] pages, in [%lu] regions", usedSize, pageCount, regionCount);
 
     /* Fill vector with ascending indices starting at 0 */
     std::vector<int> pageIndices(pageCount);
@@ -133,42 +171,40 @@ static auto flash(uint32_t usedSize, uint32_t transferBlockSize) -> bool {
     ESP_ERROR_CHECK(spi_flash_mmap_pages(pageIndices.data(), pageIndices.size(), SPI_FLASH_MMAP_DATA, &ptr, &handle));
     Unmapper unmapper{handle};
 
-    esp_loader_error_t status;
-
-    status = esp_loader_flash_start(0, usedSize, transferBlockSize);
-    HANDLE_ERROR(status, "erasing target flash");
-
     auto bytePtr{reinterpret_cast<const std::byte *>(ptr)};
-    uint32_t toSend = usedSize;
-
-    /* Send all non-partial block */
-    int count = 0;
-    while (toSend >= transferBlockSize) {
-        if ((count++) % 10 == 0) {
-            ESP_LOGI(TAG, "%lu/%lu kb", (usedSize - toSend) / 1000, usedSize / 1000);
+    const auto regionSize = [&](const uint32_t region) { return std::min(REGION_SIZE, usedSize - region * REGION_SIZE); };
+
+    /* Only regions whose MD5 differs on the target are written, consecutive ones in a single run */
+    uint32_t writtenRegions{0};
+    uint32_t region{0};
+    while (region < regionCount) {
+        if (regionMatches(bytePtr + region * REGION_SIZE, region * REGION_SIZE, regionSize(region))) {
+            ++region;
+            continue;
         }
-        status = esp_loader_flash_write(const_cast<std::byte *>(bytePtr), transferBlockSize);
-        ESP_LOGD(TAG, "esp_loader_flash_write(0x%08lX)", usedSize - toSend);
-
-        HANDLE_ERROR(status, "writing target flash");
-
-        bytePtr += transferBlockSize;
-        toSend -= transferBlockSize;
+        uint32_t end{region + 1};
+        while (end < regionCount && !regionMatches(bytePtr + end * REGION_SIZE, end * REGION_SIZE, regionSize(end))) {
+            ++end;
+        }
+        const uint32_t address{region * REGION_SIZE};
+        const uint32_t size{std::min(end * REGION_SIZE, usedSize) - address};
+        ESP_LOGI(TAG, "Writing %lu kb at 0x%08lX", size / 1000, address);
+        if (!writeRange(bytePtr + address, address, size, transferBlockSize)) {
+            return false;
+        }
+        writtenRegions += end - region;
+        region = end;
     }
 
-    if (toSend > 0) {
-        /* Send last (partial) block */
-        status = esp_loader_flash_write(const_cast<std::byte *>(bytePtr), toSend);
-
-        ESP_LOGD(TAG, "esp_loader_flash_write(0x%08lX)", usedSize - toSend);
+    ESP_LOGI(TAG, "Wrote [%lu] of [%lu] regions, the others were unchanged", writtenRegions, regionCount);
 
-        HANDLE_ERROR(status, "writing target flash");
+    if (writtenRegions == 0) {
+        /* Without a FLASH_BEGIN there is nothing to finish, just leave the bootloader */
+        esp_loader_reset_target();
+        return true;
     }
 
-    status = esp_loader_flash_verify();
-    HANDLE_ERROR(status, "verifying md5 checksum");
-
-    status = esp_loader_flash_finish(true);
+    const esp_loader_error_t status{esp_loader_flash_finish(true)};
     HANDLE_ERROR(status, "finishing flash process");
 
     return true;
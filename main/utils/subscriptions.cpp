@@ -0,0 +1,149 @@
+#include "subscriptions.h"
+#include "../global.h"
+#include "output_format.h"
+#include "string_utils.h"
+#include "timing.h"
+#include "uart.h"
+#include <cmath>
+#include <map>
+#include <stdexcept>
+#include <vector>
+
+namespace subscriptions {
+
+constexpr size_t MAX_SUBSCRIPTIONS = 8;
+
+struct Subscription {
+    Module_ptr target; // nullptr for UART0
+    long address;
+    std::string target_name;
+    std::vector<OutputColumn> columns;
+    unsigned long interval_ms;
+    double deadband;
+    unsigned long last_send_millis = 0;
+    bool sent_any = false;
+    std::vector<double> last_values;      // per column, for the deadband
+    std::vector<std::string> last_strings; // per column, only used for strings
+    unsigned long sent = 0;
+    unsigned long dropped = 0;
+};
+
+static std::map<std::string, Subscription> subscriptions;
+
+static double numeric_value(const Variable_ptr &variable) {
+    switch (variable->type) {
+    case boolean:
+        return variable->boolean_value;
+    case integer:
+        return variable->integer_value;
+    case number:
+        return variable->number_value;
+    default:
+        return 0;
+    }
+}
+
+static bool has_changed(const Subscription &subscription) {
+    for (size_t i = 0; i < subscription.columns.size(); ++i) {
+        const Variable_ptr &variable = subscription.columns[i].variable;
+        if (variable->type == string ? variable->string_value != subscription.last_strings[i]
+                                     : std::abs(numeric_value(variable) - subscription.last_values[i]) > subscription.deadband) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void add(const std::string &name, const std::string &target, const std::string &format, const double interval, const double deadband) {
+    if (!subscriptions.count(name) && subscriptions.size() >= MAX_SUBSCRIPTIONS) {
+        throw std::runtime_error("too many subscriptions (at most " + std::to_string(MAX_SUBSCRIPTIONS) + ")");
+    }
+    if (interval < 0 || deadband < 0) {
+        throw std::runtime_error("interval and deadband must not be negative");
+    }
+    Subscription subscription;
+    subscription.target_name = target;
+    if (target == "uart") {
+        subscription.target = nullptr;
+        subscription.address = 0;
+    } else {
+        std::string address = target;
+        subscription.target = Global::get_module(cut_first_word(address, ':'));
+        try {
+            subscription.address = address.empty() ? 0 : std::stol(address);
+        } catch (const std::logic_error &) {
+            throw std::runtime_error("invalid address in subscription target \"" + target + "\"");
+        }
+    }
+    subscription.columns = parse_output_format(format);
+    if (subscription.columns.empty()) {
+        throw std::runtime_error("subscription needs at least one element");
+    }
+    subscription.interval_ms = std::lround(interval * 1000);
+    subscription.deadband = deadband;
+    subscription.last_values.resize(subscription.columns.size());
+    subscription.last_strings.resize(subscription.columns.size());
+    subscriptions[name] = subscription;
+}
+
+void remove(const std::string &name) {
+    if (!subscriptions.erase(name)) {
+        throw std::runtime_error("unknown subscription \"" + name + "\"");
+    }
+}
+
+void list() {
+    for (auto const &[name, subscription] : subscriptions) {
+        echo("%s -> %s every %lu ms, deadband %g: %lu sent, %lu dropped", name.c_str(), subscription.target_name.c_str(),
+             subscription.interval_ms, subscription.deadband, subscription.sent, subscription.dropped);
+    }
+}
+
+static void send(const std::string &name, Subscription &subscription) {
+    static char buffer[1024];
+    int pos = csprintf(buffer, sizeof(buffer), "%s", name.c_str());
+    for (const OutputColumn &column : subscription.columns) {
+        pos += csprintf(&buffer[pos], sizeof(buffer) - pos, " ");
+        pos += print_output_value(&buffer[pos], sizeof(buffer) - pos, column);
+    }
+
+    bool queued = true;
+    if (subscription.target) {
+        queued = subscription.target->send_line(subscription.address, buffer);
+    } else {
+        echo("%s", buffer);
+    }
+    subscription.last_send_millis = millis();
+    if (!queued) {
+        subscription.dropped++;
+        return; // keep the last values, so a change is sent again with the next interval
+    }
+    subscription.sent++;
+    subscription.sent_any = true;
+    for (size_t i = 0; i < subscription.columns.size(); ++i) {
+        const Variable_ptr &variable = subscription.columns[i].variable;
+        if (variable->type == string) {
+            subscription.last_strings[i] = variable->string_value;
+        } else {
+            subscription.last_values[i] = numeric_value(variable);
+        }
+    }
+}
+
+void step() {
+    for (auto it = subscriptions.begin(); it != subscriptions.end();) {
+        auto &[name, subscription] = *it;
+        try {
+            if (millis_since(subscription.last_send_millis) >= subscription.interval_ms &&
+                (!subscription.sent_any || subscription.deadband <= 0 || has_changed(subscription))) {
+                send(name, subscription);
+            }
+            ++it;
+        } catch (const std::runtime_error &e) {
+            echo("error in subscription \"%s\": %s (removed)", name.c_str(), e.what());
+            it = subscriptions.erase(it);
+        }
+    }
+}
+
+} // namespace subscriptions
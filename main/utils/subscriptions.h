@@ -0,0 +1,17 @@
+#pragma once
+
+#include <string>
+
+// Independent output streams for individual receivers, e.g. a fast host on UART0 and a slow phone app via Bluetooth.
+//
+// Each subscription has its own output format (like core.output), interval and deadband and is sent to a target:
+// "uart" for UART0 or a module that can send lines, e.g. "ble" or "bus:3" for peer 3 of a SerialBus module "bus".
+// Targets never block; lines that cannot be queued are counted as dropped.
+namespace subscriptions {
+
+void add(const std::string &name, const std::string &target, const std::string &format, const double interval, const double deadband);
+void remove(const std::string &name);
+void list();
+void step();
+
+} // namespace subscriptions
@@ -0,0 +1,133 @@
+#include "telemetry.h"
+#include "uart.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+
+namespace telemetry {
+
+uint16_t crc16(const uint8_t *data, const size_t length, uint16_t crc) {
+    for (size_t i = 0; i < length; ++i) {
+        crc ^= static_cast<uint16_t>(data[i]) << 8;
+        for (int bit = 0; bit < 8; ++bit) {
+            crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+        }
+    }
+    return crc;
+}
+
+size_t cobs_encode(const uint8_t *input, const size_t length, uint8_t *output) {
+    size_t code_pos = 0;
+    size_t out_pos = 1;
+    uint8_t code = 1;
+    for (size_t i = 0; i < length; ++i) {
+        if (input[i] != 0) {
+            output[out_pos++] = input[i];
+            code++;
+        }
+        if (input[i] == 0 || code == 0xff) {
+            output[code_pos] = code;
+            code_pos = out_pos++;
+            code = 1;
+        }
+    }
+    output[code_pos] = code;
+    return out_pos;
+}
+
+size_t cobs_decode(const uint8_t *input, const size_t length, uint8_t *output) {
+    size_t in_pos = 0;
+    size_t out_pos = 0;
+    while (in_pos < length) {
+        const uint8_t code = input[in_pos++];
+        if (code == 0 || in_pos + code - 1 > length) {
+            return 0;
+        }
+        for (uint8_t i = 1; i < code; ++i) {
+            output[out_pos++] = input[in_pos++];
+        }
+        if (code < 0xff && in_pos < length) {
+            output[out_pos++] = 0;
+        }
+    }
+    return out_pos;
+}
+
+Packet::Packet(const uint8_t packet_type) {
+    this->put_u8(packet_type);
+}
+
+void Packet::reserve(const size_t size) const {
+    // two bytes are kept free for the CRC
+    if (this->length + size + 2 > sizeof(this->buffer)) {
+        throw std::runtime_error("telemetry packet is too large");
+    }
+}
+
+void Packet::put_u8(const uint8_t value) {
+    this->reserve(1);
+    this->buffer[this->length++] = value;
+}
+
+void Packet::put_u16(const uint16_t value) {
+    this->reserve(2);
+    this->buffer[this->length++] = value & 0xff;
+    this->buffer[this->length++] = value >> 8;
+}
+
+void Packet::put_u32(const uint32_t value) {
+    this->reserve(4);
+    for (int i = 0; i < 4; ++i) {
+        this->buffer[this->length++] = (value >> (8 * i)) & 0xff;
+    }
+}
+
+void Packet::put_i32(const int32_t value) {
+    this->put_u32(static_cast<uint32_t>(value));
+}
+
+void Packet::put_f32(const float value) {
+    uint32_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    this->put_u32(bits);
+}
+
+void Packet::put_string(const std::string &value) {
+    const size_t length = std::min(value.size(), static_cast<size_t>(255));
+    this->put_u8(length);
+    this->reserve(length);
+    std::memcpy(&this->buffer[this->length], value.data(), length);
+    this->length += length;
+}
+
+void Packet::put_bytes(const uint8_t *data, const size_t length) {
+    this->reserve(length);
+    std::memcpy(&this->buffer[this->length], data, length);
+    this->length += length;
+}
+
+size_t Packet::encode(uint8_t *frame, const bool newline) {
+    const uint16_t crc = crc16(this->buffer, this->length);
+    this->buffer[this->length++] = crc & 0xff;
+    this->buffer[this->length++] = crc >> 8;
+
+    // leading delimiter, COBS overhead of one byte per 254 payload bytes plus the code byte, trailing delimiter
+    frame[0] = 0x00;
+    const size_t encoded_length = cobs_encode(this->buffer, this->length, &frame[1]);
+    frame[encoded_length + 1] = 0x00;
+    if (newline) {
+        frame[encoded_length + 2] = '\n';
+    }
+    return encoded_length + (newline ? 3 : 2);
+}
+
+void Packet::send(const bool newline) {
+    static uint8_t frame[MAX_FRAME_SIZE];
+    const size_t frame_length = this->encode(frame, newline);
+
+    // same ring buffer as echo(), so frames and text lines never interleave mid-line
+    echo_raw(reinterpret_cast<const char *>(frame), frame_length);
+}
+
+} // namespace telemetry
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Binary telemetry frames on UART0, interleaved with the text protocol.
+//
+// A frame is `0x00 <COBS(payload + crc16)> 0x00`. Text lines never contain a NUL byte, so a host can tell both
+// apart by the first byte: 0x00 starts a binary frame that ends at the next 0x00, anything else is a text line.
+// The CRC is CRC-16/CCITT-FALSE (poly 0x1021, init 0xffff, little-endian), i.e. Python's
+// `binascii.crc_hqx(payload, 0xffff)`. All multi-byte values are little-endian. See `telemetry.py` for a decoder.
+//
+// The host can send commands in the same framing (followed by a newline for UART0's line detection), see main.cpp.
+// Each command frame is answered with an ACK once its statements have been executed, or a NACK with the expected
+// sequence number if it was corrupted or arrived out of order, so that the host can pipeline commands (go-back-N).
+namespace telemetry {
+
+constexpr uint8_t PACKET_SCHEMA = 0x01;
+constexpr uint8_t PACKET_SAMPLE = 0x02;
+constexpr uint8_t PACKET_RECORDING_HEADER = 0x03;
+constexpr uint8_t PACKET_RECORDING_DATA = 0x04;
+constexpr uint8_t PACKET_COMMAND = 0x05;      // host to device: flags, u16 sequence, statements separated by newlines
+constexpr uint8_t PACKET_ACK = 0x06;          // u16 sequence, u8 status
+constexpr uint8_t PACKET_NACK = 0x07;         // u16 expected sequence, u8 reason
+constexpr uint8_t PACKET_PROXY_SCHEMA = 0x08; // expander to core, see proxy_channel.h
+constexpr uint8_t PACKET_PROXY_UPDATE = 0x09; // expander to core and back, see proxy_channel.h
+
+constexpr uint8_t FLAG_TIMESTAMPS = 0x01;
+constexpr uint8_t FLAG_NEW_SESSION = 0x01; // command frames: accept this sequence number regardless of the previous one
+
+enum AckStatus : uint8_t {
+    ACK_OK = 0,
+    ACK_ERROR = 1,     // at least one statement raised an error
+    ACK_DUPLICATE = 2, // already executed, e.g. a retransmission after a lost ACK
+};
+
+enum NackReason : uint8_t {
+    NACK_CRC = 1,
+    NACK_INVALID = 2,
+    NACK_TOO_LONG = 3,
+    NACK_SEQUENCE = 4,
+};
+
+constexpr size_t MAX_PAYLOAD_SIZE = 1024;
+constexpr size_t MAX_FRAME_SIZE = MAX_PAYLOAD_SIZE + MAX_PAYLOAD_SIZE / 254 + 4; // incl. delimiters and a newline
+
+uint16_t crc16(const uint8_t *data, const size_t length, uint16_t crc = 0xffff);
+size_t cobs_encode(const uint8_t *input, const size_t length, uint8_t *output);
+size_t cobs_decode(const uint8_t *input, const size_t length, uint8_t *output); // returns 0 for invalid input
+
+class Packet {
+public:
+    Packet(const uint8_t packet_type);
+
+    void put_u8(const uint8_t value);
+    void put_u16(const uint16_t value);
+    void put_u32(const uint32_t value);
+    void put_i32(const int32_t value);
+    void put_f32(const float value);
+    void put_string(const std::string &value);
+    void put_bytes(const uint8_t *data, const size_t length);
+    size_t get_length() const { return this->length; }
+
+    // Appends the CRC and writes the frame (optionally followed by a newline) to `frame`, which must hold
+    // MAX_FRAME_SIZE bytes. Returns the frame length. Like send(), this may only be called once per packet.
+    size_t encode(uint8_t *frame, const bool newline = false);
+    void send(const bool newline = false);
+
+private:
+    uint8_t buffer[MAX_PAYLOAD_SIZE];
+    size_t length = 0;
+
+    void reserve(const size_t size) const;
+};
+
+} // namespace telemetry
@@ -1,17 +1,123 @@
 #include "uart.h"
+#include "driver/uart.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "timing.h"
 #include <algorithm>
+#include <atomic>
 #include <cstdarg>
 #include <cstdint>
+#include <memory>
 #include <stdexcept>
 #include <stdio.h>
 #include <string>
 
+// must hold the largest single record, i.e. a full echo() line or a binary telemetry frame
+static constexpr size_t ECHO_CHUNK_SIZE = 2048;
+
 static std::vector<EchoCallback> echo_callbacks;
+static std::unique_ptr<OutputBuffer> echo_buffer;
+static TaskHandle_t echo_writer_task = nullptr;
+static std::atomic<bool> echo_writing{false};
 
 void register_echo_callback(const EchoCallback &callback) {
     echo_callbacks.push_back(callback);
 }
 
+static int append_checksum(char *buffer, const int len) {
+    uint8_t checksum = 0;
+    for (int i = 0; i < len; ++i) {
+        checksum ^= buffer[i];
+    }
+    return len + std::sprintf(&buffer[len], "@%02x\n", checksum);
+}
+
+[[noreturn]] static void echo_writer_loop(void *) {
+    static char chunk[ECHO_CHUNK_SIZE];
+    uint32_t reported_drops = 0;
+    while (true) {
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(100));
+        echo_writing = true;
+        size_t length;
+        while ((length = echo_buffer->pop(chunk, sizeof(chunk))) > 0) {
+            // blocks this task only; with no TX ring in the UART driver it waits for FIFO space without spinning
+            uart_write_bytes(UART_NUM_0, chunk, length);
+        }
+        const uint32_t dropped = echo_buffer->dropped;
+        if (dropped != reported_drops) {
+            const int len = std::snprintf(chunk, sizeof(chunk) - 4, "warning: dropped %lu output lines (TX buffer full)",
+                                          static_cast<unsigned long>(dropped - reported_drops));
+            uart_write_bytes(UART_NUM_0, chunk, append_checksum(chunk, len));
+            reported_drops = dropped;
+        }
+        echo_writing = false;
+    }
+}
+
+void start_echo_writer(const size_t buffer_size) {
+    if (echo_writer_task) {
+        return;
+    }
+    echo_buffer = std::make_unique<OutputBuffer>(std::max(buffer_size, ECHO_CHUNK_SIZE));
+    // flush what printf has buffered so far, the writer task bypasses stdout
+    fflush(stdout);
+    if (xTaskCreatePinnedToCore(echo_writer_loop, "echo_writer", 2048, nullptr, 1, &echo_writer_task, 1) != pdPASS) {
+        echo_buffer.reset();
+        echo_writer_task = nullptr;
+        throw std::runtime_error("could not start echo writer task");
+    }
+}
+
+static void write_output(const char *data, const size_t length, const char *suffix = nullptr, const size_t suffix_length = 0) {
+    if (!echo_writer_task) {
+        fwrite(data, 1, length, stdout);
+        fwrite(suffix, 1, suffix_length, stdout);
+        fflush(stdout);
+        return;
+    }
+    echo_buffer->push(data, length, suffix, suffix_length);
+    xTaskNotifyGive(echo_writer_task);
+}
+
+void echo_raw(const char *data, const size_t length) {
+    write_output(data, length);
+}
+
+bool flush_echo(const unsigned long timeout_ms) {
+    if (!echo_writer_task) {
+        fflush(stdout);
+        return true;
+    }
+    const unsigned long start = millis();
+    while (echo_buffer->size() > 0 || echo_writing) {
+        if (millis_since(start) > timeout_ms) {
+            return false;
+        }
+        xTaskNotifyGive(echo_writer_task);
+        vTaskDelay(pdMS_TO_TICKS(1));
+    }
+    return uart_wait_tx_done(UART_NUM_0, pdMS_TO_TICKS(timeout_ms)) == ESP_OK;
+}
+
+void set_echo_overflow(const OutputBuffer::Overflow overflow) {
+    if (echo_buffer) {
+        echo_buffer->overflow = overflow;
+    }
+}
+
+size_t get_echo_available() {
+    // without the writer task output is written synchronously, so there is always room
+    return echo_buffer ? echo_buffer->available() : SIZE_MAX;
+}
+
+uint32_t get_echo_dropped() {
+    return echo_buffer ? echo_buffer->dropped.load() : 0;
+}
+
+size_t get_echo_high_water() {
+    return echo_buffer ? echo_buffer->get_high_water() : 0;
+}
+
 void echo(const char *format, ...) {
     static char buffer[1024];
 
@@ -28,7 +134,11 @@ void echo(const char *format, ...) {
     for (unsigned int i = 0; i < pos; ++i) {
         if (buffer[i] == '\n') {
             buffer[i] = '\0';
-            printf("%s@%02x\n", &buffer[start], checksum);
+            char suffix[5];
+            std::sprintf(suffix, "@%02x\n", checksum);
+            write_output(&buffer[start], i - start, suffix, 4);
+            // callbacks run on the caller's task (the SerialBus relay depends on the command being processed)
+            // and have to hand the line to their own queue without blocking
             for (const auto &callback : echo_callbacks) {
                 callback(&buffer[start]);
             }
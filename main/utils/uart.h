@@ -1,11 +1,24 @@
 #pragma once
 
+#include "output_buffer.h"
+#include <cstddef>
 #include <cstdint>
 #include <functional>
 #include <vector>
 
 void echo(const char *fmt, ...);
+void echo_raw(const char *data, const size_t length);
 typedef std::function<void(const char *line)> EchoCallback;
 void register_echo_callback(const EchoCallback &callback);
+
+// Once started, echo() and echo_raw() only copy into a ring buffer that a writer task drains to UART0,
+// so callers never block on serial output. Before that (and if starting fails) they write synchronously.
+void start_echo_writer(const size_t buffer_size);
+bool flush_echo(const unsigned long timeout_ms);
+void set_echo_overflow(const OutputBuffer::Overflow overflow);
+size_t get_echo_available();
+uint32_t get_echo_dropped();
+size_t get_echo_high_water();
+
 int strip(char *buffer, int len);
 int check(char *buffer, int len, bool *checksum_ok);
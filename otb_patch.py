@@ -0,0 +1,167 @@
+#!/usr/bin/env python3
+import argparse
+import hashlib
+import struct
+import sys
+from pathlib import Path
+
+# must match main/utils/image_patch.h
+MAGIC = b'OTBP'
+VERSION = 1
+WINDOW_BITS = 12
+WINDOW_SIZE = 1 << WINDOW_BITS
+HEADER = struct.Struct('<4sBBHII32s')
+LITERAL, BASE_COPY, OUTPUT_COPY = range(3)
+
+MIN_MATCH = 6  # shorter copies do not pay off against their op bytes
+MAX_COPY = 4096  # bounds the flash work a single chunk can cause on the target
+BASE_TABLE_BITS = 22
+OUTPUT_TABLE_BITS = 16
+
+
+def varint(value: int) -> bytes:
+    result = bytearray()
+    while value >= 0x80:
+        result.append(value & 0x7f | 0x80)
+        value >>= 7
+    result.append(value)
+    return bytes(result)
+
+
+def op(kind: int, length: int) -> bytes:
+    return bytes([kind << 6 | length]) if length < 64 else bytes([kind << 6]) + varint(length)
+
+
+def bucket(data: bytes, i: int, bits: int) -> int:
+    """Multiplicative hash of the MIN_MATCH bytes at i (deterministic, unlike hash() of bytes)."""
+    return (int.from_bytes(data[i:i + MIN_MATCH], 'little') * 0x9E3779B97F4A7C15 >> 40) & ((1 << bits) - 1)
+
+
+def match_length(source: bytes, s: int, image: bytes, i: int, limit: int) -> int:
+    """Length of the common prefix of source[s:] and image[i:], compared in blocks first."""
+    length = 0
+    while length + 64 <= limit and source[s + length:s + length + 64] == image[i + length:i + length + 64]:
+        length += 64
+    while length < limit and source[s + length] == image[i + length]:
+        length += 1
+    return length
+
+
+def encode(image: bytes, base: bytes = b'') -> bytes:
+    """Greedy LZ parse of the image with copies from the base image and from the last WINDOW_SIZE output bytes."""
+    base_table = [-1] * (1 << BASE_TABLE_BITS)
+    for s in range(len(base) - MIN_MATCH + 1):
+        base_table[bucket(base, s, BASE_TABLE_BITS)] = s
+    output_table = [-1] * (1 << OUTPUT_TABLE_BITS)
+
+    ops = bytearray()
+    base_end = 0  # the decoder's base cursor
+    base_end_position = 0  # output position at which the previous base copy ended
+    literal_start = 0
+    i = 0
+    while i + MIN_MATCH <= len(image):
+        output_bucket = bucket(image, i, OUTPUT_TABLE_BITS)
+        best_length, best_kind, best_source = 0, LITERAL, 0
+        # same alignment as the previous base copy first: catches bytes changed in place (e.g. shifted addresses)
+        for s in (base_end + i - base_end_position, base_table[bucket(image, i, BASE_TABLE_BITS)]):
+            if 0 <= s <= len(base) - MIN_MATCH:
+                length = match_length(base, s, image, i, min(len(base) - s, len(image) - i))
+                if length > best_length:
+                    best_length, best_kind, best_source = length, BASE_COPY, s
+        s = output_table[output_bucket]
+        if 0 <= s and i - s <= WINDOW_SIZE:
+            length = match_length(image, s, image, i, len(image) - i)
+            if length > best_length:
+                best_length, best_kind, best_source = length, OUTPUT_COPY, s
+        output_table[output_bucket] = i
+        if best_length < MIN_MATCH:
+            i += 1
+            continue
+
+        source = base if best_kind == BASE_COPY else image
+        while (i > literal_start and best_source > 0 and source[best_source - 1] == image[i - 1] and
+               (best_kind == BASE_COPY or i - best_source < WINDOW_SIZE)):
+            i, best_source, best_length = i - 1, best_source - 1, best_length + 1
+        if i > literal_start:
+            ops += op(LITERAL, i - literal_start) + image[literal_start:i]
+        for start in range(0, best_length, MAX_COPY):
+            length = min(MAX_COPY, best_length - start)
+            if best_kind == BASE_COPY:
+                relative = best_source + start - base_end
+                ops += op(BASE_COPY, length) + varint(relative << 1 if relative >= 0 else (-relative << 1) - 1)
+                base_end = best_source + start + length
+            else:
+                ops += op(OUTPUT_COPY, length) + varint(i - best_source - 1)
+        for k in range(max(i, i + best_length - WINDOW_SIZE), min(i + best_length, len(image) - MIN_MATCH + 1)):
+            output_table[bucket(image, k, OUTPUT_TABLE_BITS)] = k
+        i += best_length
+        base_end_position = i if best_kind == BASE_COPY else base_end_position
+        literal_start = i
+    if literal_start < len(image):
+        ops += op(LITERAL, len(image) - literal_start) + image[literal_start:]
+
+    header = HEADER.pack(MAGIC, VERSION, WINDOW_BITS, 0, len(image), len(base), hashlib.sha256(image).digest())
+    return header + bytes(ops)
+
+
+def decode(patch: bytes, base: bytes = b'') -> bytes:
+    """Reference decoder, used to verify a patch before it is sent."""
+    magic, version, window_bits, _, size, base_size, sha256 = HEADER.unpack_from(patch)
+    if magic != MAGIC or version != VERSION or window_bits > WINDOW_BITS:
+        raise ValueError('unsupported patch')
+    if base_size != len(base):
+        raise ValueError(f'patch needs a base image of {base_size} bytes')
+    output = bytearray()
+    base_end = 0
+    p = HEADER.size
+
+    def read_varint() -> int:
+        nonlocal p
+        value = shift = 0
+        while True:
+            byte = patch[p]
+            p += 1
+            value |= (byte & 0x7f) << shift
+            shift += 7
+            if byte < 0x80:
+                return value
+
+    while len(output) < size:
+        kind, length = patch[p] >> 6, patch[p] & 0x3f
+        p += 1
+        length = length or read_varint()
+        if kind == LITERAL:
+            output += patch[p:p + length]
+            p += length
+        elif kind == BASE_COPY:
+            value = read_varint()
+            base_end += value >> 1 if value & 1 == 0 else -((value + 1) >> 1)
+            output += base[base_end:base_end + length]
+            base_end += length
+        elif kind == OUTPUT_COPY:
+            distance = read_varint() + 1
+            for _ in range(length):
+                output.append(output[-distance])
+        else:
+            raise ValueError('invalid op')
+    if p != len(patch) or len(output) != size or hashlib.sha256(output).digest() != sha256:
+        raise ValueError('patch does not reproduce the image')
+    return bytes(output)
+
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(description='Create a compressed or delta firmware image for OTB updates')
+    parser.add_argument('firmware', help='Path to the new firmware binary')
+    parser.add_argument('output', help='Path of the patch to write')
+    parser.add_argument('--base', help='Firmware binary the target is running (creates a delta instead of a compressed image)')
+    args = parser.parse_args()
+
+    image = Path(args.firmware).read_bytes()
+    base = Path(args.base).read_bytes() if args.base else b''
+    patch = encode(image, base)
+    try:
+        decode(patch, base)
+    except (ValueError, IndexError) as e:
+        sys.exit(f'Patch verification failed: {e}')
+    Path(args.output).write_bytes(patch)
+    print(f'Wrote {args.output}: {len(patch)} bytes for a {len(image)} byte image ({len(patch) / len(image):.1%})')
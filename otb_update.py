@@ -1,6 +1,7 @@
 #!/usr/bin/env python3
 import argparse
 import base64
+import hashlib
 import re
 import sys
 import time
@@ -9,18 +10,23 @@ from pathlib import Path
 
 import serial
 
-CHUNK_SIZE = 165  # must match BUS_OTB_CHUNK_SIZE in main/utils/otb.h (the chunk line has to fit the bus payload)
-WINDOW = 8  # must match BUS_OTB_WINDOW in main/utils/otb.h
-ACK_TIMEOUT = 2.0  # resend the window when no ack arrives for this long
+CHUNK_SIZE = 165  # chunk size of targets that do not advertise one (the chunk line has to fit the bus payload)
+WINDOW = 8  # window of targets without selective acknowledgements
+ACK_TIMEOUT = 2.0  # resend when no ack arrives for this long
 STALL_TIMEOUT = 15.0  # give up when the target makes no progress for this long (its own session timeout is 10 s)
+PATCH_MAGIC = b'OTBP'  # compressed or delta image created by otb_patch.py
+COMMIT_TIMEOUT = 5.0  # a multicast peer hashes its image before it acknowledges the commit
+MULTICAST_CHUNK_SIZE = 160  # multicast chunks are written at their offset, which has to be 16-byte aligned
 
 parser = argparse.ArgumentParser(description='Push firmware via SerialBus OTB')
 parser.add_argument('firmware', help='Path to firmware binary')
 parser.add_argument('--port', default='/dev/ttyUSB0', help='Serial port')
 parser.add_argument('--baud', type=int, default=115200, help='Baudrate')
-parser.add_argument('--target', type=int, required=True, help='Bus ID of target node')
+parser.add_argument('--target', type=int, nargs='+', required=True,
+                    help='Bus ID of the target node (several IDs update all of them at once via multicast)')
 parser.add_argument('--bus', default='bus', help='SerialBus module name')
 parser.add_argument('--expander', help='Expander to pause broadcasts on')
+parser.add_argument('--chunk-size', type=int, help='Chunk size in bytes (default: the maximum the target supports)')
 args = parser.parse_args()
 
 firmware = Path(args.firmware)
@@ -28,7 +34,6 @@ if not firmware.exists():
     sys.exit(f'Firmware not found: {firmware}')
 
 file_size = firmware.stat().st_size
-number_of_chunks = (file_size + CHUNK_SIZE - 1) // CHUNK_SIZE
 
 try:
     dev = serial.Serial(args.port, args.baud, timeout=0.5)
@@ -59,32 +64,225 @@ def wait_ack(prefix: str, timeout: float = 10.0) -> str:
     raise OtbTimeout(f'no {prefix} within {timeout:.0f} s')
 
 
-def transact(msg: str, ack: str = '') -> str:
-    dev.write(f'{args.bus}.send({args.target},"{msg}")\n'.encode())
+def transact(msg: str, ack: str = '', target: int | None = None) -> str:
+    dev.write(f'{args.bus}.send({args.target[0] if target is None else target},"{msg}")\n'.encode())
     return wait_ack(ack) if ack else ''
 
 
-def send_chunks(data: bytes, use_crc: bool) -> int:
-    """Sliding window with go-back-N retransmission; returns the number of resent chunks.
+def parse_capabilities(begin_ack: str) -> dict[str, str]:
+    """Capabilities the target lists after __OTB_ACK_BEGIN__, e.g. ':crc32,sack=12,chunk=168'."""
+    suffix = begin_ack.split('__OTB_ACK_BEGIN__', 1)[1].strip().lstrip(':')
+    return dict(item.split('=', 1) if '=' in item else (item, '') for item in suffix.split(',') if item)
+
+
+def chunk_line(data: bytes, seq: int, chunk_size: int, use_crc: bool, prefix: str = '__OTB_CHUNK_') -> str:
+    chunk = data[seq * chunk_size:(seq + 1) * chunk_size]
+    b64 = base64.b64encode(chunk).decode()
+    if not use_crc:
+        return f'{prefix}{seq}__:{b64}'
+    crc = zlib.crc32(chunk, zlib.crc32(str(seq).encode()))  # covers the offset, not just the bytes
+    return f'{prefix}{seq}__:{crc:08x}:{b64}'
+
+
+ACK_PATTERN = re.compile(r'__OTB_ACK_CHUNK_(\d+)__(?::([0-9a-f]+))?')
+
+
+def send_chunks_selective(data: bytes, number_of_chunks: int, chunk_size: int, max_window: int) -> int:
+    """Selective repeat with an adaptive window; returns the number of resent chunks.
+
+    Each ack confirms all chunks up to the last written one plus a bitmap of chunks the target holds after a gap.
+    A chunk that is still missing when a chunk sent after it has been acknowledged is resent right away.
+    The window grows by one chunk per window without loss and is halved once per loss event.
+    """
+    done = [False] * number_of_chunks
+    in_flight: dict[int, tuple[int, float]] = {}  # seq -> (transmission number, time)
+    transmissions = 0
+    recovery_until = 0  # losses of chunks sent before this transmission belong to the last loss event
+    window = float(min(WINDOW, max_window))
+    base = 0  # first chunk not yet acknowledged
+    next_seq = 0
+    resends = 0
+    last_progress_at = time.time()
+
+    def send(seq: int) -> None:
+        nonlocal transmissions
+        transmissions += 1
+        in_flight[seq] = (transmissions, time.time())
+        transact(chunk_line(data, seq, chunk_size, True))
+
+    def lost(seqs: list[int]) -> None:
+        nonlocal resends, window, recovery_until
+        if any(in_flight[seq][0] > recovery_until for seq in seqs):
+            window = max(2.0, window / 2)
+            recovery_until = transmissions
+        for seq in sorted(seqs):
+            send(seq)
+        resends += len(seqs)
+
+    while base < number_of_chunks:
+        while len(in_flight) < int(window) and next_seq < min(number_of_chunks, base + max_window):
+            send(next_seq)
+            next_seq += 1
+        line = read_line()
+        now = time.time()
+        if match := ACK_PATTERN.search(line):
+            written = int(match.group(1))
+            bitmap = int(match.group(2) or '0', 16)
+            acked = [seq for seq in in_flight
+                     if seq <= written or (seq > written + 1 and bitmap >> (seq - written - 2) & 1)]
+            for seq in range(base, min(written + 1, number_of_chunks)):
+                done[seq] = True
+            for seq in acked:
+                done[seq] = True
+            latest = max((in_flight.pop(seq)[0] for seq in acked), default=0)
+            if acked:
+                window = min(float(max_window), window + len(acked) / window)
+                last_progress_at = now
+            while base < number_of_chunks and done[base]:
+                base += 1
+                if base % 50 == 0 or base == number_of_chunks:
+                    print(f'\rSending chunk {base}/{number_of_chunks} ({resends} resends, window {int(window)})...', end='')
+            if overtaken := [seq for seq, (number, _) in in_flight.items() if number < latest]:
+                lost(overtaken)
+        if timed_out := [seq for seq, (_, sent_at) in in_flight.items() if now - sent_at > ACK_TIMEOUT]:
+            lost(timed_out)
+        if now - last_progress_at > STALL_TIMEOUT:
+            raise OtbError(f'no progress for {STALL_TIMEOUT:.0f} s')
+    return resends
+
+
+def read_reply() -> tuple[int, str] | None:
+    """The next OTB reply relayed by the coordinator as (peer, message), errors included."""
+    line = dev.readline().decode(errors='ignore')
+    if match := re.search(r'otb\[(\d+)\] (__OTB_[^@\s]*)', line):
+        return int(match.group(1)), match.group(2)
+    return None
+
+
+def request(target: int, msg: str, reply: str, timeout: float = ACK_TIMEOUT, attempts: int = 3) -> str:
+    """Sends msg to one of several peers and returns the rest of its reply; replies of other peers are skipped."""
+    for _ in range(attempts):
+        transact(msg, target=target)
+        deadline = time.time() + timeout
+        while time.time() < deadline:
+            if not (answer := read_reply()) or answer[0] != target:
+                continue
+            if answer[1].startswith('__OTB_ERROR__'):
+                raise OtbError(answer[1])
+            if answer[1].startswith(reply):
+                return answer[1][len(reply):]
+    raise OtbTimeout(f'no {reply} within {attempts} attempts')
+
+
+def send_multicast(data: bytes, targets: list[int], chunk_size: int) -> tuple[list[int], dict[int, str]]:
+    """Broadcasts every chunk once, then resends the union of the chunks the peers report missing.
+
+    Each peer is committed as soon as it has all chunks and its image hash matches.
+    Returns the updated peers and the error of each peer that dropped out.
+    """
+    number_of_chunks = (len(data) + chunk_size - 1) // chunk_size
+    active: list[int] = []
+    failed: dict[int, str] = {}
+    progress: dict[int, tuple[int, float]] = {}  # fewest missing chunks each peer has reported, and when
+    window = 0  # the smallest receive window of all peers
+
+    def drop(target: int, error: Exception) -> None:
+        failed[target] = str(error)
+        if target in active:
+            active.remove(target)
+        transact('__OTB_ABORT__', target=target)
+
+    def status(target: int) -> tuple[int, list[int]]:
+        """Number of missing chunks of a peer (-1 if it did not answer this time) and as many of them as fit a reply."""
+        try:
+            count, _, ranges = request(target, '__OTB_STATUS__', '__OTB_ACK_STATUS__:').partition(':')
+        except OtbTimeout:
+            count, ranges = '-1', ''
+        fewest, since = progress[target]
+        if 0 <= int(count) < fewest:
+            progress[target] = int(count), time.time()
+        elif time.time() - since > STALL_TIMEOUT:
+            raise OtbError(f'no progress for {STALL_TIMEOUT:.0f} s')
+        missing = []
+        for item in filter(None, ranges.split(',')):
+            first, _, last = item.partition('-')
+            missing.extend(range(int(first), int(last or first) + 1))
+        return int(count), missing
+
+    def broadcast(seqs: list[int]) -> None:
+        for start in range(0, len(seqs), window):
+            for seq in seqs[start:start + window]:
+                dev.write(f'{args.bus}.send_all("{chunk_line(data, seq, chunk_size, True, "__OTB_MCHUNK_")}")\n'.encode())
+            while active:  # paces the stream: the status request is queued behind the burst on the coordinator
+                try:
+                    status(active[0])
+                    break
+                except OtbError as e:
+                    drop(active[0], e)
+            if start // window % 10 == 0:
+                print(f'\rBroadcasting chunk {min(start + window, len(seqs))}/{len(seqs)}...', end='')
+
+    # all peers begin at once, so a missing peer does not let the others' sessions time out
+    begin = f'__OTB_MBEGIN__:{len(data)}:{chunk_size}:{hashlib.sha256(data).hexdigest()}'
+    pending = list(targets)
+    for _ in range(3):
+        for target in active + pending:  # a repeated begin is acknowledged again and keeps the session alive
+            transact(begin, target=target)
+        deadline = time.time() + 10.0  # erasing the update partition takes a few seconds
+        while pending and time.time() < deadline:
+            if not (answer := read_reply()) or answer[0] not in pending:
+                continue
+            target, message = answer
+            pending.remove(target)
+            if message.startswith('__OTB_ERROR__'):
+                drop(target, OtbError(message))
+            elif message.startswith('__OTB_ACK_BEGIN__'):
+                sack = int(parse_capabilities(message).get('sack', WINDOW))
+                window = min(window, sack) if window else sack
+                active.append(target)
+            else:
+                pending.append(target)
+        if not pending:
+            break
+    for target in pending:
+        drop(target, OtbTimeout('no __OTB_ACK_BEGIN__ within 3 attempts'))
+    progress.update({target: (number_of_chunks + 1, time.time()) for target in active})
+    print(f'Broadcasting {number_of_chunks} chunks to nodes {active}...')
+    broadcast(list(range(number_of_chunks)))
+
+    updated: list[int] = []
+    while active:
+        gaps: set[int] = set()
+        for target in list(active):
+            try:
+                count, missing = status(target)
+                if count == 0:
+                    request(target, '__OTB_COMMIT__', '__OTB_ACK_COMMIT__', COMMIT_TIMEOUT)
+                    transact('core.restart()', target=target)
+                    active.remove(target)
+                    updated.append(target)
+                    print(f'\rNode {target} updated, restarting it.                ')
+                gaps.update(missing)
+            except OtbError as e:
+                drop(target, e)
+        if gaps and active:
+            print(f'\rRepairing {len(gaps)} chunks missing on {len(active)} nodes...')
+            broadcast(sorted(gaps))
+    return updated, failed
+
+
+def send_chunks(data: bytes, number_of_chunks: int, chunk_size: int, use_crc: bool) -> int:
+    """Sliding window with go-back-N retransmission for targets without selective acknowledgements.
 
     The target re-acks its last written chunk (or __OTB_ACK_BEGIN__ while nothing is written) on any gap,
     duplicate or corrupted chunk, so a lost frame in either direction rewinds the window instead of aborting.
     """
-    ack_pattern = re.compile(r'__OTB_ACK_CHUNK_(\d+)__')
     acked = -1  # highest chunk the target has confirmed written
     sent = -1  # last chunk we pushed out
     resends = 0
     stale_until = -2  # after a rewind the target keeps re-acking the stale window; those must not rewind again
     last_ack_at = last_progress_at = time.time()
 
-    def chunk_line(seq: int) -> str:
-        chunk = data[seq * CHUNK_SIZE:(seq + 1) * CHUNK_SIZE]
-        b64 = base64.b64encode(chunk).decode()
-        if not use_crc:
-            return f'__OTB_CHUNK_{seq}__:{b64}'
-        crc = zlib.crc32(chunk, zlib.crc32(str(seq).encode()))  # covers the offset, not just the bytes
-        return f'__OTB_CHUNK_{seq}__:{crc:08x}:{b64}'
-
     def rewind() -> None:
         nonlocal sent, resends, stale_until, last_ack_at
         resends += sent - acked
@@ -95,11 +293,11 @@ def send_chunks(data: bytes, use_crc: bool) -> int:
     while acked < number_of_chunks - 1:
         while sent - acked < WINDOW and sent < number_of_chunks - 1:
             sent += 1
-            transact(chunk_line(sent))
+            transact(chunk_line(data, sent, chunk_size, use_crc))
         line = read_line()
         now = time.time()
         n = None
-        if match := ack_pattern.search(line):
+        if match := ACK_PATTERN.search(line):
             n = int(match.group(1))
         elif '__OTB_ACK_BEGIN__' in line:
             n = -1
@@ -123,8 +321,20 @@ try:
         dev.write(f'{args.expander}.pause_broadcasts()\n'.encode())
         dev.flush()
 
-    print(f'Starting OTB to node {args.target} ({file_size} bytes)...')
+    data = firmware.read_bytes()
     started = time.time()
+    if len(args.target) > 1:
+        if data.startswith(PATCH_MAGIC):
+            raise OtbError('patch images depend on the firmware each node runs, send them to one node at a time')
+        chunk_size = min(MULTICAST_CHUNK_SIZE, args.chunk_size or MULTICAST_CHUNK_SIZE) // 16 * 16
+        print(f'Starting multicast OTB to nodes {args.target} ({file_size} bytes)...')
+        updated, failed = send_multicast(data, args.target, chunk_size)
+        for target, error in failed.items():
+            print(f'Node {target} failed: {error}')
+        print(f'Updated {len(updated)}/{len(args.target)} nodes in {time.time() - started:.1f}s.')
+        sys.exit(1 if failed else 0)
+
+    print(f'Starting OTB to node {args.target[0]} ({file_size} bytes)...')
     for attempt in range(3):  # the begin frame can fall into a still-booting target
         try:
             begin_ack = transact('__OTB_BEGIN__', '__OTB_ACK_BEGIN__')
@@ -132,12 +342,23 @@ try:
         except OtbTimeout:
             if attempt == 2:
                 raise
-    use_crc = '__OTB_ACK_BEGIN__:crc32' in begin_ack  # older targets neither advertise nor accept the CRC field
+    capabilities = parse_capabilities(begin_ack)
+    use_crc = 'crc32' in capabilities  # older targets neither advertise nor accept the CRC field
     if not use_crc:
         print('Target does not support chunk CRCs, relying on the image checksum only.')
+    if data.startswith(PATCH_MAGIC) and 'patch' not in capabilities:
+        raise OtbError('target does not support patch images, send the plain firmware binary instead')
+    chunk_size = int(capabilities.get('chunk', CHUNK_SIZE))
+    if args.chunk_size:
+        chunk_size = min(chunk_size, args.chunk_size)
+    number_of_chunks = (file_size + chunk_size - 1) // chunk_size
 
-    resends = send_chunks(firmware.read_bytes(), use_crc)
-    print(f'\rSent {number_of_chunks}/{number_of_chunks} chunks ({resends} resends).      ')
+    if 'sack' in capabilities and use_crc:
+        resends = send_chunks_selective(data, number_of_chunks, chunk_size, int(capabilities['sack']))
+    else:
+        print('Target does not support selective acknowledgements, resending whole windows.')
+        resends = send_chunks(data, number_of_chunks, chunk_size, use_crc)
+    print(f'\rSent {number_of_chunks}/{number_of_chunks} chunks ({resends} resends).                ')
 
     print('Committing image...')
     transact('__OTB_COMMIT__', '__OTB_ACK_COMMIT__')
@@ -147,12 +368,14 @@ try:
 
 except OtbError as e:
     print(f'\nTransmission failed: {e}')
-    transact('__OTB_ABORT__')
+    for node in args.target:
+        transact('__OTB_ABORT__', target=node)
     sys.exit(1)
 
 except KeyboardInterrupt:
     print('\nInterrupted')
-    transact('__OTB_ABORT__')
+    for node in args.target:
+        transact('__OTB_ABORT__', target=node)
     sys.exit(1)
 
 finally:
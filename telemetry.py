@@ -0,0 +1,372 @@
+#!/usr/bin/env python3
+import argparse
+import binascii
+import struct
+import sys
+import time
+from dataclasses import dataclass, field
+
+import serial
+
+PACKET_SCHEMA = 0x01  # must match PACKET_SCHEMA in main/utils/telemetry.h
+PACKET_SAMPLE = 0x02  # must match PACKET_SAMPLE in main/utils/telemetry.h
+PACKET_RECORDING_HEADER = 0x03
+PACKET_RECORDING_DATA = 0x04
+PACKET_COMMAND = 0x05
+PACKET_ACK = 0x06
+PACKET_NACK = 0x07
+FLAG_NEW_SESSION = 0x01
+ACK_OK, ACK_ERROR, ACK_DUPLICATE = 0, 1, 2
+NO_TRIGGER = 0xffffffff
+FLAG_TIMESTAMPS = 0x01
+TYPE_BOOLEAN, TYPE_INTEGER, TYPE_NUMBER, TYPE_STRING = 1, 2, 4, 8  # Lizard's Type enum in compilation/type.h
+
+
+class TelemetryError(Exception):
+    pass
+
+
+@dataclass
+class Element:
+    type: int
+    precision: int
+    name: str
+
+
+@dataclass
+class Schema:
+    id: int
+    timestamps: bool
+    elements: list[Element] = field(default_factory=list)
+
+
+@dataclass
+class Sample:
+    schema: Schema
+    sequence: int
+    timestamp_us: int | None
+    values: list
+
+
+@dataclass
+class RecordingHeader:
+    recorder: str
+    first_sample: int
+    end_sample: int
+    trigger_sample: int | None
+    length: int
+    elements: list[Element] = field(default_factory=list)
+
+
+@dataclass
+class RecordingData:
+    offset: int
+    data: bytes
+
+
+@dataclass
+class Ack:
+    sequence: int
+    status: int
+
+
+@dataclass
+class Nack:
+    expected_sequence: int
+    reason: int
+
+
+def cobs_encode(data: bytes) -> bytes:
+    output = bytearray()
+    block = bytearray()
+    for byte in data:
+        if byte == 0:
+            output += bytes([len(block) + 1]) + block
+            block.clear()
+        else:
+            block.append(byte)
+            if len(block) == 0xfe:
+                output += b'\xff' + block
+                block.clear()
+    output += bytes([len(block) + 1]) + block
+    return bytes(output)
+
+
+def encode_command(sequence: int, statements: str, new_session: bool = False) -> bytes:
+    """Encodes Lizard statements (separated by newlines) as a command frame for UART0."""
+    payload = struct.pack('<BBH', PACKET_COMMAND, FLAG_NEW_SESSION if new_session else 0, sequence % 0x10000)
+    payload += statements.encode()
+    payload += struct.pack('<H', binascii.crc_hqx(payload, 0xffff))
+    return b'\x00' + cobs_encode(payload) + b'\x00\n'
+
+
+def cobs_decode(data: bytes) -> bytes:
+    output = bytearray()
+    i = 0
+    while i < len(data):
+        code = data[i]
+        if code == 0 or i + code > len(data):
+            raise TelemetryError('invalid COBS frame')
+        output += data[i + 1:i + code]
+        i += code
+        if code < 0xff and i < len(data):
+            output.append(0)
+    return bytes(output)
+
+
+def read_varint(data: bytes, pos: int) -> tuple[int, int]:
+    value = shift = 0
+    while True:
+        byte = data[pos]
+        pos += 1
+        value |= (byte & 0x7f) << shift
+        shift += 7
+        if byte < 0x80:
+            return (value >> 1) ^ -(value & 1), pos
+
+
+def decode_recording(header: RecordingHeader, data: bytes) -> list[list]:
+    """Decodes the block stream of a recorder dump into rows of [sample index, time (us), values...]."""
+    rows = []
+    pos = 0
+    while pos < len(data):
+        block_length = struct.unpack_from('<H', data, pos)[0]
+        block = data[pos + 2:pos + 2 + block_length]
+        pos += 2 + block_length
+        count, first_sample = struct.unpack_from('<BI', block, 0)
+        columns = []
+        p = 5
+        for _ in range(len(header.elements) + 1):
+            values = []
+            for i in range(count):
+                value, p = read_varint(block, p)
+                if i > 0:
+                    value = (values[-1] + value + 2**63) % 2**64 - 2**63
+                values.append(value)
+            columns.append(values)
+        for i in range(count):
+            if first_sample + i < header.first_sample:
+                continue
+            row = [first_sample + i, columns[0][i]]
+            for element, values in zip(header.elements, columns[1:]):
+                if element.type == TYPE_BOOLEAN:
+                    row.append(bool(values[i]))
+                elif element.type == TYPE_NUMBER:
+                    row.append(values[i] / 10**element.precision)
+                else:
+                    row.append(values[i])
+            rows.append(row)
+    return rows
+
+
+class Decoder:
+    """Splits the UART0 stream into text lines and binary telemetry frames and decodes the latter.
+
+    A binary frame is `0x00 <COBS(payload + crc16)> 0x00`; text lines never contain NUL bytes.
+    """
+
+    def __init__(self) -> None:
+        self.buffer = bytearray()
+        self.schema: Schema | None = None
+        self.last_sequence: int | None = None
+        self.lost_samples = 0
+        self.bad_frames = 0
+
+    def feed(self, data: bytes) -> list[str | Schema | Sample]:
+        self.buffer += data
+        results = []
+        while self.buffer:
+            if self.buffer[0] == 0:
+                end = self.buffer.find(b'\x00', 1)
+                if end < 0:
+                    break
+                frame = bytes(self.buffer[1:end])
+                del self.buffer[:end + 1]
+                if not frame:
+                    continue  # two delimiters in a row: the trailing one of a frame we resynchronized on
+                try:
+                    results.append(self.decode_frame(frame))
+                except TelemetryError:
+                    self.bad_frames += 1
+            else:
+                end = min((i for i in (self.buffer.find(b'\n'), self.buffer.find(b'\x00')) if i >= 0), default=-1)
+                if end < 0:
+                    break
+                line = bytes(self.buffer[:end])
+                del self.buffer[:end + 1 if self.buffer[end] == ord('\n') else end]
+                results.append(line.decode(errors='replace').rstrip('\r'))
+        return results
+
+    def decode_frame(self, frame: bytes) -> Schema | Sample | RecordingHeader | RecordingData | Ack | Nack:
+        packet = cobs_decode(frame)
+        if len(packet) < 4:
+            raise TelemetryError('frame too short')
+        payload, crc = packet[:-2], struct.unpack('<H', packet[-2:])[0]
+        if binascii.crc_hqx(payload, 0xffff) != crc:
+            raise TelemetryError('CRC mismatch')
+        if payload[0] == PACKET_SCHEMA:
+            return self.decode_schema(payload)
+        if payload[0] == PACKET_SAMPLE:
+            return self.decode_sample(payload)
+        if payload[0] == PACKET_RECORDING_HEADER:
+            return self.decode_recording_header(payload)
+        if payload[0] == PACKET_RECORDING_DATA:
+            return RecordingData(offset=struct.unpack_from('<I', payload, 1)[0], data=payload[5:])
+        if payload[0] == PACKET_ACK:
+            return Ack(*struct.unpack_from('<HB', payload, 1))
+        if payload[0] == PACKET_NACK:
+            return Nack(*struct.unpack_from('<HB', payload, 1))
+        raise TelemetryError(f'unknown packet type {payload[0]}')
+
+    def decode_schema(self, payload: bytes) -> Schema:
+        schema = Schema(id=payload[1], timestamps=bool(payload[2] & FLAG_TIMESTAMPS))
+        pos = 4
+        for _ in range(payload[3]):
+            type_, precision, length = payload[pos:pos + 3]
+            name = payload[pos + 3:pos + 3 + length].decode(errors='replace')
+            schema.elements.append(Element(type_, precision, name))
+            pos += 3 + length
+        self.schema = schema
+        self.last_sequence = None
+        return schema
+
+    def decode_recording_header(self, payload: bytes) -> RecordingHeader:
+        length = payload[1]
+        name = payload[2:2 + length].decode(errors='replace')
+        pos = 2 + length
+        first_sample, end_sample, trigger_sample, stream_length, count = struct.unpack_from('<IIIIB', payload, pos)
+        header = RecordingHeader(name, first_sample, end_sample,
+                                 None if trigger_sample == NO_TRIGGER else trigger_sample, stream_length)
+        pos += 17
+        for _ in range(count):
+            type_, precision, length = payload[pos:pos + 3]
+            header.elements.append(Element(type_, precision, payload[pos + 3:pos + 3 + length].decode(errors='replace')))
+            pos += 3 + length
+        return header
+
+    def decode_sample(self, payload: bytes) -> Sample:
+        if self.schema is None or self.schema.id != payload[1]:
+            raise TelemetryError('sample for unknown schema (call core.output_mode("binary") again to re-announce it)')
+        sequence = payload[2]
+        if self.last_sequence is not None:
+            self.lost_samples += (sequence - self.last_sequence - 1) % 256
+        self.last_sequence = sequence
+        pos = 3
+        timestamp_us = None
+        if self.schema.timestamps:
+            timestamp_us = struct.unpack_from('<I', payload, pos)[0]
+            pos += 4
+        values = []
+        for element in self.schema.elements:
+            if element.type == TYPE_BOOLEAN:
+                values.append(bool(payload[pos]))
+                pos += 1
+            elif element.type == TYPE_INTEGER:
+                values.append(struct.unpack_from('<i', payload, pos)[0])
+                pos += 4
+            elif element.type == TYPE_NUMBER:
+                values.append(round(struct.unpack_from('<f', payload, pos)[0], element.precision))
+                pos += 4
+            elif element.type == TYPE_STRING:
+                length = payload[pos]
+                values.append(payload[pos + 1:pos + 1 + length].decode(errors='replace'))
+                pos += 1 + length
+            else:
+                raise TelemetryError(f'unknown element type {element.type}')
+        return Sample(self.schema, sequence, timestamp_us, values)
+
+
+def send_commands(port: serial.Serial, decoder: Decoder, commands: list[str], window: int = 8, timeout: float = 1.0) -> int:
+    """Sends each command as a frame, keeping up to `window` frames in flight, and resends from the first
+    unacknowledged frame after a NACK or a timeout (go-back-N)."""
+    base = 0  # index of the first unacknowledged command
+    next_index = 0
+    errors = 0
+    rewound_base = None  # frames that were in flight behind a lost one are NACKed as well, rewind only once for them
+    last_progress = time.monotonic()
+    while base < len(commands):
+        while next_index < len(commands) and next_index < base + window:
+            port.write(encode_command(next_index, commands[next_index], new_session=next_index == 0))
+            next_index += 1
+        for item in decoder.feed(port.read(max(1, port.in_waiting))):
+            if isinstance(item, Ack) and (item.sequence - base) % 0x10000 < next_index - base:
+                if item.status == ACK_ERROR:
+                    errors += 1
+                base = max(base, base + (item.sequence - base) % 0x10000 + 1)
+                last_progress = time.monotonic()
+            elif isinstance(item, Nack) and rewound_base != base:
+                next_index = base
+                rewound_base = base
+                last_progress = time.monotonic()
+            elif isinstance(item, str) and item:
+                print(item)
+        if time.monotonic() - last_progress > timeout:
+            next_index = base
+            rewound_base = base
+            last_progress = time.monotonic()
+    return 1 if errors else 0
+
+
+def dump_recording(port: serial.Serial, decoder: Decoder, recorder: str) -> int:
+    port.write(f'{recorder}.dump()\n'.encode())
+    header: RecordingHeader | None = None
+    data = bytearray()
+    while header is None or len(data) < header.length:
+        chunk = port.read(max(1, port.in_waiting))
+        if not chunk and header is None:
+            continue
+        for item in decoder.feed(chunk):
+            if isinstance(item, RecordingHeader) and item.recorder == recorder:
+                header = item
+                data.clear()
+            elif isinstance(item, RecordingData) and header is not None:
+                if item.offset != len(data):
+                    print(f'error: lost recording data at offset {len(data)}', file=sys.stderr)
+                    return 1
+                data += item.data
+            elif isinstance(item, str) and item.startswith('error'):
+                print(item, file=sys.stderr)
+                return 1
+    print(','.join(['sample', 'time_us'] + [element.name for element in header.elements]))
+    for row in decode_recording(header, bytes(data)):
+        print(','.join(str(value) for value in row))
+    if header.trigger_sample is not None:
+        print(f'trigger at sample {header.trigger_sample}', file=sys.stderr)
+    return 0
+
+
+def main() -> int:
+    parser = argparse.ArgumentParser(description='Decode binary core.output telemetry (see core.output_mode)')
+    parser.add_argument('device', help='Serial device path (e.g., /dev/ttyUSB0)')
+    parser.add_argument('--baud', type=int, default=115200, help='Baud rate (default: 115200)')
+    parser.add_argument('--timestamps', action='store_true', help='Include device timestamps in the samples')
+    parser.add_argument('--dump', metavar='RECORDER', help='Dump the given Recorder module as CSV and exit')
+    parser.add_argument('--send', metavar='STATEMENT', action='append',
+                        help='Send statements as acknowledged command frames and exit (can be repeated)')
+    args = parser.parse_args()
+
+    decoder = Decoder()
+    with serial.Serial(args.device, baudrate=args.baud, timeout=0.1) as port:
+        if args.dump:
+            return dump_recording(port, decoder, args.dump)
+        if args.send:
+            return send_commands(port, decoder, args.send)
+        port.write(f'core.output_mode("binary", {"true" if args.timestamps else "false"})\n'.encode())
+        try:
+            while True:
+                for item in decoder.feed(port.read(max(1, port.in_waiting))):
+                    if isinstance(item, Schema):
+                        print('schema:', ' '.join(element.name for element in item.elements))
+                    elif isinstance(item, Sample):
+                        prefix = f'{item.timestamp_us} ' if item.timestamp_us is not None else ''
+                        print(prefix + ' '.join(str(value) for value in item.values))
+                    elif item:
+                        print(item)
+        except KeyboardInterrupt:
+            print(f'\n{decoder.lost_samples} lost samples, {decoder.bad_frames} bad frames')
+            port.write(b'core.output_mode("text")\n')
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,60 @@
+// Compares the lookup of received CAN frames in CanDispatchTable with the std::map that Can used before.
+// Traffic of 8 ODrive and 8 CANopen nodes plus 16 extended ids, a quarter of the frames is for nobody.
+#include "../../main/utils/can_dispatch.h"
+#include <chrono>
+#include <cstdio>
+#include <map>
+#include <random>
+#include <vector>
+
+class Module {};
+
+template <typename F>
+static double measure(const char *name, const std::vector<uint32_t> &frames, const F &lookup) {
+    const int rounds = 200;
+    size_t hits = 0;
+    const auto start = std::chrono::steady_clock::now();
+    for (int round = 0; round < rounds; ++round) {
+        for (const uint32_t id : frames) {
+            hits += lookup(id);
+        }
+    }
+    const std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+    const double ns = elapsed.count() / rounds / frames.size();
+    printf("%-18s %6.1f ns/frame  (%zu hits)\n", name, ns, hits);
+    return ns;
+}
+
+int main() {
+    std::vector<uint32_t> ids;
+    for (uint32_t node = 0; node < 8; ++node) {
+        for (const uint32_t command : {0x01, 0x03, 0x09, 0x14, 0x17}) {
+            ids.push_back(node << 5 | command); // ODrive
+        }
+        for (const uint32_t base : {0x180, 0x280, 0x580, 0x700}) {
+            ids.push_back(base + 0x10 + node); // CANopen TPDOs, SDO response and heartbeat
+        }
+    }
+    for (uint32_t i = 0; i < 16; ++i) {
+        ids.push_back(0x18ff0000 | i << 8 | 0x42);
+    }
+
+    const Module_ptr module = std::make_shared<Module>();
+    CanDispatchTable table;
+    std::map<uint32_t, Module_ptr> map;
+    for (const uint32_t id : ids) {
+        table.add(id, module);
+        map[id] = module;
+    }
+
+    std::mt19937 random(0);
+    std::vector<uint32_t> frames(100000);
+    for (uint32_t &id : frames) {
+        id = random() % 4 ? ids[random() % ids.size()] : (random() % 2 ? random() % 0x800 : random() & 0x1fffffff);
+    }
+
+    const double map_ns = measure("std::map", frames, [&](uint32_t id) { return map.count(id) ? 1 : 0; });
+    const double table_ns = measure("CanDispatchTable", frames, [&](uint32_t id) { return table.find(id) ? 1 : 0; });
+    printf("speedup: %.1fx for %zu ids\n", map_ns / table_ns, ids.size());
+    return 0;
+}
@@ -0,0 +1,49 @@
+// Compares format_number and format_integer with snprintf on the host, e.g. before and after a change.
+// Not a test, the absolute numbers only indicate the relative cost on the ESP32.
+#include "../../main/utils/number_format.h"
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+template <typename F>
+static double measure(const char *name, const F &format) {
+    const int rounds = 1000000;
+    char buffer[64];
+    size_t checksum = 0;
+    const auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < rounds; ++i) {
+        checksum += format(buffer, sizeof(buffer), i);
+    }
+    const std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+    const double ns = elapsed.count() / rounds;
+    printf("%-28s %8.1f ns/call  (%zu)\n", name, ns, checksum);
+    return ns;
+}
+
+int main() {
+    std::mt19937_64 random(0);
+    std::uniform_real_distribution<double> distribution(-1000.0, 1000.0);
+    std::vector<double> numbers(1024);
+    std::vector<int64_t> integers(1024);
+    for (size_t i = 0; i < numbers.size(); ++i) {
+        numbers[i] = distribution(random);
+        integers[i] = static_cast<int64_t>(random() >> (random() % 64));
+    }
+
+    const double printf_number = measure("snprintf(\"%.3f\")", [&](char *buffer, size_t size, int i) {
+        return snprintf(buffer, size, "%.3f", numbers[i % numbers.size()]);
+    });
+    const double fast_number = measure("format_number(3)", [&](char *buffer, size_t size, int i) {
+        return format_number(buffer, size, numbers[i % numbers.size()], 3);
+    });
+    const double printf_integer = measure("snprintf(\"%lld\")", [&](char *buffer, size_t size, int i) {
+        return snprintf(buffer, size, "%" PRId64, integers[i % integers.size()]);
+    });
+    const double fast_integer = measure("format_integer", [&](char *buffer, size_t size, int i) {
+        return format_integer(buffer, size, integers[i % integers.size()]);
+    });
+    printf("speedup: %.1fx numbers, %.1fx integers\n", printf_number / fast_number, printf_integer / fast_integer);
+    return 0;
+}
@@ -0,0 +1,80 @@
+#undef NDEBUG
+#include "../../main/utils/can_dispatch.h"
+#include <algorithm>
+#include <cassert>
+#include <cstdio>
+#include <map>
+#include <random>
+
+class Module {};
+
+static bool contains(const CanDispatchTable::Subscribers *subscribers, const Module_ptr &module) {
+    return subscribers && std::find(subscribers->begin(), subscribers->end(), module) != subscribers->end();
+}
+
+static void test_standard_and_extended() {
+    CanDispatchTable table;
+    const Module_ptr a = std::make_shared<Module>(), b = std::make_shared<Module>();
+    table.add(0x000, a);
+    table.add(0x7ff, b);
+    table.add(0x800, a);
+    table.add(0x1fffffff, b);
+    assert(contains(table.find(0x000), a) && table.find(0x000)->size() == 1);
+    assert(contains(table.find(0x7ff), b) && table.find(0x7ff)->size() == 1);
+    assert(contains(table.find(0x800), a) && table.find(0x800)->size() == 1);
+    assert(contains(table.find(0x1fffffff), b) && table.find(0x1fffffff)->size() == 1);
+    assert(!table.find(0x001) && !table.find(0x801) && !table.find(0x1ffffffe));
+    assert((table.get_ids() == std::vector<uint32_t>{0x000, 0x7ff, 0x800, 0x1fffffff}));
+}
+
+// e.g. several CANopen modules listening to the same heartbeat
+static void test_several_subscribers() {
+    for (const uint32_t id : {0x701u, 0x18ff0001u}) {
+        CanDispatchTable table;
+        const Module_ptr a = std::make_shared<Module>(), b = std::make_shared<Module>(), c = std::make_shared<Module>();
+        table.add(id, a);
+        table.add(id, b);
+        table.add(id, a); // subscribing twice is a no-op
+        table.add(id, c);
+        const CanDispatchTable::Subscribers *subscribers = table.find(id);
+        assert(subscribers && (*subscribers == CanDispatchTable::Subscribers{a, b, c}));
+        assert(table.get_ids().size() == 1);
+        assert(!contains(table.find(id + 1), a));
+    }
+}
+
+// compares with a std::map while the hash table grows, including colliding ids
+static void test_random() {
+    CanDispatchTable table;
+    std::map<uint32_t, CanDispatchTable::Subscribers> expected;
+    std::vector<Module_ptr> modules;
+    for (int i = 0; i < 8; ++i) {
+        modules.push_back(std::make_shared<Module>());
+    }
+    std::mt19937 random(0);
+    for (int i = 0; i < 5000; ++i) {
+        const uint32_t id = random() % 4 ? random() % 0x1000 : (random() & 0x1fffffff);
+        const Module_ptr &module = modules[random() % modules.size()];
+        table.add(id, module);
+        CanDispatchTable::Subscribers &list = expected[id];
+        if (std::find(list.begin(), list.end(), module) == list.end()) {
+            list.push_back(module);
+        }
+    }
+    for (const auto &[id, list] : expected) {
+        assert(table.find(id) && *table.find(id) == list);
+    }
+    for (int i = 0; i < 100000; ++i) {
+        const uint32_t id = random() & 0x1fffffff;
+        assert((table.find(id) != nullptr) == (expected.count(id) > 0));
+    }
+    assert(table.get_ids().size() == expected.size());
+}
+
+int main() {
+    test_standard_and_extended();
+    test_several_subscribers();
+    test_random();
+    printf("can_dispatch: ok\n");
+    return 0;
+}
@@ -0,0 +1,95 @@
+#undef NDEBUG
+#include "../../main/utils/can_tx_queue.h"
+#include <cassert>
+#include <cstdio>
+#include <vector>
+
+static CanTxQueue::Frame frame(const uint32_t id, const uint8_t value = 0, const unsigned long deadline = 100) {
+    CanTxQueue::Frame frame{};
+    frame.id = id;
+    frame.data[0] = value;
+    frame.dlc = 1;
+    frame.deadline = deadline;
+    return frame;
+}
+
+static std::vector<CanTxQueue::Frame> transmit(CanTxQueue &queue, const size_t free_slots, const bool include_setpoints,
+                                               const unsigned long now = 0) {
+    std::vector<CanTxQueue::Frame> sent;
+    queue.transmit(free_slots, now, include_setpoints, [&sent](const CanTxQueue::Frame &frame) {
+        sent.push_back(frame);
+        return true;
+    });
+    return sent;
+}
+
+static void test_priorities() {
+    CanTxQueue queue(16);
+    queue.push(CanTxQueue::DIAGNOSTIC, frame(4));
+    queue.push(CanTxQueue::CONFIG, frame(3));
+    queue.push(CanTxQueue::SETPOINT, frame(2));
+    queue.push(CanTxQueue::SAFETY, frame(1));
+    std::vector<CanTxQueue::Frame> sent = transmit(queue, 16, false);
+    assert(sent.size() == 3 && sent[0].id == 1 && sent[1].id == 3 && sent[2].id == 4); // setpoints are held
+    sent = transmit(queue, 16, true);
+    assert(sent.size() == 1 && sent[0].id == 2);
+}
+
+static void test_reserved_slots() {
+    for (const size_t driver_queue_len : {1, 2, 4, 8, 20}) {
+        CanTxQueue queue(driver_queue_len);
+        queue.push(CanTxQueue::CONFIG, frame(1));
+        const size_t reserved = std::min(CanTxQueue::RESERVED_SLOTS, driver_queue_len / 2);
+        assert(transmit(queue, reserved, true).empty());
+        assert(transmit(queue, reserved + 1, true).size() == 1);
+    }
+}
+
+static void test_setpoints() {
+    CanTxQueue queue(16);
+    queue.push(CanTxQueue::SETPOINT, frame(0x00d, 1));
+    queue.push(CanTxQueue::SETPOINT, frame(0x02d, 2));
+    queue.push(CanTxQueue::SETPOINT, frame(0x00d, 3)); // replaces the first
+    assert(queue.get_metrics(CanTxQueue::SETPOINT).coalesced == 1);
+    std::vector<CanTxQueue::Frame> sent = transmit(queue, 16, true);
+    assert(sent.size() == 2 && sent[0].id == 0x00d && sent[0].data[0] == 3 && sent[1].id == 0x02d);
+
+    queue.push(CanTxQueue::SETPOINT, frame(0x00d, 4, 10));
+    assert(transmit(queue, 16, true, 11).empty());
+    assert(queue.get_metrics(CanTxQueue::SETPOINT).stale == 1);
+}
+
+// a stop command must not be followed by a setpoint for the same node that was queued before it
+static void test_safety_cancels_setpoints() {
+    CanTxQueue queue(16);
+    queue.push(CanTxQueue::SETPOINT, frame(0x00d)); // node 0
+    queue.push(CanTxQueue::SETPOINT, frame(0x02d)); // node 1
+    queue.push(CanTxQueue::SETPOINT, frame(0x00c)); // node 0
+    queue.push(CanTxQueue::SETPOINT, frame(0x04c)); // node 2
+    queue.push(CanTxQueue::SAFETY, frame(0x007), 0x7e0);
+    assert(queue.get_metrics(CanTxQueue::SETPOINT).queued == 2);
+    std::vector<CanTxQueue::Frame> sent = transmit(queue, 16, true);
+    assert(sent.size() == 3 && sent[0].id == 0x007 && sent[1].id == 0x02d && sent[2].id == 0x04c);
+
+    // without a node mask, safety frames leave the setpoints alone
+    queue.push(CanTxQueue::SETPOINT, frame(0x00d));
+    queue.push(CanTxQueue::SAFETY, frame(0x007));
+    assert(transmit(queue, 16, true).size() == 2);
+
+    // a dropped safety frame cancels nothing
+    for (int i = 0; i < 8; ++i) {
+        assert(queue.push(CanTxQueue::SAFETY, frame(0x027)));
+    }
+    queue.push(CanTxQueue::SETPOINT, frame(0x00d));
+    assert(!queue.push(CanTxQueue::SAFETY, frame(0x007), 0x7e0));
+    assert(queue.get_metrics(CanTxQueue::SETPOINT).queued == 1);
+}
+
+int main() {
+    test_priorities();
+    test_reserved_slots();
+    test_setpoints();
+    test_safety_cancels_setpoints();
+    printf("can_tx_queue: ok\n");
+    return 0;
+}
@@ -0,0 +1,300 @@
+#undef NDEBUG
+#include "../../main/utils/image_patch.h"
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+using Bytes = std::vector<uint8_t>;
+using image_patch::Decoder;
+
+static std::mt19937 random_engine(0);
+
+static size_t random_below(const size_t limit) {
+    return std::uniform_int_distribution<size_t>(0, limit - 1)(random_engine);
+}
+
+static Bytes random_bytes(const size_t length) {
+    Bytes data(length);
+    for (uint8_t &byte : data) {
+        byte = random_below(256);
+    }
+    return data;
+}
+
+static void put_u32(Bytes &data, const uint32_t value) {
+    for (int i = 0; i < 4; ++i) {
+        data.push_back(value >> (8 * i));
+    }
+}
+
+static void put_varint(Bytes &data, uint32_t value) {
+    while (value >= 0x80) {
+        data.push_back((value & 0x7f) | 0x80);
+        value >>= 7;
+    }
+    data.push_back(value);
+}
+
+static void put_op(Bytes &data, const uint8_t op, const uint32_t length) {
+    if (length < 64) {
+        data.push_back(op << 6 | length);
+    } else {
+        data.push_back(op << 6);
+        put_varint(data, length);
+    }
+}
+
+static Bytes header(const uint32_t output_size, const uint32_t base_size) {
+    Bytes data(image_patch::MAGIC, image_patch::MAGIC + sizeof(image_patch::MAGIC));
+    data.push_back(image_patch::VERSION);
+    data.push_back(image_patch::WINDOW_BITS);
+    data.push_back(0);
+    data.push_back(0);
+    put_u32(data, output_size);
+    put_u32(data, base_size);
+    data.resize(image_patch::HEADER_SIZE); // the decoder does not check the SHA-256
+    return data;
+}
+
+// Builds a patch of random literals, base copies (forwards and backwards) and output copies (including runs).
+static Bytes random_patch(const Bytes &base, const size_t op_count, Bytes &image) {
+    Bytes ops;
+    uint32_t base_end = 0;
+    image.clear();
+    for (size_t i = 0; i < op_count; ++i) {
+        const size_t kind = random_below(3);
+        const uint32_t length = 1 + random_below(random_below(4) == 0 ? 5000 : 70);
+        if (kind == 1 && base.size() >= length) {
+            const uint32_t offset = random_below(base.size() - length + 1);
+            const int64_t relative = static_cast<int64_t>(offset) - base_end;
+            put_op(ops, 1, length);
+            put_varint(ops, relative < 0 ? static_cast<uint32_t>(-relative * 2 - 1) : static_cast<uint32_t>(relative * 2));
+            image.insert(image.end(), base.begin() + offset, base.begin() + offset + length);
+            base_end = offset + length;
+        } else if (kind == 2 && !image.empty()) {
+            const uint32_t distance = 1 + random_below(std::min(image.size(), image_patch::WINDOW_SIZE));
+            put_op(ops, 2, length);
+            put_varint(ops, distance - 1);
+            for (uint32_t k = 0; k < length; ++k) {
+                image.push_back(image[image.size() - distance]);
+            }
+        } else {
+            const Bytes literal = random_bytes(length);
+            put_op(ops, 0, length);
+            ops.insert(ops.end(), literal.begin(), literal.end());
+            image.insert(image.end(), literal.begin(), literal.end());
+        }
+    }
+    Bytes patch = header(image.size(), base.size());
+    patch.insert(patch.end(), ops.begin(), ops.end());
+    return patch;
+}
+
+// Feeds the patch in pieces of random size, or of the given size; throws on malformed patches.
+static Bytes decode(const Bytes &patch, const Bytes &base, const size_t chunk_size = 0, bool *finished = nullptr) {
+    Bytes output;
+    Decoder decoder(
+        [&base](uint32_t offset, uint8_t *data, size_t length) {
+            if (offset + length > base.size()) {
+                return false;
+            }
+            std::memcpy(data, &base[offset], length);
+            return true;
+        },
+        [&output](const uint8_t *data, size_t length) {
+            output.insert(output.end(), data, data + length);
+            return true;
+        });
+    for (size_t i = 0; i < patch.size();) {
+        const size_t n = std::min(patch.size() - i, chunk_size ? chunk_size : 1 + random_below(300));
+        decoder.feed(&patch[i], n);
+        i += n;
+    }
+    assert(output.size() <= decoder.get_output_size());
+    if (finished) {
+        *finished = decoder.is_finished();
+    } else {
+        assert(decoder.is_finished());
+        assert(output.size() == decoder.get_output_size());
+    }
+    return output;
+}
+
+static bool throws(const Bytes &patch, const Bytes &base = {}) {
+    try {
+        bool finished;
+        decode(patch, base, 0, &finished);
+    } catch (const std::runtime_error &) {
+        return true;
+    }
+    return false;
+}
+
+static void test_round_trip() {
+    for (int i = 0; i < 200; ++i) {
+        const Bytes base = random_bytes(random_below(2) ? 0 : random_below(20000));
+        Bytes image;
+        const Bytes patch = random_patch(base, 1 + random_below(50), image);
+        assert(decode(patch, base) == image);
+        assert(decode(patch, base, 1) == image);
+        assert(decode(patch, base, patch.size()) == image);
+    }
+}
+
+static void test_empty_image() {
+    const Bytes patch = header(0, 0);
+    assert(decode(patch, {}).empty());
+    Bytes trailing = patch;
+    trailing.push_back(0x01);
+    assert(throws(trailing));
+}
+
+static void test_malformed() {
+    Bytes image;
+    const Bytes base = random_bytes(1000);
+    const Bytes valid = random_patch(base, 20, image);
+
+    Bytes patch = valid;
+    patch[0] = 'X'; // magic
+    assert(throws(patch, base));
+    patch = valid;
+    patch[4] = image_patch::VERSION + 1;
+    assert(throws(patch, base));
+    patch = valid;
+    patch[5] = image_patch::WINDOW_BITS + 1;
+    assert(throws(patch, base));
+
+    Bytes trailing = valid;
+    trailing.push_back(0x01);
+    assert(throws(trailing, base));
+
+    bool finished = true;
+    decode(Bytes(valid.begin(), valid.end() - 1), base, 0, &finished); // truncated
+    assert(!finished);
+
+    patch = header(10, 0);
+    patch.push_back(3 << 6 | 1); // invalid op
+    assert(throws(patch));
+
+    patch = header(10, 0);
+    put_op(patch, 0, 11); // longer than the image
+    assert(throws(patch));
+
+    patch = header(10, 0);
+    put_op(patch, 0, 0); // zero length after varint
+    patch.push_back(0);
+    assert(throws(patch));
+
+    patch = header(10, 0);
+    patch.push_back(0);
+    for (int i = 0; i < 5; ++i) {
+        patch.push_back(0xff); // varint overflow
+    }
+    assert(throws(patch));
+
+    patch = header(10, 100);
+    put_op(patch, 1, 10);
+    put_varint(patch, 1); // offset -1
+    assert(throws(patch, random_bytes(100)));
+
+    patch = header(10, 100);
+    put_op(patch, 1, 10);
+    put_varint(patch, 2 * 91); // beyond the end of the base
+    assert(throws(patch, random_bytes(100)));
+
+    patch = header(10, 0);
+    put_op(patch, 0, 1);
+    patch.push_back('a');
+    put_op(patch, 2, 9);
+    put_varint(patch, 1); // distance 2 at position 1
+    assert(throws(patch));
+
+    patch = header(image_patch::WINDOW_SIZE + 10, 0);
+    put_op(patch, 0, image_patch::WINDOW_SIZE + 1);
+    const Bytes literal = random_bytes(image_patch::WINDOW_SIZE + 1);
+    patch.insert(patch.end(), literal.begin(), literal.end());
+    put_op(patch, 2, 9);
+    put_varint(patch, image_patch::WINDOW_SIZE); // distance beyond the window
+    assert(throws(patch));
+
+    Decoder failing_read([](uint32_t, uint8_t *, size_t) { return false; }, [](const uint8_t *, size_t) { return true; });
+    patch = header(10, 100);
+    put_op(patch, 1, 10);
+    put_varint(patch, 0);
+    bool thrown = false;
+    try {
+        failing_read.feed(patch.data(), patch.size());
+    } catch (const std::runtime_error &) {
+        thrown = true;
+    }
+    assert(thrown);
+
+    Decoder failing_write([](uint32_t, uint8_t *, size_t) { return true; }, [](const uint8_t *, size_t) { return false; });
+    thrown = false;
+    try {
+        failing_write.feed(valid.data(), valid.size());
+    } catch (const std::runtime_error &) {
+        thrown = true;
+    }
+    assert(thrown);
+}
+
+// Random corruption must be rejected or produce at most the announced number of bytes, never access out of range.
+static void test_corrupted() {
+    for (int i = 0; i < 2000; ++i) {
+        const Bytes base = random_bytes(random_below(3000));
+        Bytes image;
+        Bytes patch = random_patch(base, 1 + random_below(20), image);
+        for (size_t k = 1 + random_below(4); k > 0; --k) {
+            const size_t position = image_patch::HEADER_SIZE + random_below(patch.size() - image_patch::HEADER_SIZE);
+            patch[position] ^= 1 << random_below(8);
+        }
+        throws(patch, base);
+    }
+}
+
+// Decodes a patch created by otb_patch.py, if its path is given on the command line.
+static void test_otb_patch(const char *python, const char *script) {
+    Bytes base = random_bytes(50000);
+    Bytes image = base;
+    for (int i = 0; i < 40; ++i) {
+        const Bytes insertion = random_bytes(random_below(200));
+        image.insert(image.begin() + random_below(image.size()), insertion.begin(), insertion.end());
+        const size_t position = random_below(image.size() - 100);
+        image.erase(image.begin() + position, image.begin() + position + random_below(100));
+    }
+    image.insert(image.end(), 3000, 0xff);
+    std::ofstream("image_patch_base.bin", std::ios::binary).write(reinterpret_cast<const char *>(base.data()), base.size());
+    std::ofstream("image_patch_image.bin", std::ios::binary).write(reinterpret_cast<const char *>(image.data()), image.size());
+    for (const bool delta : {false, true}) {
+        const std::string command = std::string(python) + " " + script + " image_patch_image.bin image_patch.bin" +
+                                    (delta ? " --base image_patch_base.bin" : "") + " > /dev/null";
+        assert(std::system(command.c_str()) == 0);
+        std::ifstream file("image_patch.bin", std::ios::binary);
+        const Bytes patch{std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>()};
+        assert(patch.size() < image.size());
+        assert(decode(patch, delta ? base : Bytes{}) == image);
+        assert(decode(patch, delta ? base : Bytes{}, 1) == image);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    assert(image_patch::is_patch(header(0, 0).data(), image_patch::HEADER_SIZE));
+    assert(!image_patch::is_patch(image_patch::MAGIC, 3));
+    test_round_trip();
+    test_empty_image();
+    test_malformed();
+    test_corrupted();
+    if (argc == 3) {
+        test_otb_patch(argv[1], argv[2]);
+    }
+    printf("image_patch: ok\n");
+    return 0;
+}
@@ -0,0 +1,129 @@
+#undef NDEBUG
+#include "../../main/utils/message_ring.h"
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+static bool push(MessageRing &ring, const std::string &record) {
+    uint8_t *const data = ring.reserve(record.size());
+    if (!data) {
+        return false;
+    }
+    std::memcpy(data, record.data(), record.size());
+    ring.commit();
+    return true;
+}
+
+static bool pop(MessageRing &ring, std::string &record) {
+    size_t length;
+    const uint8_t *const data = ring.front(length);
+    if (!data) {
+        return false;
+    }
+    record.assign(reinterpret_cast<const char *>(data), length);
+    ring.release();
+    return true;
+}
+
+static void test_capacity() {
+    for (const size_t capacity : {0, 4, 100}) {
+        bool thrown = false;
+        try {
+            MessageRing ring(capacity);
+        } catch (const std::runtime_error &) {
+            thrown = true;
+        }
+        assert(thrown);
+    }
+    MessageRing ring(64);
+    assert(ring.empty());
+    assert(!ring.reserve(61)); // record_size(61) = 68
+    assert(ring.reserve(60));  // record_size(60) = 64
+}
+
+// the skipped end of the buffer counts as used, as modelled by bus_sim.py
+static void test_wrap() {
+    MessageRing ring(64);
+    const std::string a(20, 'a'), b(20, 'b'), c(20, 'c');
+    std::string record;
+    assert(push(ring, a) && push(ring, b));
+    assert(pop(ring, record) && record == a);
+    assert(push(ring, c)); // 16 bytes skipped, starts at offset 0
+    assert(ring.get_high_water() == 64);
+    assert(!push(ring, std::string(1, 'x')));
+    assert(pop(ring, record) && record == b);
+    assert(pop(ring, record) && record == c);
+    assert(ring.empty());
+    assert(!pop(ring, record));
+}
+
+// compares the ring with the byte accounting of bus_sim.py's MessageRing on random records
+static void test_random() {
+    const size_t capacity = 256;
+    MessageRing ring(capacity);
+    std::deque<std::pair<std::string, size_t>> expected; // record and its space including a skipped end
+    size_t head = 0, tail = 0;
+    std::mt19937 random(0);
+    for (int i = 0; i < 100000; ++i) {
+        if (random() % 2) {
+            const std::string record(random() % 80, static_cast<char>('a' + i % 26));
+            const size_t size = MessageRing::record_size(record.size());
+            const size_t skip = head % capacity + size > capacity ? capacity - head % capacity : 0;
+            const bool fits = head - tail + skip + size <= capacity;
+            assert(push(ring, record) == fits);
+            if (fits) {
+                head += skip + size;
+                expected.emplace_back(record, skip + size);
+            }
+        } else {
+            std::string record;
+            assert(pop(ring, record) == !expected.empty());
+            if (!expected.empty()) {
+                assert(record == expected.front().first);
+                tail += expected.front().second;
+                expected.pop_front();
+            }
+        }
+        assert(ring.empty() == expected.empty());
+    }
+}
+
+static void test_threads() {
+    MessageRing ring(1024);
+    const int count = 200000;
+    std::thread producer([&ring]() {
+        for (int i = 0; i < count;) {
+            const std::string record = std::to_string(i) + std::string(i % 50, '.');
+            if (push(ring, record)) {
+                ++i;
+            } else {
+                std::this_thread::yield();
+            }
+        }
+    });
+    std::string record;
+    for (int i = 0; i < count;) {
+        if (pop(ring, record)) {
+            assert(record == std::to_string(i) + std::string(i % 50, '.'));
+            ++i;
+        } else {
+            std::this_thread::yield();
+        }
+    }
+    producer.join();
+    assert(ring.empty());
+}
+
+int main() {
+    test_capacity();
+    test_wrap();
+    test_random();
+    test_threads();
+    printf("message_ring: ok\n");
+    return 0;
+}
@@ -0,0 +1,92 @@
+#undef NDEBUG
+#include "../../main/utils/number_format.h"
+#include <cassert>
+#include <cinttypes>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <random>
+#include <stdexcept>
+
+static void check_integer(const int64_t value) {
+    char expected[32], actual[32];
+    const int expected_length = snprintf(expected, sizeof(expected), "%" PRId64, value);
+    const int length = format_integer(actual, sizeof(actual), value);
+    if (length != expected_length || strcmp(actual, expected) != 0) {
+        fprintf(stderr, "format_integer(%s) = \"%s\"\n", expected, actual);
+        assert(false);
+    }
+}
+
+static void check_number(const double value, const unsigned int precision) {
+    char expected[512], actual[512];
+    const int expected_length = snprintf(expected, sizeof(expected), "%.*f", static_cast<int>(precision), value);
+    const int length = format_number(actual, sizeof(actual), value, precision);
+    if (length != expected_length || strcmp(actual, expected) != 0) {
+        fprintf(stderr, "format_number(%.17g, %u) = \"%s\", expected \"%s\"\n", value, precision, actual, expected);
+        assert(false);
+    }
+}
+
+static void test_integers() {
+    for (const int64_t value : {INT64_C(0), INT64_C(1), INT64_C(-1), INT64_C(9), INT64_C(10), INT64_C(-10),
+                                INT64_C(999999999), INT64_C(1000000000), INT64_C(4294967296),
+                                std::numeric_limits<int64_t>::max(), std::numeric_limits<int64_t>::min()}) {
+        check_integer(value);
+    }
+    std::mt19937_64 random(0);
+    for (int i = 0; i < 100000; ++i) {
+        check_integer(static_cast<int64_t>(random()) >> (random() % 64));
+    }
+}
+
+static void test_numbers() {
+    const double special[] = {0.0, -0.0, 0.5, 1.5, 2.5, -2.5, 0.125, 0.375, 1e-7, -1e-7, 0.1, 0.7, 1.005,
+                              123456.789, 9.9999999, 999999.9999995, 4294967295.5, 1e15, 1.8e19, 1e20, 1e300,
+                              -1e300, 5e-324, std::numeric_limits<double>::max(), std::numeric_limits<double>::infinity(),
+                              -std::numeric_limits<double>::infinity(), std::numeric_limits<double>::quiet_NaN()};
+    for (const double value : special) {
+        for (unsigned int precision = 0; precision <= 12; ++precision) {
+            check_number(value, precision);
+        }
+    }
+    std::mt19937_64 random(0);
+    std::uniform_real_distribution<double> mantissa(-1.0, 1.0);
+    for (int i = 0; i < 200000; ++i) {
+        const double value = std::ldexp(mantissa(random), static_cast<int>(random() % 80) - 30);
+        check_number(value, random() % 11);
+    }
+    // exact binary halves at the rounding position
+    for (int i = -1000; i <= 1000; ++i) {
+        check_number(i / 8.0, 2);
+        check_number(i / 2.0, 0);
+    }
+}
+
+static void test_small_buffer() {
+    char buffer[4];
+    bool thrown = false;
+    try {
+        format_number(buffer, sizeof(buffer), 3.14159, 3);
+    } catch (const std::runtime_error &) {
+        thrown = true;
+    }
+    assert(thrown);
+    thrown = false;
+    try {
+        format_integer(buffer, sizeof(buffer), 1234);
+    } catch (const std::runtime_error &) {
+        thrown = true;
+    }
+    assert(thrown);
+    assert(format_integer(buffer, sizeof(buffer), 123) == 3 && strcmp(buffer, "123") == 0);
+}
+
+int main() {
+    test_integers();
+    test_numbers();
+    test_small_buffer();
+    printf("number_format: ok\n");
+    return 0;
+}